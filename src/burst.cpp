@@ -0,0 +1,142 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "burst.h"
+#include "format.h"
+#include "timebase.h"
+#include "log.h"
+
+namespace camera {
+
+burst::burst(uint16_t cnt, uint32_t frame_size) : cnt_(cnt), size_(frame_size)
+{
+	size_t total = (size_t) cnt * frame_size;
+
+	if (!cnt || !frame_size)
+		return;
+
+	if (!(frames_ = (struct entry *) calloc(cnt, sizeof(*frames_)))) {
+		ee("failed to allocate %u burst entries\n", cnt);
+		return;
+	}
+
+	mem_ = (uint8_t *) mmap(NULL, total, PROT_READ | PROT_WRITE,
+	 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (mem_ == MAP_FAILED) {
+		mem_ = nullptr;
+		ee("failed to map %zu bytes for %u burst frames\n", total, cnt);
+		return;
+	}
+
+	/* populated already, keep it that way, page faults cost frames */
+	if (mlock(mem_, total) == 0)
+		locked_ = true;
+	else
+		ww("burst memory not locked, errno %d\n", errno);
+
+	ii("burst of %u frames, %zu MiB preallocated\n", cnt, total >> 20);
+}
+
+burst::~burst()
+{
+	if (mem_) {
+		if (locked_)
+			munlock(mem_, (size_t) cnt_ * size_);
+		munmap(mem_, (size_t) cnt_ * size_);
+	}
+
+	free(frames_);
+}
+
+bool burst::capture(stream &s)
+{
+	struct image img;
+	uint64_t start = timebase::now();
+
+	len_ = 0;
+	gaps_ = 0;
+	while (len_ < cnt_) {
+		if (!s.get_frame(img)) {
+			s.put_frame();
+			ee("burst stopped after %u frames, no frame\n", len_);
+			return false;
+		}
+
+		struct entry *e = &frames_[len_];
+
+		if (len_ && img.id != frames_[len_ - 1].seq + 1)
+			gaps_ += img.id - frames_[len_ - 1].seq - 1;
+
+		e->seq = img.id;
+		e->bytes = img.bytes < size_ ? img.bytes : size_;
+		e->sec = img.sec;
+		e->nsec = img.nsec;
+		memcpy(mem_ + (size_t) len_ * size_, img.data, e->bytes);
+		s.put_frame();
+		len_++;
+	}
+
+	uint64_t dt = timebase::now() - start;
+
+	ii("burst of %u frames in %llu ms, seq %u..%u, %u lost\n", len_,
+	 (unsigned long long) dt / 1000000, frames_[0].seq,
+	 frames_[len_ - 1].seq, gaps_);
+	return !gaps_;
+}
+
+bool burst::write(const char *dir, uint32_t fmt)
+{
+	const struct format *f = find_format(fmt);
+	char ext[8];
+	char path[256];
+	uint64_t bytes = 0;
+	uint64_t start = timebase::now();
+	uint8_t i;
+
+	/* jpeg frames are complete files, rest is raw driver layout */
+	for (i = 0; f && f->name[i] && i < sizeof(ext) - 1; ++i)
+		ext[i] = tolower(f->name[i]);
+	ext[i] = '\0';
+	if (f && f->layout == layout::jpeg)
+		strcpy(ext, "jpg");
+
+	for (uint16_t n = 0; n < len_; ++n) {
+		struct entry *e = &frames_[n];
+		FILE *fp;
+
+		snprintf(path, sizeof(path), "%s/burst-%08u.%s", dir, e->seq,
+		 ext);
+		if (!(fp = fopen(path, "wb"))) {
+			ee("failed to open '%s', errno %d\n", path, errno);
+			return false;
+		}
+
+		if (fwrite(mem_ + (size_t) n * size_, 1, e->bytes, fp) !=
+		 e->bytes) {
+			ee("failed to write '%s'\n", path);
+			fclose(fp);
+			return false;
+		}
+
+		fclose(fp);
+		bytes += e->bytes;
+	}
+
+	uint64_t ms = (timebase::now() - start) / 1000000;
+
+	ii("%u burst frames written to %s, %llu MiB in %llu ms\n", len_, dir,
+	 (unsigned long long) bytes >> 20, (unsigned long long) ms);
+	return true;
+}
+
+} // namespace camera
@@ -0,0 +1,49 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef BURST_H
+#define BURST_H
+
+#include <stdint.h>
+
+#include "camera.h"
+
+namespace camera {
+
+static constexpr uint8_t BURST_BUFFERS = 8; /* driver side slack */
+
+/* Captures next N frames as they come from the driver into memory that is
+ * allocated, faulted in and locked upfront. Nothing is decoded or shown
+ * while burst runs, so the loop only dequeues, copies and requeues and
+ * keeps up with sensor rate. Frames are written out once burst is over.
+ */
+class burst {
+public:
+	burst(uint16_t cnt, uint32_t frame_size);
+	~burst();
+	bool valid() const { return mem_ != nullptr; }
+	bool capture(stream &);
+	bool write(const char *dir, uint32_t fmt);
+	uint32_t gaps() const { return gaps_; }
+private:
+	struct entry {
+		uint32_t seq;
+		uint32_t bytes;
+		uint64_t sec;
+		uint64_t nsec;
+	};
+	uint8_t *mem_ = nullptr;
+	struct entry *frames_ = nullptr;
+	uint16_t cnt_;
+	uint16_t len_ = 0;
+	uint32_t size_;
+	uint32_t gaps_ = 0; /* frames lost between first and last */
+	bool locked_ = false;
+};
+
+}
+
+#endif // BURST_H
@@ -16,6 +16,9 @@
 #include <sys/mman.h>
 
 #include "camera.h"
+#include "format.h"
+#include "probe.h"
+#include "timebase.h"
 #include "log.h"
 
 namespace camera {
@@ -33,8 +36,9 @@ struct buffer_view {
 struct frame {
 	uint16_t w = 0;
 	uint16_t h = 0;
-	uint8_t bufcnt;
-	struct buffer_view *buf;
+	uint32_t stride = 0;
+	uint8_t bufcnt = 0;
+	struct buffer_view *buf = nullptr;
 };
 
 class device {
@@ -45,13 +49,29 @@ public:
 		for (uint8_t i = 0; i < frame.bufcnt; ++i)
 			v4l2_munmap(frame.buf[i].data, frame.buf[i].size);
 		nop("closed video device %d\n", fd);
+		free(frame.buf);
 		v4l2_close(fd);
 	};
 	const int fd;
+	bool streaming = false;
 	struct frame frame;
 	struct v4l2_buffer buf;
 };
 
+class v4l2_stream : public stream {
+public:
+	v4l2_stream(device &dev) : dev_(dev) {}
+	~v4l2_stream() { delete &dev_; }
+	bool start() override;
+	bool stop() override;
+	void get_frame_size(uint16_t &w, uint16_t &h) override;
+	uint32_t get_buffer_size() override;
+	bool get_frame(struct image &) override;
+	void put_frame() override;
+private:
+	device &dev_;
+};
+
 static bool dev_ioctl(int fd, long req, void *arg)
 {
 	int rc;
@@ -65,6 +85,18 @@ static bool dev_ioctl(int fd, long req, void *arg)
 	return true;
 }
 
+static enum timebase::stamp stamp_type(uint32_t flags)
+{
+	switch (flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) {
+	case V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC:
+		return timebase::STAMP_MONOTONIC;
+	case V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN: /* old drivers, gettimeofday() */
+		return timebase::STAMP_REALTIME;
+	default: /* COPY, set by output side of m2m device */
+		return timebase::STAMP_NONE;
+	}
+}
+
 static int open_camera(const char* path)
 {
 	int fd;
@@ -105,6 +137,25 @@ static uint8_t set_framerate(device &dev, uint8_t fps)
 	return par.parm.capture.timeperframe.denominator;
 }
 
+static bool queue_buffers(device &dev)
+{
+	struct v4l2_buffer buf;
+
+	for (uint8_t i = 0; i < dev.frame.bufcnt; ++i) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+
+		if (!dev_ioctl(dev.fd, VIDIOC_QBUF, &buf)) {
+			ee("v4l2_ioctl VIDIOC_QBUF fd %d\n", dev.fd);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 static bool init_stream(device &dev, struct params *p)
 {
 	struct v4l2_format fmt;
@@ -124,16 +175,18 @@ static bool init_stream(device &dev, struct params *p)
 	}
 
 	if (fmt.fmt.pix.pixelformat != p->fmt) {
-		ee("requested stream format is not supported\n");
+		ee("requested stream format %s is not supported\n",
+		 format_name(p->fmt));
 		return false;
 	}
 
 	dev.frame.w = fmt.fmt.pix.width;
 	dev.frame.h = fmt.fmt.pix.height;
+	dev.frame.stride = fmt.fmt.pix.bytesperline;
 	p->w = dev.frame.w;
 	p->h = dev.frame.h;
 	memset(&req, 0, sizeof(req));
-	req.count = BUFFERS_CNT;
+	req.count = p->buffers ? p->buffers : BUFFERS_CNT;
 	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	req.memory = V4L2_MEMORY_MMAP;
 
@@ -171,70 +224,95 @@ static bool init_stream(device &dev, struct params *p)
 		}
 	}
 
-	for (uint8_t i = 0; i < dev.frame.bufcnt; ++i) {
-		memset(&buf, 0, sizeof(buf));
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = i;
-
-		if (!dev_ioctl(dev.fd, VIDIOC_QBUF, &buf)) {
-			ee("v4l2_ioctl VIDIOC_QBUF fd %d\n", dev.fd);
-			return false;
-		}
-	}
-
 	p->fps = set_framerate(dev, p->fps);
-	ii("selected params %ux%u@%u\n", dev.frame.w, dev.frame.h, p->fps);
+	ii("selected params %ux%u@%u %s\n", dev.frame.w, dev.frame.h, p->fps,
+	 format_name(p->fmt));
 	return true;
 }
 
 stream_ptr create_stream(const char *path, struct params *p)
 {
+	struct stat st;
 	int fd;
 
 	if (!path)
 		return nullptr;
+	else if (strncmp(path, "http://", 7) == 0)
+		return create_mjpeg(path, p);
+	else if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+		return create_replay(path, p);
 	else if ((fd = open_camera(path)) < 0)
 		return nullptr;
 
 	device *dev = new device(fd);
-	if (!init_stream(*dev, p))
+	if (!init_stream(*dev, p)) {
+		delete dev;
 		return nullptr;
+	}
 
-	stream *stream = new camera::stream(*dev);
-	return std::make_unique<camera::stream>(std::move(*stream));
+	return stream_ptr(new v4l2_stream(*dev));
 }
 
-stream::stream(device &dev): dev_(dev) {}
-stream::~stream() { delete &dev_; }
-
-bool stream::start()
+bool v4l2_stream::start()
 {
 	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (dev_.streaming)
+		return true;
+	else if (!queue_buffers(dev_))
+		return false;
+
 	if (!dev_ioctl(dev_.fd, VIDIOC_STREAMON, &type)) {
 		ee("v4l2_ioctl VIDIOC_STREAMON fd %d\n", dev_.fd);
 		return false;
 	}
 
+	dev_.streaming = true;
 	return true;
 }
 
-void stream::get_frame_size(uint16_t &w, uint16_t &h)
+/* STREAMOFF returns every buffer to userspace, start() queues them again */
+bool v4l2_stream::stop()
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (!dev_.streaming)
+		return true;
+
+	if (!dev_ioctl(dev_.fd, VIDIOC_STREAMOFF, &type)) {
+		ee("v4l2_ioctl VIDIOC_STREAMOFF fd %d\n", dev_.fd);
+		return false;
+	}
+
+	dev_.buf.bytesused = 0; /* nothing to put back */
+	dev_.streaming = false;
+	return true;
+}
+
+void v4l2_stream::get_frame_size(uint16_t &w, uint16_t &h)
 {
 	w = dev_.frame.w;
 	h = dev_.frame.h;
 }
 
-void stream::put_frame()
+uint32_t v4l2_stream::get_buffer_size()
 {
-	if (dev_.buf.bytesused)
+	return dev_.frame.bufcnt ? dev_.frame.buf[0].size : 0;
+}
+
+void v4l2_stream::put_frame()
+{
+	if (dev_.buf.bytesused) {
+		probe2(qbuf, dev_.buf.sequence, dev_.buf.index);
 		dev_ioctl(dev_.fd, VIDIOC_QBUF, &dev_.buf);
+	}
 	/* was not queued otherwise */
 }
 
-bool stream::get_frame(struct image &out)
+bool v4l2_stream::get_frame(struct image &out)
 {
 	struct pollfd fds;
+	uint64_t ns;
 
 	dev_.buf.bytesused = 0; /* invalidate for put_frame call */
 	fds.fd = dev_.fd;
@@ -269,9 +347,13 @@ bool stream::get_frame(struct image &out)
 		out.h = dev_.frame.h;
 		out.data = (uint8_t *) dev_.frame.buf[dev_.buf.index].data;
 		out.bytes = dev_.buf.bytesused;
+		out.stride = dev_.frame.stride;
 		out.id = dev_.buf.sequence;
-		out.sec = dev_.buf.timestamp.tv_sec;
-		out.nsec = dev_.buf.timestamp.tv_usec * 1000;
+		ns = timebase::from_timeval(dev_.buf.timestamp,
+		 stamp_type(dev_.buf.flags));
+		out.sec = ns / 1000000000;
+		out.nsec = ns % 1000000000;
+		probe3(dqbuf, out.id, dev_.buf.index, ns);
 		break;
 	}
 
@@ -13,21 +13,14 @@
 
 namespace camera {
 
-static inline uint64_t time_ms(void)
-{
-	struct timespec now;
-
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	return now.tv_sec * 1000 + (uint32_t) (now.tv_nsec * .000001);
-}
-
 struct image {
 	uint32_t id;
 	uint16_t w;
 	uint16_t h;
 	uint8_t *data;
 	uint32_t bytes;
-	uint64_t sec;
+	uint32_t stride; /* bytes per line of first plane, 0 if compressed */
+	uint64_t sec; /* capture time, CLOCK_MONOTONIC */
 	uint64_t nsec;
 };
 
@@ -36,23 +29,25 @@ struct params {
 	uint16_t h;
 	uint8_t fps;
 	uint32_t fmt;
+	uint8_t buffers; /* driver buffers, 0 for default */
 };
 
-class device;
-
 class stream {
 public:
-	stream(device &);
-	~stream();
-	device &dev_;
-	bool start();
-	void get_frame_size(uint16_t &w, uint16_t &h);
-	bool get_frame(struct image &);
-	void put_frame();
+	virtual ~stream() {}
+	virtual bool start() = 0;
+	virtual bool stop() = 0;
+	virtual void get_frame_size(uint16_t &w, uint16_t &h) = 0;
+	virtual uint32_t get_buffer_size() = 0; /* largest frame it may return */
+	virtual bool get_frame(struct image &) = 0;
+	virtual void put_frame() = 0;
 };
 
 using stream_ptr = std::unique_ptr<stream>;
+/* video device, recording when path is regular file or http:// url */
 stream_ptr create_stream(const char *path, struct params *);
+stream_ptr create_replay(const char *path, struct params *);
+stream_ptr create_mjpeg(const char *url, struct params *);
 
 }
 
@@ -0,0 +1,213 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <utility>
+#include <stb/stb_image.h>
+
+#include "format.h"
+#include "convert.h"
+#include "log.h"
+
+namespace camera {
+
+static constexpr uint8_t RGB_PLANES = 3;
+
+const struct format *find_format(const char *name)
+{
+	for (size_t i = 0; i < FORMATS_CNT; ++i) {
+		if (strcasecmp(formats[i].name, name) == 0)
+			return &formats[i];
+	}
+
+	return nullptr;
+}
+
+static inline uint8_t clamp(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* BT.601 limited range, 8-bit fixed point */
+struct chroma {
+	int r;
+	int g;
+	int b;
+};
+
+static inline struct chroma chroma_terms(int u, int v)
+{
+	u -= 128;
+	v -= 128;
+	return { 409 * v + 128, -100 * u - 208 * v + 128, 516 * u + 128 };
+}
+
+static inline void yuv2rgb(uint8_t *dst, int y, const struct chroma &c)
+{
+	y = 298 * (y - 16);
+	dst[0] = clamp((y + c.r) >> 8);
+	dst[1] = clamp((y + c.g) >> 8);
+	dst[2] = clamp((y + c.b) >> 8);
+}
+
+template <size_t I>
+static void rgb_rows(const struct image &img, uint32_t stride, uint8_t *dst)
+{
+	constexpr const struct format &f = formats[I];
+	constexpr bool same = f.off[0] == 0 && f.off[1] == 1 && f.off[2] == 2;
+	const uint32_t row = img.w * RGB_PLANES;
+
+	for (uint16_t y = 0; y < img.h; ++y, dst += row) {
+		const uint8_t *src = img.data + y * stride;
+
+		if (same) {
+			memcpy(dst, src, row);
+			continue;
+		}
+
+		uint8_t *out = dst;
+		for (uint16_t x = 0; x < img.w; ++x, src += f.group, out += 3) {
+			out[0] = src[f.off[0]];
+			out[1] = src[f.off[1]];
+			out[2] = src[f.off[2]];
+		}
+	}
+}
+
+template <size_t I>
+static void yuv_packed_rows(const struct image &img, uint32_t stride,
+ uint8_t *dst)
+{
+	constexpr const struct format &f = formats[I];
+
+	for (uint16_t y = 0; y < img.h; ++y) {
+		const uint8_t *src = img.data + y * stride;
+
+		for (uint16_t x = 0; x < img.w; x += 2, src += f.group) {
+			struct chroma c = chroma_terms(src[f.off[1]], src[f.off[3]]);
+
+			yuv2rgb(dst, src[f.off[0]], c);
+			yuv2rgb(dst + 3, src[f.off[2]], c);
+			dst += 6;
+		}
+	}
+}
+
+template <size_t I>
+static void yuv_semiplanar_rows(const struct image &img, uint32_t stride,
+ uint8_t *dst)
+{
+	constexpr const struct format &f = formats[I];
+	const uint8_t *uv_plane = img.data + stride * img.h;
+
+	for (uint16_t y = 0; y < img.h; ++y) {
+		const uint8_t *luma = img.data + y * stride;
+		const uint8_t *uv = uv_plane + (y / f.sub_h) * stride;
+
+		for (uint16_t x = 0; x < img.w; x += 2, luma += 2, uv += 2) {
+			struct chroma c = chroma_terms(uv[f.off[1]], uv[f.off[3]]);
+
+			yuv2rgb(dst, luma[0], c);
+			yuv2rgb(dst + 3, luma[1], c);
+			dst += 6;
+		}
+	}
+}
+
+static bool jpeg_decode(const struct image &img, struct slot *s)
+{
+	int w;
+	int h;
+	int n = 0;
+	uint8_t *data = stbi_load_from_memory(img.data, img.bytes, &w, &h, &n,
+	 RGB_PLANES);
+
+	if (!data) {
+		ee("failed to decode jpeg frame %u\n", img.id);
+		return false;
+	} else if ((uint32_t) w * h * RGB_PLANES > s->size) {
+		ee("frame %dx%d does not fit pool slot\n", w, h);
+		free(data);
+		return false;
+	}
+
+	s->w = w;
+	s->h = h;
+	s->bytes = w * h * RGB_PLANES;
+	memcpy(s->data, data, s->bytes);
+	free(data);
+	return true;
+}
+
+template <size_t I>
+static bool decode(const struct image &img, struct slot *s)
+{
+	constexpr const struct format &f = formats[I];
+	uint32_t stride;
+
+	if (f.layout == layout::jpeg) {
+		if (!jpeg_decode(img, s))
+			return false;
+	} else {
+		/* stride and size checks happen per frame, never per row */
+		stride = img.stride ? img.stride : line_bytes(f, img.w);
+		if (img.w % f.sub_w || img.h % f.sub_h) {
+			/* row kernels convert whole chroma pairs only */
+			ww("frame %u is %ux%u, not multiple of chroma block\n",
+			 img.id, img.w, img.h);
+			return false;
+		} else if (img.bytes < plane_bytes(f, stride, img.h)) {
+			ww("short frame %u, %u bytes\n", img.id, img.bytes);
+			return false;
+		} else if ((uint32_t) img.w * img.h * RGB_PLANES > s->size) {
+			ee("frame %ux%u does not fit pool slot\n", img.w, img.h);
+			return false;
+		}
+
+		switch (f.layout) {
+		case layout::rgb:
+			rgb_rows<I>(img, stride, s->data);
+			break;
+		case layout::yuv_packed:
+			yuv_packed_rows<I>(img, stride, s->data);
+			break;
+		case layout::yuv_semiplanar:
+			yuv_semiplanar_rows<I>(img, stride, s->data);
+			break;
+		default:
+			return false;
+		}
+
+		s->w = img.w;
+		s->h = img.h;
+		s->bytes = img.w * img.h * RGB_PLANES;
+	}
+
+	s->id = img.id;
+	s->fmt = f.decoded;
+	s->sec = img.sec;
+	s->nsec = img.nsec;
+	return true;
+}
+
+template <size_t... I>
+static decode_fn lookup(uint32_t fourcc, std::index_sequence<I...>)
+{
+	static constexpr decode_fn table[] = { decode<I>... };
+	size_t i = format_index(fourcc);
+
+	return i < FORMATS_CNT ? table[i] : nullptr;
+}
+
+decode_fn find_decoder(uint32_t fourcc)
+{
+	return lookup(fourcc, std::make_index_sequence<FORMATS_CNT>());
+}
+
+} // namespace camera
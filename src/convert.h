@@ -0,0 +1,22 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include "camera.h"
+#include "pool.h"
+
+namespace camera {
+
+/* Converts captured image into pooled frame of its decoded format */
+using decode_fn = bool (*)(const struct image &, struct slot *);
+
+decode_fn find_decoder(uint32_t fourcc);
+
+}
+
+#endif // CONVERT_H
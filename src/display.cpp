@@ -0,0 +1,244 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "display.h"
+#include "log.h"
+
+namespace display {
+
+#ifdef HAVE_X11SHM
+backend_ptr create_x11shm(const char *title, uint16_t w, uint16_t h);
+#endif
+
+#ifdef HAVE_KMS
+backend_ptr create_kms(const char *path);
+#endif
+
+#ifdef HAVE_VULKAN
+backend_ptr create_vulkan(const char *title, uint16_t w, uint16_t h);
+#endif
+
+backend_ptr create_backend(const char *name, const char *title, uint16_t w,
+ uint16_t h)
+{
+#ifdef HAVE_X11SHM
+	if (strcmp(name, "shm") == 0)
+		return create_x11shm(title, w, h);
+#endif
+#ifdef HAVE_KMS
+	if (strcmp(name, "kms") == 0)
+		return create_kms(NULL);
+	else if (strncmp(name, "kms:", 4) == 0) /* e.g. kms:/dev/dri/card1 */
+		return create_kms(name + 4);
+#endif
+#ifdef HAVE_VULKAN
+	if (strcmp(name, "vk") == 0)
+		return create_vulkan(title, w, h);
+#endif
+	(void) title; /* unused when built without any backend */
+	(void) w;
+	(void) h;
+	ee("display backend '%s' is not available\n", name);
+	return nullptr;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* 4 pixels per shuffle, 16 byte load needs 4 bytes slack past the 12 used */
+__attribute__((target("ssse3")))
+static void copy_row_ssse3(uint32_t *dst, const uint8_t *src, uint16_t w)
+{
+	const __m128i shuf = _mm_setr_epi8(2, 1, 0, -128, 5, 4, 3, -128,
+	 8, 7, 6, -128, 11, 10, 9, -128);
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	uint16_t x = 0;
+
+	for (; x + 6 <= w; x += 4, src += 12) {
+		__m128i v = _mm_loadu_si128((const __m128i *) src);
+		v = _mm_or_si128(_mm_shuffle_epi8(v, shuf), alpha);
+		_mm_storeu_si128((__m128i *) (dst + x), v);
+	}
+
+	for (; x < w; ++x, src += 3)
+		dst[x] = 0xff000000 | src[0] << 16 | src[1] << 8 | src[2];
+}
+#elif defined(__ARM_NEON)
+static void copy_row_neon(uint32_t *dst, const uint8_t *src, uint16_t w)
+{
+	uint16_t x = 0;
+
+	for (; x + 16 <= w; x += 16, src += 48) {
+		uint8x16x3_t rgb = vld3q_u8(src);
+		uint8x16x4_t bgrx = { { rgb.val[2], rgb.val[1], rgb.val[0],
+		 vdupq_n_u8(0xff) } };
+		vst4q_u8((uint8_t *) (dst + x), bgrx);
+	}
+
+	for (; x < w; ++x, src += 3)
+		dst[x] = 0xff000000 | src[0] << 16 | src[1] << 8 | src[2];
+}
+#endif
+
+static void copy_row(uint32_t *dst, const uint8_t *src, uint16_t w)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	static const bool ssse3 = __builtin_cpu_supports("ssse3");
+
+	if (ssse3)
+		return copy_row_ssse3(dst, src, w);
+#elif defined(__ARM_NEON)
+	return copy_row_neon(dst, src, w);
+#endif
+	for (uint16_t x = 0; x < w; ++x, src += 3)
+		dst[x] = 0xff000000 | src[0] << 16 | src[1] << 8 | src[2];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Gathers 4 source pixels as dwords, so the last pixel of a row is left
+ * to scalar tail: its dword would read past the row
+ */
+__attribute__((target("ssse3")))
+static uint16_t scale_row_ssse3(uint32_t *dst, const uint8_t *src,
+ const uint32_t *cols, uint16_t w, uint32_t row)
+{
+	const __m128i shuf = _mm_setr_epi8(2, 1, 0, -128, 6, 5, 4, -128,
+	 10, 9, 8, -128, 14, 13, 12, -128);
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	uint32_t px[4];
+	uint16_t x = 0;
+
+	for (; x + 4 <= w && cols[x + 3] + 4 <= row; x += 4) {
+		for (uint8_t i = 0; i < 4; ++i)
+			memcpy(&px[i], src + cols[x + i], 4);
+
+		__m128i v = _mm_loadu_si128((const __m128i *) px);
+		v = _mm_or_si128(_mm_shuffle_epi8(v, shuf), alpha);
+		_mm_storeu_si128((__m128i *) (dst + x), v);
+	}
+
+	return x;
+}
+#elif defined(__ARM_NEON)
+/* Lane loads take exactly 3 bytes per pixel, no slack needed */
+static uint16_t scale_row_neon(uint32_t *dst, const uint8_t *src,
+ const uint32_t *cols, uint16_t w)
+{
+	uint8x8x3_t rgb = { { vdup_n_u8(0), vdup_n_u8(0), vdup_n_u8(0) } };
+	uint16_t x = 0;
+
+	for (; x + 8 <= w; x += 8) {
+		rgb = vld3_lane_u8(src + cols[x + 0], rgb, 0);
+		rgb = vld3_lane_u8(src + cols[x + 1], rgb, 1);
+		rgb = vld3_lane_u8(src + cols[x + 2], rgb, 2);
+		rgb = vld3_lane_u8(src + cols[x + 3], rgb, 3);
+		rgb = vld3_lane_u8(src + cols[x + 4], rgb, 4);
+		rgb = vld3_lane_u8(src + cols[x + 5], rgb, 5);
+		rgb = vld3_lane_u8(src + cols[x + 6], rgb, 6);
+		rgb = vld3_lane_u8(src + cols[x + 7], rgb, 7);
+
+		uint8x8x4_t bgrx = { { rgb.val[2], rgb.val[1], rgb.val[0],
+		 vdup_n_u8(0xff) } };
+		vst4_u8((uint8_t *) (dst + x), bgrx);
+	}
+
+	return x;
+}
+#endif
+
+/* Nearest neighbour, cols holds source byte offset per output column */
+static void scale_row(uint32_t *dst, const uint8_t *src, const uint32_t *cols,
+ uint16_t w, uint32_t row)
+{
+	uint16_t x = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	static const bool ssse3 = __builtin_cpu_supports("ssse3");
+
+	if (ssse3)
+		x = scale_row_ssse3(dst, src, cols, w, row);
+#elif defined(__ARM_NEON)
+	x = scale_row_neon(dst, src, cols, w);
+	(void) row;
+#else
+	(void) row;
+#endif
+	for (; x < w; ++x) {
+		const uint8_t *p = src + cols[x];
+		dst[x] = 0xff000000 | p[0] << 16 | p[1] << 8 | p[2];
+	}
+}
+
+scaler::~scaler()
+{
+	free(cols_);
+}
+
+/* Returns true when fitted size changed and borders need repaint */
+bool scaler::fit(uint16_t src_w, uint16_t src_h, uint16_t dst_w,
+ uint16_t dst_h)
+{
+	if (src_w == src_w_ && src_h == src_h_ && dst_w == dst_w_ &&
+	 dst_h == dst_h_)
+		return false;
+
+	src_w_ = src_w;
+	src_h_ = src_h;
+	dst_w_ = dst_w;
+	dst_h_ = dst_h;
+
+	/* same rule as GL path: keep original aspect ratio */
+	w = (uint32_t) dst_h * src_w / src_h;
+	if (w <= dst_w) {
+		h = dst_h;
+	} else {
+		w = dst_w;
+		h = (uint32_t) dst_w * src_h / src_w;
+	}
+
+	free(cols_);
+	if (!(cols_ = (uint32_t *) malloc(w * sizeof(*cols_)))) {
+		w = h = 0;
+		return true;
+	}
+
+	for (uint16_t x = 0; x < w; ++x)
+		cols_[x] = (uint32_t) x * src_w / w * 3;
+
+	return true;
+}
+
+void scaler::run(const uint8_t *src, uint8_t *dst, uint32_t pitch)
+{
+	const uint32_t src_pitch = src_w_ * 3;
+	uint32_t prev = UINT32_MAX;
+
+	for (uint16_t y = 0; y < h; ++y, dst += pitch) {
+		uint32_t sy = (uint32_t) y * src_h_ / h;
+
+		if (sy == prev) { /* upscaled row repeats previous one */
+			memcpy(dst, dst - pitch, w * 4);
+			continue;
+		}
+
+		prev = sy;
+		if (w == src_w_)
+			copy_row((uint32_t *) dst, src + sy * src_pitch, w);
+		else
+			scale_row((uint32_t *) dst, src + sy * src_pitch, cols_,
+			 w, src_pitch);
+	}
+}
+
+} // namespace display
@@ -0,0 +1,67 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include <stdint.h>
+#include <memory>
+
+#include "pool.h"
+#include "stats.h"
+#include "probe.h"
+
+namespace display {
+
+/* Presentation backends other than the GLFW/GL path in main.cpp */
+class backend {
+public:
+	virtual ~backend() {}
+	virtual bool present(const struct camera::slot *) = 0;
+	virtual bool dispatch() = 0; /* false once user asked to quit */
+	virtual void wait() = 0; /* sleep until next event */
+	virtual bool hidden() = 0;
+	stats::histogram latency; /* capture to present, filled if known */
+	uint64_t last_us = 0;
+protected:
+	void presented(uint64_t capture_ns, uint64_t present_ns)
+	{
+		probe2(present, capture_ns, present_ns);
+		if (present_ns > capture_ns) {
+			last_us = (present_ns - capture_ns) / 1000;
+			latency.add(last_us);
+		}
+	}
+};
+
+static inline uint64_t capture_ns(const struct camera::slot *s)
+{
+	return s->sec * 1000000000ULL + s->nsec;
+}
+
+using backend_ptr = std::unique_ptr<backend>;
+backend_ptr create_backend(const char *name, const char *title, uint16_t w,
+ uint16_t h);
+
+/* Nearest neighbour RGB24 to XRGB8888 scaler keeping aspect ratio */
+class scaler {
+public:
+	~scaler();
+	bool fit(uint16_t src_w, uint16_t src_h, uint16_t dst_w, uint16_t dst_h);
+	void run(const uint8_t *src, uint8_t *dst, uint32_t pitch);
+	uint16_t w = 0; /* fitted size */
+	uint16_t h = 0;
+private:
+	uint16_t src_w_ = 0;
+	uint16_t src_h_ = 0;
+	uint16_t dst_w_ = 0;
+	uint16_t dst_h_ = 0;
+	uint32_t *cols_ = nullptr; /* source byte offset per output column */
+};
+
+}
+
+#endif // DISPLAY_H
@@ -0,0 +1,102 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/videodev2.h>
+
+namespace camera {
+
+enum class layout : uint8_t {
+	rgb, /* packed 8-bit triplets */
+	yuv_packed, /* 4:2:2 macropixels, two luma samples share chroma */
+	yuv_semiplanar, /* luma plane followed by interleaved chroma plane */
+	jpeg, /* compressed, decoded by stb_image */
+};
+
+/* GL pixel transfer formats, numeric to keep GL headers out of here */
+static constexpr uint32_t GL_FMT_RGB = 0x1907; /* GL_RGB */
+
+struct format {
+	uint32_t fourcc;
+	const char *name;
+	enum layout layout;
+	uint8_t bpp; /* average bits per pixel, 0 when compressed */
+	uint8_t planes;
+	uint8_t sub_w; /* chroma subsampling */
+	uint8_t sub_h;
+	uint8_t group; /* bytes per macropixel in first plane */
+	uint8_t off[4]; /* r,g,b or y0,u,y1,v byte offsets in macropixel */
+	uint32_t decoded; /* format of frames stored in pool */
+	uint32_t gl_fmt; /* pixel transfer format when uploading as is */
+};
+
+/* Adding a format is a single entry here, conversion kernels in convert.cpp
+ * are instantiated from this table.
+ */
+static constexpr struct format formats[] = {
+	{ V4L2_PIX_FMT_RGB24, "RGB8", layout::rgb, 24, 1, 1, 1, 3,
+	 { 0, 1, 2, 0 }, V4L2_PIX_FMT_RGB24, GL_FMT_RGB },
+	{ V4L2_PIX_FMT_BGR24, "BGR8", layout::rgb, 24, 1, 1, 1, 3,
+	 { 2, 1, 0, 0 }, V4L2_PIX_FMT_RGB24, 0 },
+	{ V4L2_PIX_FMT_YUYV, "YUYV", layout::yuv_packed, 16, 1, 2, 1, 4,
+	 { 0, 1, 2, 3 }, V4L2_PIX_FMT_RGB24, 0 },
+	{ V4L2_PIX_FMT_UYVY, "UYVY", layout::yuv_packed, 16, 1, 2, 1, 4,
+	 { 1, 0, 3, 2 }, V4L2_PIX_FMT_RGB24, 0 },
+	{ V4L2_PIX_FMT_NV12, "NV12", layout::yuv_semiplanar, 12, 2, 2, 2, 1,
+	 { 0, 0, 0, 1 }, V4L2_PIX_FMT_RGB24, 0 },
+	{ V4L2_PIX_FMT_NV21, "NV21", layout::yuv_semiplanar, 12, 2, 2, 2, 1,
+	 { 0, 1, 0, 0 }, V4L2_PIX_FMT_RGB24, 0 },
+	{ V4L2_PIX_FMT_MJPEG, "JPEG", layout::jpeg, 0, 1, 2, 2, 0,
+	 { 0, 0, 0, 0 }, V4L2_PIX_FMT_RGB24, 0 },
+};
+
+static constexpr size_t FORMATS_CNT = sizeof(formats) / sizeof(formats[0]);
+
+static constexpr size_t format_index(uint32_t fourcc, size_t i = 0)
+{
+	return (i == FORMATS_CNT || formats[i].fourcc == fourcc) ? i :
+	 format_index(fourcc, i + 1);
+}
+
+static constexpr uint32_t image_bytes(const struct format &f, uint16_t w,
+ uint16_t h)
+{
+	return (uint32_t) w * h * f.bpp / 8;
+}
+
+static constexpr uint32_t line_bytes(const struct format &f, uint16_t w)
+{
+	return f.layout == layout::yuv_packed ? w / f.sub_w * f.group :
+	 (uint32_t) w * f.group;
+}
+
+static constexpr uint32_t plane_bytes(const struct format &f, uint32_t stride,
+ uint16_t h)
+{
+	return f.planes == 1 ? stride * h : stride * h + stride * (h / f.sub_h);
+}
+
+static inline const struct format *find_format(uint32_t fourcc)
+{
+	size_t i = format_index(fourcc);
+	return i < FORMATS_CNT ? &formats[i] : nullptr;
+}
+
+const struct format *find_format(const char *name);
+
+static inline const char *format_name(uint32_t fourcc)
+{
+	const struct format *f = find_format(fourcc);
+	return f ? f->name : "<nil>";
+}
+
+}
+
+#endif // FORMAT_H
@@ -0,0 +1,71 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include "frameclock.h"
+
+namespace camera {
+
+static constexpr uint8_t DEFAULT_FPS = 30;
+static constexpr uint32_t CLOCK_FRAMES = 32; /* filter memory when locked */
+static constexpr uint32_t CLOCK_MAX_GAP = 64; /* frames, else start over */
+static constexpr int64_t CLOCK_RESET = 3; /* intervals off, start over */
+
+frame_clock::frame_clock(uint8_t fps)
+{
+	interval_q8_ = (1000000000ULL << 8) / (fps ? fps : DEFAULT_FPS);
+	interval_ns_.store(interval_q8_ >> 8);
+}
+
+uint64_t frame_clock::update(uint32_t seq, uint64_t ns)
+{
+	uint32_t dn = seq - last_seq_;
+	uint64_t prev = last_ns_;
+	uint64_t pred;
+	int64_t iv;
+	int64_t r;
+	int64_t k;
+
+	if (!n_ || !dn || dn > CLOCK_MAX_GAP)
+		goto restart;
+
+	pred = prev + ((interval_q8_ * dn) >> 8);
+	r = (int64_t) (ns - pred);
+	iv = interval_q8_ >> 8;
+	if (n_ > 1 && (r > CLOCK_RESET * iv || r < -CLOCK_RESET * iv))
+		goto restart; /* stream stopped and started, or clock stepped */
+
+	k = n_ + 1;
+	last_ns_ = pred + r * 2 * (2 * k - 1) / (k * (k + 1));
+	iv = interval_q8_ + r * 256 * 6 / (k * (k + 1)) / dn;
+	if (iv > 0)
+		interval_q8_ = iv;
+	if (last_ns_ <= prev)
+		last_ns_ = prev + 1;
+
+	last_seq_ = seq;
+	if (n_ < CLOCK_FRAMES - 1)
+		n_++;
+
+	dev_ns_ += ((r < 0 ? -r : r) - (int64_t) dev_ns_) / 16;
+	jitter_us_.store(dev_ns_ / 1000, std::memory_order_relaxed);
+	interval_ns_.store((interval_q8_ + 128) >> 8, std::memory_order_relaxed);
+	return last_ns_;
+
+restart: /* keep interval, next frame measures it anyway */
+	last_ns_ = ns;
+	last_seq_ = seq;
+	n_ = 1;
+	return ns;
+}
+
+uint16_t frame_clock::fps() const
+{
+	uint64_t iv = interval_ns_.load(std::memory_order_relaxed);
+
+	return iv ? (1000000000 + iv / 2) / iv : 0;
+}
+
+} // namespace camera
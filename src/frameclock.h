@@ -0,0 +1,41 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef FRAMECLOCK_H
+#define FRAMECLOCK_H
+
+#include <stdint.h>
+#include <atomic>
+
+namespace camera {
+
+/* Recovers sensor clock from sequence numbers and jittery buffer stamps.
+ * Alpha-beta filter over t = t0 + seq * interval, with gains of growing
+ * memory least squares fit (what Kalman filter converges to for this
+ * model) until memory of CLOCK_FRAMES is reached, so it locks within few
+ * frames and then rejects USB jitter. Sequence gaps count as dropped
+ * frames, a jump of several intervals starts over.
+ */
+class frame_clock {
+public:
+	explicit frame_clock(uint8_t fps);
+	uint64_t update(uint32_t seq, uint64_t ns); /* gives smoothed ns */
+	uint64_t interval_ns() const { return interval_ns_.load(); }
+	uint16_t fps() const; /* rounded */
+	uint32_t jitter_us() const { return jitter_us_.load(); }
+private:
+	uint64_t interval_q8_; /* ns << 8 */
+	uint64_t last_ns_ = 0; /* smoothed stamp of last frame */
+	uint32_t last_seq_ = 0;
+	uint32_t n_ = 0; /* frames since reset, up to CLOCK_FRAMES */
+	uint64_t dev_ns_ = 0; /* mean absolute residual */
+	std::atomic<uint64_t> interval_ns_;
+	std::atomic<uint32_t> jitter_us_{0};
+};
+
+}
+
+#endif // FRAMECLOCK_H
@@ -0,0 +1,412 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "http.h"
+#include "format.h"
+#include "jpeg.h"
+#include "timebase.h"
+#include "log.h"
+
+namespace camera {
+
+static constexpr uint8_t HTTP_FRAMES = 8;
+static constexpr uint8_t HTTP_QUEUE = 2; /* frames waiting per client */
+static constexpr const char *HTTP_HOST = "127.0.0.1";
+static constexpr uint16_t HTTP_REQUEST_MAX = 1024;
+static constexpr uint64_t HTTP_REQUEST_NS = 5000000000ULL;
+
+static const char response_[] =
+	"HTTP/1.0 200 OK\r\n"
+	"Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+	"Cache-Control: no-cache, no-store\r\n"
+	"Pragma: no-cache\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+static const char busy_[] =
+	"HTTP/1.0 503 Service Unavailable\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+static const char tail_[] = "\r\n";
+
+static int listen_on(const char *addr)
+{
+	struct sockaddr_in sa;
+	const char *port = strrchr(addr, ':');
+	char host[INET_ADDRSTRLEN];
+	int one = 1;
+	int fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+
+	if (!port) {
+		port = addr;
+		snprintf(host, sizeof(host), "%s", HTTP_HOST);
+	} else if (port - addr >= (int) sizeof(host)) {
+		ee("malformed http address '%s'\n", addr);
+		return -1;
+	} else {
+		memcpy(host, addr, port - addr);
+		host[port - addr] = '\0';
+		port++;
+	}
+
+	sa.sin_port = htons(atoi(port));
+	if (!sa.sin_port || inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+		ee("malformed http address '%s', e.g. 8080 or 0.0.0.0:8080\n",
+		 addr);
+		return -1;
+	}
+
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	 0)) < 0) {
+		ee("failed to create socket, errno %d\n", errno);
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0 ||
+	 listen(fd, HTTP_MAX_CLIENTS) < 0) {
+		ee("failed to listen on %s:%s, errno %d\n", host, port, errno);
+		close(fd);
+		return -1;
+	}
+
+	if (sa.sin_addr.s_addr != htonl(INADDR_LOOPBACK))
+		ww("http stream is reachable from network on %s\n", host);
+
+	ii("http stream on http://%s:%s/\n", host, port);
+	return fd;
+}
+
+http_server::http_server(frame_pool &raw, uint32_t size, const char *addr,
+ uint8_t quality) : raw_(raw), quality_(quality), quit_(false)
+{
+	pool_.reset(new frame_pool(HTTP_FRAMES, size, exhaust::drop_oldest));
+	if (!pool_->valid())
+		return;
+	else if ((event_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		return;
+	else if ((raw_consumer_ = raw_.attach(1)) < 0)
+		return;
+	else if ((listen_ = listen_on(addr)) < 0)
+		return;
+
+	feeder_ = std::thread(&http_server::feed, this);
+	pthread_setname_np(feeder_.native_handle(), "http-feed");
+	io_ = std::thread(&http_server::serve, this);
+	pthread_setname_np(io_.native_handle(), "http-io");
+}
+
+http_server::~http_server()
+{
+	stop();
+
+	if (raw_consumer_ >= 0)
+		raw_.detach(raw_consumer_);
+	if (event_ >= 0)
+		close(event_);
+}
+
+void http_server::stop()
+{
+	uint64_t one = 1;
+
+	if (listen_ < 0)
+		return;
+
+	feeder_.join(); /* leaves once raw pool is cancelled */
+	quit_ = true;
+	if (write(event_, &one, sizeof(one)) < 0)
+		ee("failed to wake http thread, errno %d\n", errno);
+
+	io_.join();
+	for (uint8_t i = 0; i < HTTP_MAX_CLIENTS; ++i) {
+		if (clients_[i].fd >= 0)
+			drop_client(&clients_[i]);
+	}
+
+	close(listen_);
+	listen_ = -1;
+	if (pool_->drops())
+		ii("http frames dropped, all held by clients: %u\n",
+		 pool_->drops());
+}
+
+/* Makes JPEG of newest raw frame once for all clients, and only while
+ * somebody watches
+ */
+void http_server::feed()
+{
+	jpeg_encoder jpeg(quality_);
+	struct slot *s;
+	struct slot *out;
+	uint64_t one = 1;
+
+	while ((s = raw_.pop(raw_consumer_, true))) {
+		const struct format *f = find_format(s->fmt);
+		const uint8_t *data = s->data;
+		uint32_t bytes = s->bytes;
+
+		if (!pool_->consumers()) {
+			raw_.release(s);
+			continue;
+		} else if (!f || f->layout != layout::jpeg) {
+			bytes = jpeg.encode(s, &data);
+		}
+
+		if (bytes && (out = pool_->acquire())) {
+			if (bytes > out->size) {
+				ww("frame %u of %u bytes does not fit\n", s->id,
+				 bytes);
+				pool_->release(out);
+			} else {
+				memcpy(out->data, data, bytes);
+				out->bytes = bytes;
+				out->id = s->id;
+				out->fmt = V4L2_PIX_FMT_MJPEG;
+				out->w = s->w;
+				out->h = s->h;
+				out->sec = s->sec;
+				out->nsec = s->nsec;
+				pool_->publish(out);
+				if (write(event_, &one, sizeof(one)) < 0)
+					ee("failed to wake http thread\n");
+			}
+		}
+
+		raw_.release(s);
+	}
+}
+
+void http_server::drop_client(struct client *c)
+{
+	if (c->cur)
+		pool_->release(c->cur);
+	if (c->consumer >= 0)
+		pool_->detach(c->consumer);
+
+	if (c->frames)
+		ii("http client %d: %u frames sent, %u skipped\n", c->fd,
+		 c->frames, c->skipped);
+
+	close(c->fd);
+	*c = client();
+}
+
+void http_server::accept_client()
+{
+	struct client *c = nullptr;
+	int one = 1;
+	int fd;
+
+	while ((fd = accept4(listen_, NULL, NULL, SOCK_NONBLOCK |
+	 SOCK_CLOEXEC)) >= 0) {
+		for (uint8_t i = 0; i < HTTP_MAX_CLIENTS && !c; ++i) {
+			if (clients_[i].fd < 0)
+				c = &clients_[i];
+		}
+
+		if (!c) {
+			ww("no room for more than %u http clients\n",
+			 HTTP_MAX_CLIENTS);
+			send(fd, busy_, sizeof(busy_) - 1, MSG_NOSIGNAL);
+			close(fd);
+			continue;
+		}
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		c->fd = fd; /* request comes next */
+		c->deadline_ns = timebase::now() + HTTP_REQUEST_NS;
+		c = nullptr;
+	}
+}
+
+/* Any GET gets the stream, whatever path it asks for */
+void http_server::start_client(struct client *c)
+{
+	char req[HTTP_REQUEST_MAX];
+	ssize_t len = recv(c->fd, req, sizeof(req) - 1, 0);
+
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	} else if (len <= 0 || strncmp(req, "GET ", 4) != 0) {
+		drop_client(c);
+		return;
+	}
+
+	/* small enough for empty socket buffer to take at once */
+	if (send(c->fd, response_, sizeof(response_) - 1, MSG_NOSIGNAL) !=
+	 sizeof(response_) - 1) {
+		drop_client(c);
+	} else if ((c->consumer = pool_->attach(HTTP_QUEUE)) < 0) {
+		drop_client(c);
+	} else {
+		ii("http client %d streaming\n", c->fd);
+	}
+}
+
+/* Sends queued frames until socket is full, false if client is gone */
+bool http_server::send_frames(struct client *c)
+{
+	while (1) {
+		if (!c->cur) {
+			if (!(c->cur = pool_->pop(c->consumer)))
+				return true;
+
+			if (c->frames && c->cur->id > c->last_id + 1)
+				c->skipped += c->cur->id - c->last_id - 1;
+
+			c->last_id = c->cur->id;
+			c->sent = 0;
+			c->head_len = snprintf(c->head, sizeof(c->head),
+			 "--frame\r\nContent-Type: image/jpeg\r\n"
+			 "Content-Length: %u\r\n\r\n", c->cur->bytes);
+		}
+
+		/* part header, jpeg straight from shared slot, part tail */
+		struct iovec iov[3] = {
+			{ c->head, c->head_len },
+			{ c->cur->data, c->cur->bytes },
+			{ (void *) tail_, sizeof(tail_) - 1 },
+		};
+		uint32_t total = c->head_len + c->cur->bytes + sizeof(tail_) - 1;
+		uint32_t skip = c->sent;
+		uint8_t first = 0;
+
+		while (skip >= iov[first].iov_len) {
+			skip -= iov[first].iov_len;
+			first++;
+		}
+
+		iov[first].iov_base = (uint8_t *) iov[first].iov_base + skip;
+		iov[first].iov_len -= skip;
+
+		struct msghdr msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov + first;
+		msg.msg_iovlen = 3 - first;
+
+		ssize_t rc = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rc < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ||
+			 errno == EINTR;
+		}
+
+		c->sent += rc;
+		if (c->sent < total)
+			continue; /* socket may still take more or say EAGAIN */
+
+		pool_->release(c->cur);
+		c->cur = nullptr;
+		c->frames++;
+	}
+}
+
+void http_server::serve()
+{
+	struct pollfd fds[2 + HTTP_MAX_CLIENTS];
+	struct client *polled[HTTP_MAX_CLIENTS];
+	uint64_t cnt;
+	uint64_t now;
+
+	while (!quit_) {
+		nfds_t n = 2;
+		int timeout = -1;
+
+		now = timebase::now();
+
+		fds[0] = { listen_, POLLIN, 0 };
+		fds[1] = { event_, POLLIN, 0 };
+		for (uint8_t i = 0; i < HTTP_MAX_CLIENTS; ++i) {
+			struct client *c = &clients_[i];
+
+			if (c->fd < 0)
+				continue;
+
+			/* writable matters only with frame half sent */
+			fds[n] = { c->fd, (short) (POLLIN | (c->cur ? POLLOUT :
+			 0)), 0 };
+			polled[n - 2] = c;
+			n++;
+
+			/* wake up to drop those who never send request */
+			if (c->consumer < 0) {
+				uint64_t left = c->deadline_ns > now ?
+				 c->deadline_ns - now : 0;
+				int ms = (left + 999999) / 1000000;
+
+				if (timeout < 0 || ms < timeout)
+					timeout = ms;
+			}
+		}
+
+		if (poll(fds, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			ee("http poll failed, errno %d\n", errno);
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			if (read(event_, &cnt, sizeof(cnt)) < 0 &&
+			 errno != EAGAIN)
+				ee("failed to read http event\n");
+		}
+
+		if (fds[0].revents & POLLIN)
+			accept_client();
+
+		now = timebase::now();
+
+		for (nfds_t i = 2; i < n; ++i) {
+			struct client *c = polled[i - 2];
+			char buf[HTTP_REQUEST_MAX];
+
+			if (c->consumer < 0) {
+				if (fds[i].revents)
+					start_client(c);
+				if (c->fd >= 0 && c->consumer < 0 &&
+				 now >= c->deadline_ns) {
+					ww("http client %d sent no request\n",
+					 c->fd);
+					drop_client(c);
+				}
+				continue;
+			} else if (fds[i].revents & (POLLERR | POLLHUP)) {
+				drop_client(c);
+				continue;
+			} else if ((fds[i].revents & POLLIN) &&
+			 recv(c->fd, buf, sizeof(buf), 0) == 0) {
+				drop_client(c); /* peer closed */
+				continue;
+			}
+
+			if (!send_frames(c))
+				drop_client(c);
+		}
+	}
+}
+
+} // namespace camera
@@ -0,0 +1,67 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdint.h>
+#include <thread>
+#include <atomic>
+#include <memory>
+
+#include "pool.h"
+
+namespace camera {
+
+static constexpr uint8_t HTTP_MAX_CLIENTS = POOL_MAX_CONSUMERS;
+
+/* MJPEG over HTTP as multipart/x-mixed-replace, what browsers show as live
+ * picture. Each frame is made JPEG once, raw formats are encoded, and put
+ * into own refcounted pool; every client is a consumer of that pool with
+ * short queue where newest frame pushes oldest out. Clients only ever hold
+ * frames of this pool, so slow viewers never hold back capture.
+ */
+class http_server {
+public:
+	http_server(frame_pool &raw, uint32_t size, const char *addr,
+	 uint8_t quality);
+	~http_server();
+	bool valid() const { return listen_ >= 0; }
+	void stop(); /* after raw pool is cancelled */
+private:
+	struct client {
+		int fd = -1;
+		int consumer = -1; /* streaming once attached */
+		uint64_t deadline_ns = 0; /* to send request by */
+		struct slot *cur = nullptr; /* frame being sent */
+		uint32_t sent = 0;
+		char head[128];
+		uint8_t head_len = 0;
+		uint32_t last_id = 0;
+		uint32_t frames = 0;
+		uint32_t skipped = 0;
+	};
+	void feed();
+	void serve();
+	void accept_client();
+	void start_client(struct client *);
+	bool send_frames(struct client *);
+	void drop_client(struct client *);
+	frame_pool &raw_;
+	int raw_consumer_ = -1;
+	std::unique_ptr<frame_pool> pool_;
+	uint8_t quality_;
+	int listen_ = -1;
+	int event_ = -1; /* new frame or quit */
+	std::atomic<bool> quit_;
+	std::thread feeder_;
+	std::thread io_;
+	struct client clients_[HTTP_MAX_CLIENTS];
+};
+
+}
+
+#endif // HTTP_H
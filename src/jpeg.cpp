@@ -0,0 +1,685 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "jpeg.h"
+#include "format.h"
+#include "log.h"
+
+namespace camera {
+
+/* GCC/clang vector extension, SSE or NEON depending on target; eight rows
+ * of a block are processed at once, so each butterfly below is 1D DCT of
+ * eight columns in parallel.
+ */
+typedef float vec8 __attribute__((vector_size(32)));
+typedef int ivec8 __attribute__((vector_size(32)));
+typedef uint8_t u8x8 __attribute__((vector_size(8)));
+typedef uint8_t u8x16 __attribute__((vector_size(16)));
+typedef uint16_t u16x16 __attribute__((vector_size(32)));
+typedef uint32_t u32x16 __attribute__((vector_size(64)));
+
+/* six blocks of 63 longest AC codes, doubled for byte stuffing */
+static constexpr uint32_t MCU_MAX_BYTES = 6 * 512;
+
+/* natural index of k-th coefficient in zigzag order */
+static const uint8_t zigzag_[64] = {
+	0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+/* ITU T.81 Annex K quantization tables, natural order */
+static const uint8_t base_quant_[2][64] = {
+	{
+		16, 11, 10, 16, 24, 40, 51, 61,
+		12, 12, 14, 19, 26, 58, 60, 55,
+		14, 13, 16, 24, 40, 57, 69, 56,
+		14, 17, 22, 29, 51, 87, 80, 62,
+		18, 22, 37, 56, 68, 109, 103, 77,
+		24, 35, 55, 64, 81, 104, 113, 92,
+		49, 64, 78, 87, 103, 121, 120, 101,
+		72, 92, 95, 98, 112, 100, 103, 99,
+	}, {
+		17, 18, 24, 47, 99, 99, 99, 99,
+		18, 21, 26, 66, 99, 99, 99, 99,
+		24, 26, 56, 99, 99, 99, 99, 99,
+		47, 66, 99, 99, 99, 99, 99, 99,
+		99, 99, 99, 99, 99, 99, 99, 99,
+		99, 99, 99, 99, 99, 99, 99, 99,
+		99, 99, 99, 99, 99, 99, 99, 99,
+		99, 99, 99, 99, 99, 99, 99, 99,
+	},
+};
+
+/* AAN DCT output scale per frequency */
+static const float aan_[8] = {
+	1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+	1.0f, 0.785694958f, 0.541196100f, 0.275899379f,
+};
+
+/* ITU T.81 Annex K Huffman tables: code counts per length, then symbols */
+static const uint8_t dc_lum_bits_[16] = {
+	0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const uint8_t dc_chr_bits_[16] = {
+	0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+};
+
+static const uint8_t dc_vals_[12] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+};
+
+static const uint8_t ac_lum_bits_[16] = {
+	0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d,
+};
+
+static const uint8_t ac_lum_vals_[162] = {
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+	0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+	0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+	0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+	0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+	0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+	0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+	0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+	0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+	0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+	0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+};
+
+static const uint8_t ac_chr_bits_[16] = {
+	0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+};
+
+static const uint8_t ac_chr_vals_[162] = {
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+	0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+	0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+	0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+	0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+	0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+	0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+	0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+	0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+	0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+	0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+};
+
+struct huff_spec {
+	uint8_t id; /* class << 4 | table */
+	const uint8_t *bits;
+	const uint8_t *vals;
+	uint8_t cnt;
+};
+
+/* dc luma, ac luma, dc chroma, ac chroma */
+static const struct huff_spec huff_specs_[4] = {
+	{ 0x00, dc_lum_bits_, dc_vals_, sizeof(dc_vals_) },
+	{ 0x10, ac_lum_bits_, ac_lum_vals_, sizeof(ac_lum_vals_) },
+	{ 0x01, dc_chr_bits_, dc_vals_, sizeof(dc_vals_) },
+	{ 0x11, ac_chr_bits_, ac_chr_vals_, sizeof(ac_chr_vals_) },
+};
+
+struct huff {
+	uint16_t code[256];
+	uint8_t size[256];
+};
+
+static struct huff huff_[4];
+static uint8_t zz_out_[64]; /* zigzag to transposed DCT output index */
+
+static void init_tables()
+{
+	for (uint8_t t = 0; t < 4; ++t) {
+		const struct huff_spec *spec = &huff_specs_[t];
+		uint16_t code = 0;
+		uint8_t k = 0;
+
+		for (uint8_t len = 1; len <= 16; ++len) {
+			for (uint8_t i = 0; i < spec->bits[len - 1]; ++i) {
+				huff_[t].code[spec->vals[k]] = code++;
+				huff_[t].size[spec->vals[k]] = len;
+				k++;
+			}
+
+			code <<= 1;
+		}
+	}
+
+	for (uint8_t k = 0; k < 64; ++k)
+		zz_out_[k] = (zigzag_[k] % 8) * 8 + zigzag_[k] / 8;
+}
+
+jpeg_encoder::jpeg_encoder(uint8_t quality)
+{
+	static bool ready = (init_tables(), true);
+	uint32_t scale;
+
+	(void) ready;
+	if (!quality)
+		quality = 1;
+	else if (quality > 100)
+		quality = 100;
+
+	/* IJG quality scaling */
+	scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+	for (uint8_t t = 0; t < 2; ++t) {
+		uint8_t q[64];
+
+		for (uint8_t n = 0; n < 64; ++n) {
+			uint32_t v = (base_quant_[t][n] * scale + 50) / 100;
+
+			q[n] = v < 1 ? 1 : v > 255 ? 255 : v;
+		}
+
+		for (uint8_t k = 0; k < 64; ++k)
+			quant_[t][k] = q[zigzag_[k]];
+
+		/* DCT output ends up transposed, horizontal frequency first */
+		for (uint8_t u = 0; u < 8; ++u) {
+			for (uint8_t v = 0; v < 8; ++v) {
+				div_[t][v * 8 + u] = 1.f / (q[u * 8 + v] *
+				 aan_[u] * aan_[v] * 8.f);
+			}
+		}
+	}
+}
+
+jpeg_encoder::~jpeg_encoder()
+{
+	free(scratch_);
+	free(out_);
+}
+
+static inline void fdct(vec8 *d)
+{
+	vec8 tmp0 = d[0] + d[7];
+	vec8 tmp7 = d[0] - d[7];
+	vec8 tmp1 = d[1] + d[6];
+	vec8 tmp6 = d[1] - d[6];
+	vec8 tmp2 = d[2] + d[5];
+	vec8 tmp5 = d[2] - d[5];
+	vec8 tmp3 = d[3] + d[4];
+	vec8 tmp4 = d[3] - d[4];
+
+	/* even part */
+	vec8 tmp10 = tmp0 + tmp3;
+	vec8 tmp13 = tmp0 - tmp3;
+	vec8 tmp11 = tmp1 + tmp2;
+	vec8 tmp12 = tmp1 - tmp2;
+	vec8 z1 = (tmp12 + tmp13) * 0.707106781f;
+
+	d[0] = tmp10 + tmp11;
+	d[4] = tmp10 - tmp11;
+	d[2] = tmp13 + z1;
+	d[6] = tmp13 - z1;
+
+	/* odd part */
+	tmp10 = tmp4 + tmp5;
+	tmp11 = tmp5 + tmp6;
+	tmp12 = tmp6 + tmp7;
+
+	vec8 z5 = (tmp10 - tmp12) * 0.382683433f;
+	vec8 z2 = tmp10 * 0.541196100f + z5;
+	vec8 z4 = tmp12 * 1.306562965f + z5;
+	vec8 z3 = tmp11 * 0.707106781f;
+	vec8 z11 = tmp7 + z3;
+	vec8 z13 = tmp7 - z3;
+
+	d[5] = z13 + z2;
+	d[3] = z13 - z2;
+	d[1] = z11 + z4;
+	d[7] = z11 - z4;
+}
+
+static inline void transpose(vec8 *d)
+{
+	for (uint8_t i = 0; i < 8; ++i) {
+		for (uint8_t j = i + 1; j < 8; ++j) {
+			float t = d[i][j];
+
+			d[i][j] = d[j][i];
+			d[j][i] = t;
+		}
+	}
+}
+
+static inline uint8_t nbits(int v)
+{
+	return v ? 32 - __builtin_clz(v < 0 ? -v : v) : 0;
+}
+
+void jpeg_encoder::put(uint32_t code, uint8_t len)
+{
+	acc_ = (acc_ << len) | code;
+	bits_ += len;
+
+	if (bits_ >= 32)
+		flush();
+}
+
+/* whole bytes out, 0xff gets stuffed with zero */
+void jpeg_encoder::flush()
+{
+	while (bits_ >= 8) {
+		uint8_t b = acc_ >> (bits_ - 8);
+
+		out_[len_++] = b;
+		if (b == 0xff)
+			out_[len_++] = 0;
+
+		bits_ -= 8;
+	}
+}
+
+bool jpeg_encoder::reserve(uint32_t bytes)
+{
+	uint8_t *out;
+	uint32_t cap = cap_ ? cap_ : 1 << 16;
+
+	if (len_ + bytes <= cap_)
+		return true;
+
+	while (cap < len_ + bytes)
+		cap *= 2;
+
+	if (!(out = (uint8_t *) realloc(out_, cap))) {
+		ee("failed to grow jpeg buffer to %u bytes\n", cap);
+		return false;
+	}
+
+	out_ = out;
+	cap_ = cap;
+	return true;
+}
+
+void jpeg_encoder::block(const struct plane *p, uint32_t x, uint32_t y,
+ uint8_t comp)
+{
+	uint8_t t = comp ? 1 : 0;
+	const struct huff *dc = &huff_[t * 2];
+	const struct huff *ac = &huff_[t * 2 + 1];
+	vec8 d[8];
+	ivec8 q[8];
+	int16_t zz[64];
+	uint64_t mask = 0;
+
+	for (uint8_t i = 0; i < 8; ++i) {
+		uint32_t row = y + i < p->h ? y + i : p->h - 1;
+		const uint8_t *src = p->data + row * p->stride;
+		u8x8 px;
+
+		if (x + 8 <= p->w) {
+			memcpy(&px, src + x, sizeof(px));
+		} else { /* replicate right edge */
+			for (uint8_t j = 0; j < 8; ++j)
+				px[j] = src[x + j < p->w ? x + j : p->w - 1];
+		}
+
+		/* range conversion and level shift in one go */
+		d[i] = __builtin_convertvector(px, vec8) * scale_[t] + bias_[t];
+	}
+
+	fdct(d);
+	transpose(d);
+	fdct(d);
+
+	for (uint8_t i = 0; i < 8; ++i) {
+		vec8 div;
+
+		memcpy(&div, &div_[t][i * 8], sizeof(div));
+		d[i] = d[i] * div + 16384.5f; /* round half up as IJG does */
+		q[i] = __builtin_convertvector(d[i], ivec8) - 16384;
+	}
+
+	/* zigzag order plus mask of non-zero AC terms, so coding below only
+	 * visits coefficients that produce symbols
+	 */
+	const int *qs = (const int *) q;
+
+	for (uint8_t k = 0; k < 64; ++k) {
+		zz[k] = qs[zz_out_[k]];
+		mask |= (uint64_t) (zz[k] != 0) << k;
+	}
+
+	int diff = zz[0] - dc_[comp];
+	uint8_t nb = nbits(diff);
+
+	dc_[comp] = zz[0];
+	if (diff < 0)
+		diff--;
+
+	put((dc->code[nb] << nb) | (diff & ((1 << nb) - 1)), dc->size[nb] + nb);
+
+	uint8_t k = 0;
+	for (mask &= ~1ULL; mask; mask &= mask - 1) {
+		uint8_t next = __builtin_ctzll(mask);
+		uint8_t run = next - k - 1;
+		int v = zz[next];
+
+		for (; run > 15; run -= 16)
+			put(ac->code[0xf0], ac->size[0xf0]);
+
+		nb = nbits(v);
+		if (v < 0)
+			v--;
+
+		uint8_t sym = (run << 4) | nb;
+		put((ac->code[sym] << nb) | (v & ((1 << nb) - 1)),
+		 ac->size[sym] + nb);
+		k = next;
+	}
+
+	if (k != 63)
+		put(ac->code[0], ac->size[0]); /* end of block */
+}
+
+/* JFIF equations with 8-bit coefficients, within one step of 16.16 ones;
+ * every result fits 16 bits, so wrapping u16x16 lanes give it exactly too,
+ * hence macros as they take int and vectors alike
+ */
+#define YCC_Y(r, g, b) ((77 * (r) + 150 * (g) + 29 * (b) + 128) >> 8)
+#define YCC_CB(r, g, b) ((128 * (b) - 43 * (r) - 85 * (g) + 32895) >> 8)
+#define YCC_CR(r, g, b) ((128 * (r) - 107 * (g) - 21 * (b) + 32895) >> 8)
+
+/* Sixteen RGB pixels at once; each pixel is fetched with one 32-bit load,
+ * so caller must have at least one more byte past last one, then channels
+ * are masked out by little endian bit shift of their byte offsets
+ */
+static inline void rgb_ycc16(const uint8_t *src, const uint8_t *shift,
+ uint8_t *y, uint8_t *cb, uint8_t *cr)
+{
+	u32x16 px;
+	u8x16 out;
+
+	for (uint8_t k = 0; k < 16; ++k)
+		memcpy((uint32_t *) &px + k, src + k * 3, sizeof(uint32_t));
+
+	u16x16 r = __builtin_convertvector((px >> shift[0]) & 0xff, u16x16);
+	u16x16 g = __builtin_convertvector((px >> shift[1]) & 0xff, u16x16);
+	u16x16 b = __builtin_convertvector((px >> shift[2]) & 0xff, u16x16);
+
+	out = __builtin_convertvector(YCC_Y(r, g, b), u8x16);
+	memcpy(y, &out, sizeof(out));
+	out = __builtin_convertvector(YCC_CB(r, g, b), u8x16);
+	memcpy(cb, &out, sizeof(out));
+	out = __builtin_convertvector(YCC_CR(r, g, b), u8x16);
+	memcpy(cr, &out, sizeof(out));
+}
+
+/* Split frame into 8-bit planes the block loader can index directly */
+bool jpeg_encoder::planarize(const struct slot *s)
+{
+	const struct format *f = find_format(s->fmt);
+	uint32_t luma = (uint32_t) s->w * s->h;
+	uint32_t stride;
+	uint32_t need;
+	uint8_t *y;
+	uint8_t *cb;
+	uint8_t *cr;
+
+	if (!f || f->layout == layout::jpeg)
+		return false;
+
+	stride = s->stride ? s->stride : line_bytes(*f, s->w);
+	need = f->layout == layout::yuv_semiplanar ? luma / 2 : luma * 3;
+	if (need > scratch_size_) {
+		free(scratch_);
+		if (!(scratch_ = (uint8_t *) malloc(need))) {
+			scratch_size_ = 0;
+			return false;
+		}
+
+		scratch_size_ = need;
+	}
+
+	/* camera YUV is limited range, JFIF expects full range */
+	scale_[0] = 255.f / 219.f;
+	bias_[0] = -16.f * 255.f / 219.f - 128.f;
+	scale_[1] = 255.f / 224.f;
+	bias_[1] = -128.f * 255.f / 224.f;
+
+	if (f->layout == layout::rgb) {
+		const uint8_t shift[] = {
+			(uint8_t) (f->off[0] * 8),
+			(uint8_t) (f->off[1] * 8),
+			(uint8_t) (f->off[2] * 8),
+		};
+
+		y = scratch_;
+		cb = y + luma;
+		cr = cb + luma;
+		for (uint16_t i = 0; i < s->h; ++i) {
+			const uint8_t *src = s->data + i * stride;
+			uint32_t o = i * s->w;
+			uint16_t j = 0;
+
+			/* keep last pixel for the tail, the row may end
+			 * right at the end of frame
+			 */
+			for (; j + 16 < s->w; j += 16, src += 48)
+				rgb_ycc16(src, shift, y + o + j, cb + o + j,
+				 cr + o + j);
+
+			for (; j < s->w; ++j, src += 3) {
+				int32_t r = src[f->off[0]];
+				int32_t g = src[f->off[1]];
+				int32_t b = src[f->off[2]];
+
+				y[o + j] = YCC_Y(r, g, b);
+				cb[o + j] = YCC_CB(r, g, b);
+				cr[o + j] = YCC_CR(r, g, b);
+			}
+		}
+
+		planes_[0] = { y, s->w, s->w, s->h };
+		planes_[1] = { cb, s->w, s->w, s->h };
+		planes_[2] = { cr, s->w, s->w, s->h };
+		hs_ = vs_ = 1;
+		scale_[0] = scale_[1] = 1.f;
+		bias_[0] = bias_[1] = -128.f;
+	} else if (f->layout == layout::yuv_packed) {
+		uint16_t cw = s->w / 2;
+
+		y = scratch_;
+		cb = y + luma;
+		cr = cb + cw * s->h;
+		for (uint16_t i = 0; i < s->h; ++i) {
+			const uint8_t *src = s->data + i * stride;
+
+			for (uint16_t j = 0; j < cw; ++j, src += 4) {
+				y[i * s->w + j * 2] = src[f->off[0]];
+				y[i * s->w + j * 2 + 1] = src[f->off[2]];
+				cb[i * cw + j] = src[f->off[1]];
+				cr[i * cw + j] = src[f->off[3]];
+			}
+		}
+
+		planes_[0] = { y, s->w, s->w, s->h };
+		planes_[1] = { cb, cw, cw, s->h };
+		planes_[2] = { cr, cw, cw, s->h };
+		hs_ = 2;
+		vs_ = 1;
+	} else {
+		const uint8_t *uv = s->data + stride * s->h;
+		uint16_t cw = s->w / 2;
+		uint16_t ch = s->h / 2;
+
+		cb = scratch_;
+		cr = cb + cw * ch;
+		for (uint16_t i = 0; i < ch; ++i) {
+			const uint8_t *src = uv + i * stride;
+
+			for (uint16_t j = 0; j < cw; ++j, src += 2) {
+				cb[i * cw + j] = src[f->off[1]];
+				cr[i * cw + j] = src[f->off[3]];
+			}
+		}
+
+		planes_[0] = { s->data, stride, s->w, s->h }; /* as is */
+		planes_[1] = { cb, cw, cw, ch };
+		planes_[2] = { cr, cw, cw, ch };
+		hs_ = vs_ = 2;
+	}
+
+	return true;
+}
+
+void jpeg_encoder::headers(uint16_t w, uint16_t h)
+{
+	static const uint8_t app0[] = {
+		0xff, 0xd8, 0xff, 0xe0, 0, 16, 'J', 'F', 'I', 'F', 0, 1, 1, 0,
+		0, 1, 0, 1, 0, 0,
+	};
+	uint8_t *p = out_ + len_;
+	uint16_t dht = 2;
+
+	memcpy(p, app0, sizeof(app0));
+	p += sizeof(app0);
+
+	*p++ = 0xff; *p++ = 0xdb; *p++ = 0; *p++ = 2 + 2 * 65;
+	for (uint8_t t = 0; t < 2; ++t) {
+		*p++ = t;
+		memcpy(p, quant_[t], 64);
+		p += 64;
+	}
+
+	*p++ = 0xff; *p++ = 0xc0; *p++ = 0; *p++ = 17; *p++ = 8;
+	*p++ = h >> 8; *p++ = h; *p++ = w >> 8; *p++ = w; *p++ = 3;
+	*p++ = 1; *p++ = (hs_ << 4) | vs_; *p++ = 0;
+	*p++ = 2; *p++ = 0x11; *p++ = 1;
+	*p++ = 3; *p++ = 0x11; *p++ = 1;
+
+	for (uint8_t t = 0; t < 4; ++t)
+		dht += 17 + huff_specs_[t].cnt;
+
+	*p++ = 0xff; *p++ = 0xc4; *p++ = dht >> 8; *p++ = dht;
+	for (uint8_t t = 0; t < 4; ++t) {
+		*p++ = huff_specs_[t].id;
+		memcpy(p, huff_specs_[t].bits, 16);
+		p += 16;
+		memcpy(p, huff_specs_[t].vals, huff_specs_[t].cnt);
+		p += huff_specs_[t].cnt;
+	}
+
+	*p++ = 0xff; *p++ = 0xda; *p++ = 0; *p++ = 12; *p++ = 3;
+	*p++ = 1; *p++ = 0x00;
+	*p++ = 2; *p++ = 0x11;
+	*p++ = 3; *p++ = 0x11;
+	*p++ = 0; *p++ = 63; *p++ = 0;
+
+	len_ = p - out_;
+}
+
+bool jpeg_encoder::scan()
+{
+	uint16_t mw = 8 * hs_;
+	uint16_t mh = 8 * vs_;
+	uint16_t cols = (planes_[0].w + mw - 1) / mw;
+	uint16_t rows = (planes_[0].h + mh - 1) / mh;
+
+	for (uint16_t my = 0; my < rows; ++my) {
+		for (uint16_t mx = 0; mx < cols; ++mx) {
+			if (!reserve(MCU_MAX_BYTES))
+				return false;
+
+			for (uint8_t by = 0; by < vs_; ++by) {
+				for (uint8_t bx = 0; bx < hs_; ++bx) {
+					block(&planes_[0], mx * mw + bx * 8,
+					 my * mh + by * 8, 0);
+				}
+			}
+
+			block(&planes_[1], mx * 8, my * 8, 1);
+			block(&planes_[2], mx * 8, my * 8, 2);
+		}
+	}
+
+	return true;
+}
+
+uint32_t jpeg_encoder::encode(const struct slot *s, const uint8_t **out)
+{
+	if (!planarize(s))
+		return 0;
+
+	len_ = 0;
+	acc_ = 0;
+	bits_ = 0;
+	dc_[0] = dc_[1] = dc_[2] = 0;
+
+	if (!reserve(1024))
+		return 0;
+
+	headers(s->w, s->h);
+	if (!scan())
+		return 0;
+
+	put(0x7f, 7); /* pad last byte with ones */
+	if (!reserve(16))
+		return 0;
+
+	flush();
+	out_[len_++] = 0xff;
+	out_[len_++] = 0xd9;
+	*out = out_;
+	return len_;
+}
+
+bool standard_dht(const uint8_t *d, uint32_t len)
+{
+	const struct huff_spec *spec;
+	uint32_t i = 0;
+	uint16_t cnt;
+
+	while (i + 17 <= len) {
+		spec = nullptr;
+		for (uint8_t t = 0; t < 4; ++t) {
+			if (huff_specs_[t].id == d[i])
+				spec = &huff_specs_[t];
+		}
+
+		cnt = 0;
+		for (uint8_t k = 0; k < 16; ++k)
+			cnt += d[i + 1 + k];
+
+		if (!spec || cnt != spec->cnt || i + 17 + cnt > len ||
+		 memcmp(d + i + 1, spec->bits, 16) != 0 ||
+		 memcmp(d + i + 17, spec->vals, cnt) != 0)
+			return false;
+
+		i += 17 + cnt;
+	}
+
+	return i == len;
+}
+
+} // namespace camera
@@ -0,0 +1,64 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef JPEG_H
+#define JPEG_H
+
+#include <stdint.h>
+
+#include "pool.h"
+
+namespace camera {
+
+/* Baseline JFIF encoder for raw frames. YUV sources keep their chroma
+ * subsampling (4:2:2 packed, 4:2:0 semiplanar) and RGB is encoded as
+ * 4:4:4. One instance per thread, scratch and output buffers are reused
+ * from frame to frame.
+ */
+class jpeg_encoder {
+public:
+	jpeg_encoder(uint8_t quality);
+	~jpeg_encoder();
+	uint32_t encode(const struct slot *, const uint8_t **out);
+private:
+	struct plane {
+		const uint8_t *data;
+		uint32_t stride;
+		uint16_t w;
+		uint16_t h;
+	};
+	bool planarize(const struct slot *);
+	void headers(uint16_t w, uint16_t h);
+	bool scan();
+	void block(const struct plane *, uint32_t x, uint32_t y, uint8_t comp);
+	bool reserve(uint32_t bytes);
+	void put(uint32_t code, uint8_t len);
+	void flush();
+	float div_[2][64]; /* 1 / (quant * DCT scale) in DCT output order */
+	uint8_t quant_[2][64]; /* zigzag order, as stored in DQT */
+	struct plane planes_[3];
+	uint8_t hs_; /* luma blocks per MCU */
+	uint8_t vs_;
+	float scale_[2]; /* sample to level shifted value, luma and chroma */
+	float bias_[2];
+	int dc_[3];
+	uint8_t *scratch_ = nullptr;
+	uint32_t scratch_size_ = 0;
+	uint8_t *out_ = nullptr;
+	uint32_t cap_ = 0;
+	uint32_t len_ = 0;
+	uint64_t acc_ = 0;
+	uint8_t bits_ = 0;
+};
+
+/* True if every table in DHT segment payload is the Annex K one for its
+ * class and slot, which is what RFC 2435 receivers assume
+ */
+bool standard_dht(const uint8_t *d, uint32_t len);
+
+}
+
+#endif // JPEG_H
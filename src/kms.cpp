@@ -0,0 +1,374 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "display.h"
+#include "log.h"
+
+namespace display {
+
+static constexpr const char *KMS_DEVICE = "/dev/dri/card0";
+static constexpr uint8_t KMS_BUFFERS = 2;
+
+static volatile sig_atomic_t quit_;
+
+static void quit_cb(int)
+{
+	quit_ = 1;
+}
+
+struct dumb {
+	uint32_t handle;
+	uint32_t fb;
+	uint32_t pitch;
+	uint64_t size;
+	uint8_t *map;
+	uint64_t capture_ns; /* frame being scanned out */
+};
+
+struct flip_stats {
+	uint64_t last_us;
+	uint64_t min_us;
+	uint64_t max_us;
+	uint64_t sum_us;
+	uint32_t cnt;
+	uint32_t skipped; /* frames arriving while flip was pending */
+};
+
+/* Frames go to dumb buffers scanned out by the CRTC primary plane. Next
+ * frame is flipped in only after previous flip completed, so presentation
+ * is paced by the display and never queues behind vblank.
+ */
+class kms : public backend {
+public:
+	~kms();
+	bool init(const char *path);
+	bool present(const struct camera::slot *) override;
+	bool dispatch() override;
+	void wait() override;
+	bool hidden() override { return false; }
+private:
+	bool find_output();
+	bool create_buffer(struct dumb *);
+	void destroy_buffer(struct dumb *);
+	static void flip_cb(int fd, unsigned int seq, unsigned int sec,
+	 unsigned int usec, void *data);
+	int fd_ = -1;
+	uint32_t conn_ = 0;
+	uint32_t crtc_ = 0;
+	drmModeModeInfo mode_;
+	drmModeCrtcPtr saved_ = nullptr;
+	struct dumb bufs_[KMS_BUFFERS] = {};
+	uint8_t front_ = 0;
+	bool pending_ = false;
+	struct flip_stats stats_ = {};
+	scaler scaler_;
+};
+
+kms::~kms()
+{
+	if (fd_ < 0)
+		return;
+
+	while (pending_ && !quit_) { /* let last flip land before teardown */
+		struct pollfd fds = { fd_, POLLIN, 0 };
+
+		if (poll(&fds, 1, 100) <= 0)
+			break;
+
+		dispatch();
+	}
+
+	if (saved_) {
+		drmModeSetCrtc(fd_, saved_->crtc_id, saved_->buffer_id,
+		 saved_->x, saved_->y, &conn_, 1, &saved_->mode);
+		drmModeFreeCrtc(saved_);
+	}
+
+	for (uint8_t i = 0; i < KMS_BUFFERS; ++i)
+		destroy_buffer(&bufs_[i]);
+
+	if (stats_.cnt) {
+		ii("flip-to-flip us: min %llu avg %llu max %llu; %u flips, "
+		 "%u frames skipped\n", (unsigned long long) stats_.min_us,
+		 (unsigned long long) (stats_.sum_us / stats_.cnt),
+		 (unsigned long long) stats_.max_us, stats_.cnt,
+		 stats_.skipped);
+	}
+
+	latency.report("capture-to-scanout");
+	close(fd_);
+}
+
+bool kms::find_output()
+{
+	drmModeResPtr res;
+	drmModeConnectorPtr conn = nullptr;
+	drmModeEncoderPtr enc;
+
+	if (!(res = drmModeGetResources(fd_))) {
+		ee("drmModeGetResources failed, errno %d\n", errno);
+		return false;
+	}
+
+	for (int i = 0; i < res->count_connectors; ++i) {
+		conn = drmModeGetConnector(fd_, res->connectors[i]);
+
+		if (conn && conn->connection == DRM_MODE_CONNECTED &&
+		 conn->count_modes > 0)
+			break;
+
+		drmModeFreeConnector(conn);
+		conn = nullptr;
+	}
+
+	if (!conn) {
+		ee("no connected output\n");
+		drmModeFreeResources(res);
+		return false;
+	}
+
+	conn_ = conn->connector_id;
+	mode_ = conn->modes[0]; /* usually preferred, but not guaranteed */
+	for (int i = 0; i < conn->count_modes; ++i) {
+		if (conn->modes[i].type & DRM_MODE_TYPE_PREFERRED) {
+			mode_ = conn->modes[i];
+			break;
+		}
+	}
+
+	if (conn->encoder_id && (enc = drmModeGetEncoder(fd_,
+	 conn->encoder_id))) {
+		crtc_ = enc->crtc_id;
+		drmModeFreeEncoder(enc);
+	}
+
+	for (int i = 0; !crtc_ && i < conn->count_encoders; ++i) {
+		if (!(enc = drmModeGetEncoder(fd_, conn->encoders[i])))
+			continue;
+
+		for (int j = 0; j < res->count_crtcs; ++j) {
+			if (enc->possible_crtcs & (1 << j)) {
+				crtc_ = res->crtcs[j];
+				break;
+			}
+		}
+
+		drmModeFreeEncoder(enc);
+	}
+
+	drmModeFreeConnector(conn);
+	drmModeFreeResources(res);
+
+	if (!crtc_) {
+		ee("no crtc for connector %u\n", conn_);
+		return false;
+	}
+
+	ii("kms output %ux%u@%u on connector %u crtc %u\n", mode_.hdisplay,
+	 mode_.vdisplay, mode_.vrefresh, conn_, crtc_);
+	return true;
+}
+
+bool kms::create_buffer(struct dumb *buf)
+{
+	struct drm_mode_create_dumb create;
+	struct drm_mode_map_dumb map;
+
+	memset(&create, 0, sizeof(create));
+	create.width = mode_.hdisplay;
+	create.height = mode_.vdisplay;
+	create.bpp = 32;
+
+	if (drmIoctl(fd_, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
+		ee("DRM_IOCTL_MODE_CREATE_DUMB failed, errno %d\n", errno);
+		return false;
+	}
+
+	buf->handle = create.handle;
+	buf->pitch = create.pitch;
+	buf->size = create.size;
+
+	if (drmModeAddFB(fd_, create.width, create.height, 24, 32, buf->pitch,
+	 buf->handle, &buf->fb) < 0) {
+		ee("drmModeAddFB failed, errno %d\n", errno);
+		return false;
+	}
+
+	memset(&map, 0, sizeof(map));
+	map.handle = buf->handle;
+	if (drmIoctl(fd_, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+		ee("DRM_IOCTL_MODE_MAP_DUMB failed, errno %d\n", errno);
+		return false;
+	}
+
+	buf->map = (uint8_t *) mmap(NULL, buf->size, PROT_READ | PROT_WRITE,
+	 MAP_SHARED, fd_, map.offset);
+	if (buf->map == MAP_FAILED) {
+		buf->map = nullptr;
+		ee("failed to map dumb buffer\n");
+		return false;
+	}
+
+	memset(buf->map, 0, buf->size);
+	return true;
+}
+
+void kms::destroy_buffer(struct dumb *buf)
+{
+	struct drm_mode_destroy_dumb destroy;
+
+	if (buf->map)
+		munmap(buf->map, buf->size);
+	if (buf->fb)
+		drmModeRmFB(fd_, buf->fb);
+
+	if (buf->handle) {
+		memset(&destroy, 0, sizeof(destroy));
+		destroy.handle = buf->handle;
+		drmIoctl(fd_, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	}
+
+	memset(buf, 0, sizeof(*buf));
+}
+
+bool kms::init(const char *path)
+{
+	uint64_t cap = 0;
+
+	if ((fd_ = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+		ee("failed to open '%s'\n", path);
+		return false;
+	} else if (drmGetCap(fd_, DRM_CAP_DUMB_BUFFER, &cap) < 0 || !cap) {
+		ee("'%s' has no dumb buffers\n", path);
+		return false;
+	} else if (!find_output()) {
+		return false;
+	}
+
+	for (uint8_t i = 0; i < KMS_BUFFERS; ++i) {
+		if (!create_buffer(&bufs_[i]))
+			return false;
+	}
+
+	saved_ = drmModeGetCrtc(fd_, crtc_);
+	if (drmModeSetCrtc(fd_, crtc_, bufs_[0].fb, 0, 0, &conn_, 1,
+	 &mode_) < 0) {
+		ee("drmModeSetCrtc failed, errno %d; DRM master?\n", errno);
+		return false;
+	}
+
+	signal(SIGINT, quit_cb);
+	signal(SIGTERM, quit_cb);
+	return true;
+}
+
+void kms::flip_cb(int, unsigned int, unsigned int sec, unsigned int usec,
+ void *data)
+{
+	kms *self = (kms *) data;
+	struct flip_stats *st = &self->stats_;
+	uint64_t now = (uint64_t) sec * 1000000 + usec;
+
+	self->pending_ = false;
+	/* flip timestamp is CLOCK_MONOTONIC vblank time */
+	self->presented(self->bufs_[self->front_].capture_ns, now * 1000);
+	if (st->last_us) {
+		uint64_t diff = now - st->last_us;
+
+		if (!st->cnt || diff < st->min_us)
+			st->min_us = diff;
+		if (diff > st->max_us)
+			st->max_us = diff;
+
+		st->sum_us += diff;
+		st->cnt++;
+	}
+
+	st->last_us = now;
+}
+
+bool kms::dispatch()
+{
+	struct pollfd fds = { fd_, POLLIN, 0 };
+	drmEventContext ev;
+
+	if (quit_)
+		return false;
+	else if (poll(&fds, 1, 0) <= 0)
+		return true;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.version = 2;
+	ev.page_flip_handler = flip_cb;
+	drmHandleEvent(fd_, &ev);
+	return true;
+}
+
+void kms::wait()
+{
+	struct pollfd fds = { fd_, POLLIN, 0 };
+
+	poll(&fds, 1, -1); /* flips or signals wake us up */
+}
+
+bool kms::present(const struct camera::slot *s)
+{
+	struct dumb *back;
+
+	if (pending_) { /* newest frame wins on next vblank */
+		stats_.skipped++;
+		return true;
+	}
+
+	if (scaler_.fit(s->w, s->h, mode_.hdisplay, mode_.vdisplay)) {
+		for (uint8_t i = 0; i < KMS_BUFFERS; ++i)
+			memset(bufs_[i].map, 0, bufs_[i].size);
+	}
+
+	back = &bufs_[front_ ^ 1];
+
+	/* center the picture, borders stay black */
+	uint32_t x = (mode_.hdisplay - scaler_.w) / 2;
+	uint32_t y = (mode_.vdisplay - scaler_.h) / 2;
+
+	scaler_.run(s->data, back->map + y * back->pitch + x * 4, back->pitch);
+	back->capture_ns = capture_ns(s);
+	if (drmModePageFlip(fd_, crtc_, back->fb, DRM_MODE_PAGE_FLIP_EVENT,
+	 this) < 0) {
+		ee("drmModePageFlip failed, errno %d\n", errno);
+		return false;
+	}
+
+	pending_ = true;
+	front_ ^= 1;
+	return true;
+}
+
+backend_ptr create_kms(const char *path)
+{
+	kms *out = new kms();
+
+	if (!out->init(path ? path : KMS_DEVICE)) {
+		delete out;
+		return nullptr;
+	}
+
+	return backend_ptr(out);
+}
+
+} // namespace display
@@ -0,0 +1,243 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <thread>
+#include <chrono>
+
+#include "log.h"
+
+namespace logger {
+
+static constexpr uint32_t RING_SIZE = 256; /* power of 2 */
+static constexpr uint16_t LINE_MAX = 240;
+static constexpr uint8_t DRAIN_MS = 10;
+static constexpr uint8_t BURST = 5; /* messages per second per call site */
+
+struct cell {
+	std::atomic<uint32_t> seq;
+	uint16_t len;
+	char text[LINE_MAX];
+};
+
+std::atomic<uint8_t> level_(LOG_LEVEL);
+
+static struct cell ring_[RING_SIZE];
+static std::atomic<uint32_t> head_;
+static uint32_t tail_; /* drain thread only */
+static std::atomic<uint32_t> lost_;
+static std::atomic<bool> run_;
+static std::thread thread_;
+static char out_[(RING_SIZE + 1) * LINE_MAX];
+
+static struct {
+	std::atomic<uint32_t> seq; /* odd while writer is busy */
+	char text[LINE_MAX];
+} status_;
+
+static inline uint32_t coarse_sec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now); /* vDSO, no syscall */
+	return now.tv_sec;
+}
+
+static struct cell *claim(uint32_t *ticket)
+{
+	struct cell *c;
+	uint32_t pos = head_.load(std::memory_order_relaxed);
+
+	while (1) {
+		c = &ring_[pos & (RING_SIZE - 1)];
+		int32_t diff = (int32_t) (c->seq.load(std::memory_order_acquire) -
+		 pos);
+
+		if (diff == 0) {
+			if (head_.compare_exchange_weak(pos, pos + 1,
+			 std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			lost_.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		} else {
+			pos = head_.load(std::memory_order_relaxed);
+		}
+	}
+
+	*ticket = pos;
+	return c;
+}
+
+void write(const char *fmt, ...)
+{
+	va_list args;
+	struct cell *c;
+	uint32_t pos;
+	int len;
+
+	va_start(args, fmt);
+	if (!run_.load(std::memory_order_relaxed)) {
+		vprintf(fmt, args);
+		va_end(args);
+		return;
+	} else if (!(c = claim(&pos))) {
+		va_end(args);
+		return;
+	}
+
+	len = vsnprintf(c->text, LINE_MAX, fmt, args);
+	va_end(args);
+
+	c->len = len < 0 ? 0 : (len >= LINE_MAX ? LINE_MAX - 1 : len);
+	c->seq.store(pos + 1, std::memory_order_release);
+}
+
+void status(const char *fmt, ...)
+{
+	va_list args;
+	uint32_t seq = status_.seq.load(std::memory_order_relaxed);
+
+	status_.seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	va_start(args, fmt);
+	vsnprintf(status_.text, LINE_MAX, fmt, args);
+	va_end(args);
+	status_.seq.store(seq + 2, std::memory_order_release);
+}
+
+bool allow(struct limiter *lim)
+{
+	uint32_t now = coarse_sec();
+	uint32_t sec = lim->sec.load(std::memory_order_relaxed);
+
+	if (sec != now && lim->sec.compare_exchange_strong(sec, now)) {
+		uint32_t n = lim->suppressed.exchange(0);
+
+		lim->cnt.store(0);
+		if (n)
+			write("(ww) %u repeated messages suppressed\n", n);
+	}
+
+	if (lim->cnt.fetch_add(1, std::memory_order_relaxed) < BURST)
+		return true;
+
+	lim->suppressed.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+static bool read_status(char *buf, uint32_t *last)
+{
+	uint32_t seq1;
+	uint32_t seq2;
+
+	do {
+		seq1 = status_.seq.load(std::memory_order_acquire);
+		if (seq1 == *last)
+			return false;
+
+		memcpy(buf, status_.text, LINE_MAX);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		seq2 = status_.seq.load(std::memory_order_relaxed);
+	} while ((seq1 & 1) || seq1 != seq2);
+
+	buf[LINE_MAX - 1] = '\0';
+	*last = seq1;
+	return true;
+}
+
+/* At most RING_SIZE cells per flush: freed cells get refilled meanwhile,
+ * and out_ only has room for that many lines and the lost messages note
+ */
+static size_t drain(size_t len)
+{
+	for (uint32_t i = 0; i < RING_SIZE; ++i) {
+		struct cell *c = &ring_[tail_ & (RING_SIZE - 1)];
+
+		if (c->seq.load(std::memory_order_acquire) != tail_ + 1)
+			break;
+
+		memcpy(out_ + len, c->text, c->len);
+		len += c->len;
+		c->seq.store(tail_ + RING_SIZE, std::memory_order_release);
+		tail_++;
+	}
+
+	return len;
+}
+
+static void flush(bool *shown)
+{
+	static uint32_t last;
+	static char line[LINE_MAX];
+	bool updated = read_status(line, &last);
+	size_t len = drain(0);
+	uint32_t lost;
+
+	if ((lost = lost_.exchange(0))) {
+		len += snprintf(out_ + len, LINE_MAX,
+		 "(ww) %u log messages lost\n", lost);
+	}
+
+	if (!len && !updated)
+		return;
+
+	if (len) {
+		if (*shown)
+			fputs("\033[G\033[K", stdout); /* wipe status line */
+
+		fwrite(out_, 1, len, stdout);
+	}
+
+	if ((*shown = !!last))
+		fputs(line, stdout);
+
+	fflush(stdout);
+}
+
+static void run(void)
+{
+	bool shown = false;
+
+	while (run_.load()) {
+		flush(&shown);
+		std::this_thread::sleep_for(std::chrono::milliseconds(DRAIN_MS));
+	}
+
+	flush(&shown);
+}
+
+bool start()
+{
+	if (run_.load())
+		return true;
+
+	for (uint32_t i = 0; i < RING_SIZE; ++i)
+		ring_[i].seq.store(i);
+
+	head_.store(0);
+	tail_ = 0;
+	run_.store(true);
+	thread_ = std::thread(run);
+	pthread_setname_np(thread_.native_handle(), "log");
+	atexit(stop); /* drain on exit() paths */
+	return true;
+}
+
+void stop()
+{
+	if (!run_.exchange(false))
+		return;
+	else if (thread_.joinable())
+		thread_.join();
+}
+
+} // namespace logger
@@ -7,9 +7,56 @@
 #ifndef LOG_H
 #define LOG_H
 
-#define ii(...) printf("(ii) " __VA_ARGS__)
-#define ww(...) printf("(ww) " __VA_ARGS__)
-#define ee(...) printf("(ee) " __VA_ARGS__)
+#include <stdint.h>
+#include <atomic>
+
+#define LOG_ERR 1
+#define LOG_WARN 2
+#define LOG_INFO 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+/* Messages are formatted by the caller into a lock-free ring and written
+ * out by a background thread, so logging never blocks or enters the kernel
+ * on capture and render threads. Each call site is rate limited.
+ */
+namespace logger {
+
+struct limiter {
+	std::atomic<uint32_t> sec;
+	std::atomic<uint32_t> cnt;
+	std::atomic<uint32_t> suppressed;
+};
+
+extern std::atomic<uint8_t> level_;
+
+bool start();
+void stop();
+bool allow(struct limiter *);
+void write(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void status(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static inline void set_level(uint8_t level) { level_.store(level); }
+
+static inline bool enabled(uint8_t level)
+{
+	return level <= LOG_LEVEL &&
+	 level <= level_.load(std::memory_order_relaxed);
+}
+
+}
+
+#define log_(level, tag, ...) do {\
+	static logger::limiter lim_;\
+	if (logger::enabled(level) && logger::allow(&lim_))\
+		logger::write("(" tag ") " __VA_ARGS__);\
+} while (0)
+
+#define ii(...) log_(LOG_INFO, "ii", __VA_ARGS__)
+#define ww(...) log_(LOG_WARN, "ww", __VA_ARGS__)
+#define ee(...) log_(LOG_ERR, "ee", __VA_ARGS__)
 #define nop(...) ;
 
 #endif /* LOG_H */
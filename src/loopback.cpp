@@ -0,0 +1,392 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+#include <glad/gl.h>
+
+#include "loopback.h"
+#include "format.h"
+#include "log.h"
+
+namespace display {
+
+static constexpr uint8_t RGBA = 4;
+
+/* Two RGBA pixels per lane, so pairs sharing chroma never need shuffles */
+typedef uint64_t u64x2 __attribute__((vector_size(16)));
+typedef uint32_t u32x2 __attribute__((vector_size(8)));
+typedef uint16_t u16x2 __attribute__((vector_size(4)));
+
+static constexpr uint8_t LANE_PIXELS = 4;
+
+static inline u64x2 load(const uint8_t *src)
+{
+	u64x2 out;
+	memcpy(&out, src, sizeof(out));
+	return out;
+}
+
+static inline u64x2 channel(u64x2 px, uint8_t byte)
+{
+	return px >> (byte * 8) & 0xff;
+}
+
+/* BT.601 limited range, as most capture devices produce */
+static inline u64x2 luma(u64x2 r, u64x2 g, u64x2 b)
+{
+	return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+
+/* r, g, b are sums of 1 << n pixels */
+static inline u64x2 chroma_u(u64x2 r, u64x2 g, u64x2 b, uint8_t n)
+{
+	return (112 * b + (128 << (8 + n)) + (1 << (7 + n)) - 38 * r - 74 * g)
+	 >> (8 + n);
+}
+
+static inline u64x2 chroma_v(u64x2 r, u64x2 g, u64x2 b, uint8_t n)
+{
+	return (112 * r + (128 << (8 + n)) + (1 << (7 + n)) - 94 * g - 18 * b)
+	 >> (8 + n);
+}
+
+/* 4 pixels into 8 bytes of macropixels */
+static inline void yuyv4(const uint8_t *src, uint8_t *dst)
+{
+	u64x2 px = load(src);
+	u64x2 r0 = channel(px, 0), g0 = channel(px, 1), b0 = channel(px, 2);
+	u64x2 r1 = channel(px, 4), g1 = channel(px, 5), b1 = channel(px, 6);
+	u64x2 r = r0 + r1, g = g0 + g1, b = b0 + b1;
+	u32x2 out = __builtin_convertvector(luma(r0, g0, b0) |
+	 chroma_u(r, g, b, 1) << 8 | luma(r1, g1, b1) << 16 |
+	 chroma_v(r, g, b, 1) << 24, u32x2);
+
+	memcpy(dst, &out, sizeof(out));
+}
+
+/* 4 pixels of two rows into 4 luma bytes each and 4 bytes of chroma */
+static inline void nv12x4(const uint8_t *src0, const uint8_t *src1,
+ uint8_t *y0, uint8_t *y1, uint8_t *uv)
+{
+	u64x2 px0 = load(src0);
+	u64x2 px1 = load(src1);
+	u64x2 r00 = channel(px0, 0), g00 = channel(px0, 1);
+	u64x2 b00 = channel(px0, 2), r01 = channel(px0, 4);
+	u64x2 g01 = channel(px0, 5), b01 = channel(px0, 6);
+	u64x2 r10 = channel(px1, 0), g10 = channel(px1, 1);
+	u64x2 b10 = channel(px1, 2), r11 = channel(px1, 4);
+	u64x2 g11 = channel(px1, 5), b11 = channel(px1, 6);
+	u64x2 r = r00 + r01 + r10 + r11;
+	u64x2 g = g00 + g01 + g10 + g11;
+	u64x2 b = b00 + b01 + b10 + b11;
+	u16x2 out;
+
+	out = __builtin_convertvector(luma(r00, g00, b00) |
+	 luma(r01, g01, b01) << 8, u16x2);
+	memcpy(y0, &out, sizeof(out));
+	out = __builtin_convertvector(luma(r10, g10, b10) |
+	 luma(r11, g11, b11) << 8, u16x2);
+	memcpy(y1, &out, sizeof(out));
+	out = __builtin_convertvector(chroma_u(r, g, b, 2) |
+	 chroma_v(r, g, b, 2) << 8, u16x2);
+	memcpy(uv, &out, sizeof(out));
+}
+
+loopback::~loopback()
+{
+	if (writer_.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			quit_ = true;
+		}
+
+		mapped_.notify_one();
+		writer_.join();
+		ii("loopback: %u read back, %u written, %u skipped busy,"
+		 " %u failed\n", read_, written_, busy_, failed_);
+	}
+
+	for (uint8_t i = 0; i < LOOPBACK_PBOS; ++i) {
+		if (ring_[i].fence)
+			glDeleteSync((GLsync) ring_[i].fence);
+		if (ring_[i].map) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, ring_[i].pbo);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		}
+		if (ring_[i].pbo)
+			glDeleteBuffers(1, &ring_[i].pbo);
+	}
+
+	if (fbo_)
+		glDeleteFramebuffers(1, &fbo_);
+	if (tex_)
+		glDeleteTextures(1, &tex_);
+	if (fd_ >= 0)
+		close(fd_);
+
+	free(out_);
+}
+
+/* dev is path with optional format suffix, e.g. /dev/video9:NV12 */
+bool loopback::init(const char *dev, uint16_t w, uint16_t h)
+{
+	const char *sep = strrchr(dev, ':');
+	const camera::format *f = camera::find_format(V4L2_PIX_FMT_YUYV);
+	struct v4l2_format fmt;
+	char path[256];
+	size_t len = sep ? (size_t) (sep - dev) : strlen(dev);
+
+	if (sep && (!(f = camera::find_format(sep + 1)) ||
+	 (f->fourcc != V4L2_PIX_FMT_YUYV && f->fourcc != V4L2_PIX_FMT_NV12))) {
+		ee("unsupported loopback format '%s', YUYV or NV12\n", sep + 1);
+		return false;
+	} else if (len >= sizeof(path)) {
+		ee("loopback device path is too long\n");
+		return false;
+	} else if (w % 2 || h % 2) {
+		ee("loopback needs even frame size, got %ux%u\n", w, h);
+		return false;
+	}
+
+	memcpy(path, dev, len);
+	path[len] = '\0';
+	if ((fd_ = open(path, O_WRONLY)) < 0) {
+		ee("failed to open '%s', errno %d\n", path, errno);
+		return false;
+	}
+
+	fmt_ = f->fourcc;
+	w_ = w;
+	h_ = h;
+	out_bytes_ = camera::image_bytes(*f, w, h);
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	fmt.fmt.pix.width = w;
+	fmt.fmt.pix.height = h;
+	fmt.fmt.pix.pixelformat = fmt_;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	fmt.fmt.pix.bytesperline = camera::line_bytes(*f, w);
+	fmt.fmt.pix.sizeimage = out_bytes_;
+	fmt.fmt.pix.colorspace = V4L2_COLORSPACE_SMPTE170M;
+	if (ioctl(fd_, VIDIOC_S_FMT, &fmt) < 0) {
+		ee("ioctl VIDIOC_S_FMT on '%s', errno %d\n", path, errno);
+		return false;
+	}
+
+	if (!(out_ = (uint8_t *) malloc(out_bytes_)))
+		return false;
+
+	glGenTextures(1, &tex_);
+	glBindTexture(GL_TEXTURE_2D, tex_);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA,
+	 GL_UNSIGNED_BYTE, NULL);
+	glGenFramebuffers(1, &fbo_);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+	 GL_TEXTURE_2D, tex_, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+	 GL_FRAMEBUFFER_COMPLETE) {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		ee("loopback framebuffer is incomplete\n");
+		return false;
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	for (uint8_t i = 0; i < LOOPBACK_PBOS; ++i) {
+		glGenBuffers(1, &ring_[i].pbo);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, ring_[i].pbo);
+		glBufferData(GL_PIXEL_PACK_BUFFER, (uint32_t) w * h * RGBA,
+		 NULL, GL_STREAM_READ);
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	writer_ = std::thread(&loopback::write_loop, this);
+	pthread_setname_np(writer_.native_handle(), "loopback");
+	ii("loopback %s %ux%u %s\n", path, w, h, f->name);
+	return true;
+}
+
+void loopback::render(unsigned int prog, unsigned int vao, unsigned int tex,
+ uint64_t capture_ns)
+{
+	struct entry *e = &ring_[head_];
+
+	if (e->state.load(std::memory_order_acquire) != ENTRY_FREE) {
+		busy_++;
+		return;
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+	glViewport(0, 0, w_, h_);
+	glUseProgram(prog);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glBindVertexArray(vao);
+	glDrawArrays(GL_TRIANGLES, 0, 6);
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, e->pbo);
+	glReadPixels(0, 0, w_, h_, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	e->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	e->capture_ns = capture_ns;
+	e->state.store(ENTRY_READING, std::memory_order_relaxed);
+	head_ = (head_ + 1) % LOOPBACK_PBOS;
+}
+
+/* Unmaps what writer is done with, maps what GPU finished reading back */
+void loopback::poll()
+{
+	struct entry *e;
+	GLenum rc;
+	bool handed = false;
+
+	for (uint8_t i = 0; i < LOOPBACK_PBOS; ++i) {
+		e = &ring_[i];
+		if (e->state.load(std::memory_order_acquire) != ENTRY_DONE)
+			continue;
+
+		if (e->map) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, e->pbo);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			e->map = nullptr;
+		}
+
+		e->state.store(ENTRY_FREE, std::memory_order_release);
+	}
+
+	while ((e = &ring_[tail_])->state.load(std::memory_order_relaxed) ==
+	 ENTRY_READING) {
+		rc = glClientWaitSync((GLsync) e->fence, 0, 0);
+		if (rc != GL_ALREADY_SIGNALED && rc != GL_CONDITION_SATISFIED)
+			break;
+
+		glDeleteSync((GLsync) e->fence);
+		e->fence = nullptr;
+		tail_ = (tail_ + 1) % LOOPBACK_PBOS;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, e->pbo);
+		e->map = (const uint8_t *) glMapBufferRange(
+		 GL_PIXEL_PACK_BUFFER, 0, (uint32_t) w_ * h_ * RGBA,
+		 GL_MAP_READ_BIT);
+		if (e->map)
+			read_++;
+
+		/* failed mapping still goes to writer to keep ring order */
+		e->state.store(e->map ? ENTRY_MAPPED : ENTRY_FAILED,
+		 std::memory_order_release);
+		handed = true;
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	if (handed) {
+		std::lock_guard<std::mutex> lock(lock_); /* pairs with wait */
+		mapped_.notify_one();
+	}
+}
+
+/* GL rows go bottom up, device rows top down */
+void loopback::convert(const uint8_t *src)
+{
+	uint32_t stride = (uint32_t) w_ * RGBA;
+	uint16_t tail = w_ % LANE_PIXELS;
+	uint16_t body = w_ - tail;
+	uint8_t pad[LANE_PIXELS * 2 * RGBA] = {};
+	uint8_t out[LANE_PIXELS * 2 * 2];
+	const uint8_t *row0;
+	const uint8_t *row1;
+	uint8_t *y0;
+	uint8_t *uv;
+
+	if (fmt_ == V4L2_PIX_FMT_YUYV) {
+		for (uint16_t y = 0; y < h_; ++y) {
+			row0 = src + (h_ - 1 - y) * stride;
+			y0 = out_ + (uint32_t) y * w_ * 2;
+			for (uint16_t x = 0; x < body; x += LANE_PIXELS)
+				yuyv4(row0 + x * RGBA, y0 + x * 2);
+
+			if (!tail)
+				continue;
+
+			memcpy(pad, row0 + body * RGBA, tail * RGBA);
+			yuyv4(pad, out);
+			memcpy(y0 + body * 2, out, tail * 2);
+		}
+
+		return;
+	}
+
+	uv = out_ + (uint32_t) w_ * h_;
+	for (uint16_t y = 0; y < h_; y += 2, uv += w_) {
+		row0 = src + (h_ - 1 - y) * stride;
+		row1 = row0 - stride;
+		y0 = out_ + (uint32_t) y * w_;
+		for (uint16_t x = 0; x < body; x += LANE_PIXELS)
+			nv12x4(row0 + x * RGBA, row1 + x * RGBA, y0 + x,
+			 y0 + w_ + x, uv + x);
+
+		if (!tail)
+			continue;
+
+		memcpy(pad, row0 + body * RGBA, tail * RGBA);
+		memcpy(pad + LANE_PIXELS * RGBA, row1 + body * RGBA,
+		 tail * RGBA);
+		nv12x4(pad, pad + LANE_PIXELS * RGBA, out, out + LANE_PIXELS,
+		 out + LANE_PIXELS * 2);
+		memcpy(y0 + body, out, tail);
+		memcpy(y0 + w_ + body, out + LANE_PIXELS, tail);
+		memcpy(uv + body, out + LANE_PIXELS * 2, tail);
+	}
+}
+
+void loopback::write_loop()
+{
+	struct entry *e;
+	uint8_t state;
+
+	while (1) {
+		e = &ring_[next_];
+		{
+			std::unique_lock<std::mutex> lock(lock_);
+			mapped_.wait(lock, [&] {
+				state = e->state.load(
+				 std::memory_order_acquire);
+				return quit_ || state == ENTRY_MAPPED ||
+				 state == ENTRY_FAILED;
+			});
+			if (quit_)
+				return;
+		}
+
+		next_ = (next_ + 1) % LOOPBACK_PBOS;
+		if (state == ENTRY_FAILED) {
+			e->state.store(ENTRY_DONE, std::memory_order_release);
+			continue;
+		}
+
+		convert(e->map);
+		e->state.store(ENTRY_DONE, std::memory_order_release);
+
+		if (write(fd_, out_, out_bytes_) == (ssize_t) out_bytes_) {
+			written_++;
+		} else if (!failed_++) {
+			ww("loopback write failed, errno %d\n", errno);
+		}
+	}
+}
+
+} // namespace display
@@ -0,0 +1,76 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace display {
+
+static constexpr uint8_t LOOPBACK_PBOS = 4;
+
+/* Feeds what GL path shows into v4l2loopback output device, so other
+ * programs see processed picture as yet another camera. Frame is drawn
+ * once more into offscreen target of camera size and read back into pixel
+ * pack buffer; buffer is mapped only once its fence signalled, a few
+ * frames later, so display loop never waits for GPU. Writer thread reads
+ * mapped buffer directly, converts it to YUYV or NV12 and writes it to the
+ * device; display loop only unmaps it on a later poll.
+ */
+class loopback {
+public:
+	~loopback();
+	bool init(const char *dev, uint16_t w, uint16_t h); /* GL current */
+	void render(unsigned int prog, unsigned int vao, unsigned int tex,
+	 uint64_t capture_ns); /* leaves viewport to caller */
+	void poll(); /* hand over finished readbacks, never waits */
+private:
+	enum state : uint8_t {
+		ENTRY_FREE,
+		ENTRY_READING, /* fence set, readback in flight */
+		ENTRY_MAPPED, /* writer's until done */
+		ENTRY_FAILED, /* not mapped, writer only skips it */
+		ENTRY_DONE, /* to unmap if mapped */
+	};
+	struct entry {
+		unsigned int pbo;
+		void *fence; /* GLsync */
+		const uint8_t *map;
+		uint64_t capture_ns;
+		std::atomic<uint8_t> state;
+	};
+	void write_loop();
+	void convert(const uint8_t *src);
+	int fd_ = -1;
+	uint32_t fmt_ = 0;
+	uint16_t w_ = 0;
+	uint16_t h_ = 0;
+	uint32_t out_bytes_ = 0;
+	uint8_t *out_ = nullptr;
+	unsigned int fbo_ = 0;
+	unsigned int tex_ = 0;
+	struct entry ring_[LOOPBACK_PBOS] = {};
+	uint8_t head_ = 0; /* next to render into */
+	uint8_t tail_ = 0; /* oldest in flight */
+	uint8_t next_ = 0; /* next for writer, entries go in ring order */
+	std::thread writer_;
+	std::mutex lock_;
+	std::condition_variable mapped_;
+	bool quit_ = false;
+	uint32_t read_ = 0;
+	uint32_t busy_ = 0; /* frames skipped, all buffers in flight */
+	uint32_t written_ = 0;
+	uint32_t failed_ = 0;
+};
+
+}
+
+#endif // LOOPBACK_H
@@ -0,0 +1,669 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lossless.h"
+#include "format.h"
+#include "log.h"
+
+namespace camera {
+
+static constexpr uint8_t BLOCK = 16; /* residuals sharing Rice parameter */
+static constexpr uint8_t K_MAX = 6;
+static constexpr uint8_t K_ZERO = 7; /* block header: all residuals zero */
+static constexpr uint8_t ESCAPE = 23; /* unary length that means raw byte */
+
+typedef uint8_t u8x16 __attribute__((vector_size(16)));
+typedef int8_t i8x16 __attribute__((vector_size(16)));
+
+enum slice_mode : uint8_t {
+	coded,
+	stored, /* coding did not pay off, noise */
+};
+
+struct bit_writer {
+	uint8_t *p;
+	uint64_t acc;
+	uint32_t bits;
+};
+
+struct bit_reader {
+	const uint8_t *p;
+	const uint8_t *end;
+	uint64_t acc; /* msb first */
+	uint32_t bits;
+};
+
+/* n is at most 32; always stores a word so flushing takes no branch, buffer
+ * needs four bytes of slack
+ */
+static inline void put(struct bit_writer *bw, uint64_t code, uint8_t n)
+{
+	uint32_t full;
+	uint32_t word;
+
+	bw->acc = (bw->acc << n) | code;
+	bw->bits += n;
+	full = bw->bits >> 5;
+	word = __builtin_bswap32(bw->acc >> (bw->bits & 31));
+	memcpy(bw->p, &word, 4);
+	bw->p += full * 4;
+	bw->bits &= 31;
+}
+
+static inline void flush(struct bit_writer *bw)
+{
+	while (bw->bits >= 8) {
+		*bw->p++ = bw->acc >> (bw->bits - 8);
+		bw->bits -= 8;
+	}
+
+	if (bw->bits) {
+		*bw->p++ = bw->acc << (8 - bw->bits);
+		bw->bits = 0;
+	}
+}
+
+/* keeps at least 56 bits in accumulator, zeros past the end */
+static inline void refill(struct bit_reader *br)
+{
+	if (br->end - br->p >= 8) {
+		uint64_t v;
+
+		memcpy(&v, br->p, 8);
+		br->acc |= __builtin_bswap64(v) >> br->bits;
+		br->p += (63 - br->bits) >> 3;
+		br->bits |= 56;
+		return;
+	}
+
+	while (br->bits <= 56) {
+		if (br->p < br->end)
+			br->acc |= (uint64_t) *br->p << (56 - br->bits);
+
+		br->p++;
+		br->bits += 8;
+	}
+}
+
+static inline uint32_t get(struct bit_reader *br, uint8_t n)
+{
+	uint32_t v = br->acc >> (64 - n);
+
+	br->acc <<= n;
+	br->bits -= n;
+	return v;
+}
+
+static inline uint8_t zigzag(uint8_t d)
+{
+	return (d << 1) ^ (uint8_t) ((int8_t) d >> 7);
+}
+
+static inline uint8_t unzigzag(uint8_t u)
+{
+	return (u >> 1) ^ (uint8_t) -(u & 1);
+}
+
+/* LOCO-I predictor, same as gradient clamped to neighbours range; written
+ * as clamp it compiles to conditional moves
+ */
+static inline uint8_t median(uint8_t a, uint8_t b, uint8_t c)
+{
+	int mx = a > b ? a : b;
+	int mn = a > b ? b : a;
+	int g = a + b - c;
+
+	g = g < mn ? mn : g;
+	return g > mx ? mx : g;
+}
+
+/* Prediction only looks at original samples, so whole row goes 16 lanes
+ * at a time
+ */
+static void predict(const uint8_t *cur, const uint8_t *up, uint16_t w,
+ uint8_t *res)
+{
+	uint16_t x = 1;
+
+	if (!up) {
+		res[0] = zigzag(cur[0] - 128);
+		for (; x < w; ++x)
+			res[x] = zigzag(cur[x] - cur[x - 1]);
+		return;
+	}
+
+	res[0] = zigzag(cur[0] - up[0]);
+	for (; x + 16 <= w; x += 16) {
+		u8x16 a, b, c, v;
+
+		memcpy(&a, cur + x - 1, 16);
+		memcpy(&b, up + x, 16);
+		memcpy(&c, up + x - 1, 16);
+		memcpy(&v, cur + x, 16);
+
+		u8x16 mx = a > b ? a : b;
+		u8x16 mn = a > b ? b : a;
+		u8x16 p = c >= mx ? mn : (c <= mn ? mx : a + b - c);
+		i8x16 d = (i8x16) (v - p);
+
+		v = (u8x16) ((d + d) ^ (d >> 7));
+		memcpy(res + x, &v, 16);
+	}
+
+	for (; x < w; ++x)
+		res[x] = zigzag(cur[x] - median(cur[x - 1], up[x], up[x - 1]));
+}
+
+static void unpredict(uint8_t *cur, const uint8_t *up, uint16_t w,
+ const uint8_t *res)
+{
+	if (!up) {
+		cur[0] = 128 + unzigzag(res[0]);
+		for (uint16_t x = 1; x < w; ++x)
+			cur[x] = cur[x - 1] + unzigzag(res[x]);
+		return;
+	}
+
+	/* left and upper left stay in registers, row stores may alias */
+	uint8_t a = up[0] + unzigzag(res[0]);
+	uint8_t c = up[0];
+
+	cur[0] = a;
+	for (uint16_t x = 1; x < w; ++x) {
+		uint8_t b = up[x];
+
+		a = median(a, b, c) + unzigzag(res[x]);
+		cur[x] = a;
+		c = b;
+	}
+}
+
+static void code_row(struct bit_writer *out, const uint8_t *res, uint16_t w)
+{
+	struct bit_writer bw = *out; /* local copy, byte stores may alias */
+
+	for (uint16_t x = 0; x < w; x += BLOCK) {
+		uint8_t n = w - x < BLOCK ? w - x : BLOCK;
+		uint32_t sum = 0;
+		uint32_t mean;
+		uint8_t k;
+
+		for (uint8_t i = 0; i < n; ++i)
+			sum += res[x + i];
+
+		if (!sum) {
+			put(&bw, K_ZERO, 3);
+			continue;
+		}
+
+		mean = sum / n;
+		k = mean ? 31 - __builtin_clz(mean) : 0;
+		if (k > K_MAX)
+			k = K_MAX;
+
+		put(&bw, k, 3);
+		for (uint8_t i = 0; i < n; ++i) {
+			uint8_t v = res[x + i];
+			uint8_t q = v >> k;
+
+			if (q < ESCAPE) /* q zeros, one, k low bits */
+				put(&bw, (1 << k) | (v & ((1 << k) - 1)),
+				 q + 1 + k);
+			else
+				put(&bw, (1 << 8) | v, ESCAPE + 1 + 8);
+		}
+	}
+
+	*out = bw;
+}
+
+static void decode_row(struct bit_reader *in, uint8_t *res, uint16_t w)
+{
+	struct bit_reader r = *in; /* local copy, byte stores may alias */
+	struct bit_reader *br = &r;
+
+	for (uint16_t x = 0; x < w; x += BLOCK) {
+		uint8_t n = w - x < BLOCK ? w - x : BLOCK;
+		uint8_t k;
+
+		refill(br);
+		if ((k = get(br, 3)) == K_ZERO) {
+			memset(res + x, 0, n);
+			continue;
+		}
+
+		for (uint8_t i = 0; i < n; ++i) {
+			uint8_t z;
+
+			refill(br);
+			z = br->acc ? __builtin_clzll(br->acc) : 64;
+			if (z < ESCAPE) {
+				get(br, z + 1);
+				res[x + i] = (z << k) | (k ? get(br, k) : 0);
+			} else {
+				get(br, ESCAPE + 1);
+				res[x + i] = get(br, 8);
+			}
+		}
+	}
+
+	*in = r;
+}
+
+static void load_row(const uint8_t *src, uint8_t step, int8_t ref,
+ uint16_t w, uint8_t *dst)
+{
+	if (step == 1 && !ref) {
+		memcpy(dst, src, w);
+	} else if (!ref) {
+		for (uint16_t x = 0; x < w; ++x)
+			dst[x] = src[x * step];
+	} else {
+		for (uint16_t x = 0; x < w; ++x)
+			dst[x] = src[x * step] - src[x * step + ref];
+	}
+}
+
+static void store_row(uint8_t *dst, uint8_t step, int8_t ref, uint16_t w,
+ const uint8_t *src)
+{
+	if (step == 1 && !ref) {
+		memcpy(dst, src, w);
+	} else if (!ref) {
+		for (uint16_t x = 0; x < w; ++x)
+			dst[x * step] = src[x];
+	} else {
+		for (uint16_t x = 0; x < w; ++x)
+			dst[x * step] = src[x] + dst[x * step + ref];
+	}
+}
+
+/* luma rows of slice i, even so 4:2:0 chroma splits along */
+static void slice_rows(uint16_t h, uint8_t cnt, uint8_t i, uint16_t &y0,
+ uint16_t &y1)
+{
+	y0 = (uint32_t) h * i / cnt & ~1;
+	y1 = i + 1 == cnt ? h : ((uint32_t) h * (i + 1) / cnt & ~1);
+}
+
+lossless_codec::lossless_codec(uint8_t threads)
+{
+	if (!threads)
+		threads = 1;
+	else if (threads > LOSSLESS_MAX_SLICES)
+		threads = LOSSLESS_MAX_SLICES;
+
+	threads_cnt_ = threads;
+	for (uint8_t i = 1; i < threads_cnt_; ++i) {
+		threads_[i] = std::thread(&lossless_codec::work, this, i);
+		pthread_setname_np(threads_[i].native_handle(), "lossless");
+	}
+}
+
+lossless_codec::~lossless_codec()
+{
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		quit_ = true;
+	}
+
+	go_.notify_all();
+	for (uint8_t i = 1; i < threads_cnt_; ++i)
+		threads_[i].join();
+
+	for (uint8_t i = 0; i < LOSSLESS_MAX_SLICES; ++i) {
+		free(slices_[i].buf);
+		free(slices_[i].rows);
+	}
+
+	free(out_);
+}
+
+bool lossless_codec::reserve(struct slice *s, uint32_t cap)
+{
+	uint8_t *buf;
+
+	if (s->cap >= cap)
+		return true;
+	else if (!(buf = (uint8_t *) realloc(s->buf, cap)))
+		return false;
+
+	s->buf = buf;
+	s->cap = cap;
+	return true;
+}
+
+bool lossless_codec::setup(uint32_t fmt, uint16_t w, uint16_t h,
+ uint32_t stride, uint32_t bytes, uint8_t *data)
+{
+	const struct format *f = find_format(fmt);
+	struct plane *p = planes_;
+
+	if (!f || f->layout == layout::jpeg || !w || !h) {
+		ee("no lossless coding for %s frames\n", format_name(fmt));
+		return false;
+	} else if (line_bytes(*f, w) > stride ||
+	 plane_bytes(*f, stride, h) > bytes) {
+		ee("%ux%u %s frame does not fit %u bytes\n", w, h, f->name,
+		 bytes);
+		return false;
+	}
+
+	switch (f->layout) {
+	case layout::rgb: /* green first, red and blue go as differences */
+		p[0] = { data + f->off[1], stride, w, h, 3, 0, 1 };
+		p[1] = { data + f->off[0], stride, w, h, 3,
+		 (int8_t) (f->off[1] - f->off[0]), 1 };
+		p[2] = { data + f->off[2], stride, w, h, 3,
+		 (int8_t) (f->off[1] - f->off[2]), 1 };
+		break;
+	case layout::yuv_packed:
+		p[0] = { data + f->off[0], stride, w, h, 2, 0, 1 };
+		p[1] = { data + f->off[1], stride, (uint16_t) (w / 2), h, 4, 0,
+		 1 };
+		p[2] = { data + f->off[3], stride, (uint16_t) (w / 2), h, 4, 0,
+		 1 };
+		break;
+	case layout::yuv_semiplanar:
+		p[0] = { data, stride, w, h, 1, 0, 1 };
+		p[1] = { data + stride * h + f->off[1], stride,
+		 (uint16_t) (w / 2), (uint16_t) (h / 2), 2, 0, 2 };
+		p[2] = { data + stride * h + f->off[3], stride,
+		 (uint16_t) (w / 2), (uint16_t) (h / 2), 2, 0, 2 };
+		break;
+	default:
+		return false;
+	}
+
+	planes_cnt_ = 3;
+	h_ = h;
+
+	if (row_max_ < w) { /* current, upper and residual rows */
+		for (uint8_t i = 0; i < LOSSLESS_MAX_SLICES; ++i) {
+			uint8_t *rows = (uint8_t *) realloc(slices_[i].rows,
+			 w * 3);
+
+			if (!rows)
+				return false;
+
+			slices_[i].rows = rows;
+		}
+
+		row_max_ = w;
+	}
+
+	return true;
+}
+
+void lossless_codec::encode_slice(uint8_t i)
+{
+	struct slice *s = &slices_[i];
+	uint8_t *cur = s->rows;
+	uint8_t *up = cur + row_max_;
+	uint8_t *res = up + row_max_;
+	uint32_t raw = 0;
+	uint16_t y0;
+	uint16_t y1;
+
+	slice_rows(h_, slices_cnt_, i, y0, y1);
+	for (uint8_t n = 0; n < planes_cnt_; ++n) {
+		const struct plane *p = &planes_[n];
+
+		raw += (y1 / p->sub_h - y0 / p->sub_h) * p->w;
+	}
+
+	/* coded rows may overshoot raw size by one row before we notice */
+	if (!(s->ok = reserve(s, 1 + raw + row_max_ * 4 + 8)))
+		return;
+
+	struct bit_writer bw = { s->buf + 1, 0, 0 };
+	const uint8_t *limit = s->buf + 1 + raw;
+
+	s->buf[0] = slice_mode::coded;
+	for (uint8_t n = 0; n < planes_cnt_; ++n) {
+		const struct plane *p = &planes_[n];
+		uint16_t r0 = y0 / p->sub_h;
+		uint16_t r1 = y1 / p->sub_h;
+
+		for (uint16_t r = r0; r < r1; ++r) {
+			uint8_t *tmp;
+
+			load_row(p->base + r * p->stride, p->step, p->ref, p->w,
+			 cur);
+			predict(cur, r == r0 ? nullptr : up, p->w, res);
+			code_row(&bw, res, p->w);
+			if (bw.p > limit)
+				goto store;
+
+			tmp = up;
+			up = cur;
+			cur = tmp;
+		}
+	}
+
+	flush(&bw);
+	if (bw.p <= limit) {
+		s->len = bw.p - s->buf;
+		return;
+	}
+
+store:
+	s->buf[0] = slice_mode::stored;
+	s->len = 1;
+	for (uint8_t n = 0; n < planes_cnt_; ++n) {
+		const struct plane *p = &planes_[n];
+
+		for (uint16_t r = y0 / p->sub_h; r < y1 / p->sub_h; ++r) {
+			load_row(p->base + r * p->stride, p->step, p->ref, p->w,
+			 s->buf + s->len);
+			s->len += p->w;
+		}
+	}
+}
+
+void lossless_codec::decode_slice(uint8_t i)
+{
+	struct slice *s = &slices_[i];
+	uint8_t *cur = s->rows;
+	uint8_t *up = cur + row_max_;
+	uint8_t *res = up + row_max_;
+	uint16_t y0;
+	uint16_t y1;
+
+	s->ok = false;
+	if (!s->len)
+		return;
+
+	slice_rows(h_, slices_cnt_, i, y0, y1);
+	if (s->in[0] == slice_mode::stored) {
+		const uint8_t *in = s->in + 1;
+		const uint8_t *end = s->in + s->len;
+
+		for (uint8_t n = 0; n < planes_cnt_; ++n) {
+			const struct plane *p = &planes_[n];
+
+			for (uint16_t r = y0 / p->sub_h; r < y1 / p->sub_h;
+			 ++r) {
+				if (in + p->w > end)
+					return;
+
+				store_row(p->base + r * p->stride, p->step,
+				 p->ref, p->w, in);
+				in += p->w;
+			}
+		}
+
+		s->ok = true;
+		return;
+	}
+
+	struct bit_reader br = { s->in + 1, s->in + s->len, 0, 0 };
+
+	for (uint8_t n = 0; n < planes_cnt_; ++n) {
+		const struct plane *p = &planes_[n];
+		uint16_t r0 = y0 / p->sub_h;
+		uint16_t r1 = y1 / p->sub_h;
+
+		for (uint16_t r = r0; r < r1; ++r) {
+			uint8_t *tmp;
+
+			decode_row(&br, res, p->w);
+			unpredict(cur, r == r0 ? nullptr : up, p->w, res);
+			store_row(p->base + r * p->stride, p->step, p->ref,
+			 p->w, cur);
+
+			tmp = up;
+			up = cur;
+			cur = tmp;
+		}
+	}
+
+	s->ok = br.p - br.bits / 8 <= br.end; /* no reads past slice */
+}
+
+void lossless_codec::work(uint8_t id)
+{
+	uint32_t seen = 0;
+
+	while (1) {
+		{
+			std::unique_lock<std::mutex> lock(lock_);
+			go_.wait(lock, [&] { return quit_ || gen_ != seen; });
+			if (quit_)
+				return;
+
+			seen = gen_;
+		}
+
+		for (uint8_t i = id; i < slices_cnt_; i += threads_cnt_) {
+			if (encoding_)
+				encode_slice(i);
+			else
+				decode_slice(i);
+		}
+
+		std::lock_guard<std::mutex> lock(lock_);
+		if (!--pending_)
+			done_.notify_one();
+	}
+}
+
+void lossless_codec::run(uint8_t slices)
+{
+	slices_cnt_ = slices;
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		pending_ = threads_cnt_ - 1;
+		gen_++;
+	}
+
+	go_.notify_all();
+	for (uint8_t i = 0; i < slices_cnt_; i += threads_cnt_) {
+		if (encoding_)
+			encode_slice(i);
+		else
+			decode_slice(i);
+	}
+
+	std::unique_lock<std::mutex> lock(lock_);
+	done_.wait(lock, [&] { return !pending_; });
+}
+
+uint32_t lossless_codec::encode(const struct slot *s, const uint8_t **out)
+{
+	const struct format *f = find_format(s->fmt);
+	struct lossless_header hdr;
+	uint32_t bytes = sizeof(hdr);
+	uint8_t *dst;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = LOSSLESS_MAGIC;
+	hdr.fmt = s->fmt;
+	hdr.id = s->id;
+	hdr.w = s->w;
+	hdr.h = s->h;
+	hdr.stride = s->stride;
+	hdr.bytes = s->bytes;
+	hdr.sec = s->sec;
+	hdr.nsec = s->nsec;
+
+	if (f && f->layout == layout::jpeg) {
+		bytes += s->bytes;
+	} else if (!setup(s->fmt, s->w, s->h, s->stride, s->bytes, s->data)) {
+		return 0;
+	} else {
+		encoding_ = true;
+		hdr.slices = threads_cnt_ < s->h / 2 ? threads_cnt_ : 1;
+		run(hdr.slices);
+
+		for (uint8_t i = 0; i < hdr.slices; ++i) {
+			if (!slices_[i].ok)
+				return 0;
+
+			hdr.slice_bytes[i] = slices_[i].len;
+			bytes += slices_[i].len;
+		}
+	}
+
+	if (cap_ < bytes) {
+		if (!(dst = (uint8_t *) realloc(out_, bytes)))
+			return 0;
+
+		out_ = dst;
+		cap_ = bytes;
+	}
+
+	memcpy(out_, &hdr, sizeof(hdr));
+	dst = out_ + sizeof(hdr);
+	if (!hdr.slices)
+		memcpy(dst, s->data, s->bytes);
+
+	for (uint8_t i = 0; i < hdr.slices; ++i) {
+		memcpy(dst, slices_[i].buf, slices_[i].len);
+		dst += slices_[i].len;
+	}
+
+	*out = out_;
+	return bytes;
+}
+
+bool lossless_codec::decode(const struct lossless_header &hdr,
+ const uint8_t *in, uint8_t *out)
+{
+	if (hdr.magic != LOSSLESS_MAGIC || hdr.slices > LOSSLESS_MAX_SLICES) {
+		ee("malformed lossless frame %u\n", hdr.id);
+		return false;
+	} else if (!hdr.slices) {
+		memcpy(out, in, hdr.bytes);
+		return true;
+	} else if (!setup(hdr.fmt, hdr.w, hdr.h, hdr.stride, hdr.bytes, out)) {
+		return false;
+	}
+
+	for (uint8_t i = 0; i < hdr.slices; ++i) {
+		slices_[i].in = in;
+		slices_[i].len = hdr.slice_bytes[i];
+		in += hdr.slice_bytes[i];
+	}
+
+	encoding_ = false;
+	run(hdr.slices);
+
+	for (uint8_t i = 0; i < hdr.slices; ++i) {
+		if (!slices_[i].ok) {
+			ee("corrupted slice %u of frame %u\n", i, hdr.id);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+} // namespace camera
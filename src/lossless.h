@@ -0,0 +1,97 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef LOSSLESS_H
+#define LOSSLESS_H
+
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "pool.h"
+
+namespace camera {
+
+static constexpr uint8_t LOSSLESS_MAX_SLICES = 8;
+static constexpr uint32_t LOSSLESS_MAGIC = 0x314c5643; /* "CVL1" */
+
+/* Frame record of .cvl file: header, then slices back to back. Compressed
+ * sources are kept as is, with no slices and bytes of payload.
+ */
+struct lossless_header {
+	uint32_t magic;
+	uint32_t fmt;
+	uint32_t id;
+	uint16_t w;
+	uint16_t h;
+	uint32_t stride;
+	uint32_t bytes; /* decoded frame size */
+	uint64_t sec;
+	uint64_t nsec;
+	uint32_t slices;
+	uint32_t slice_bytes[LOSSLESS_MAX_SLICES];
+};
+
+/* Planes are separated, each sample predicted from its neighbours (LOCO-I
+ * median predictor) and residuals Rice coded in small blocks with own
+ * parameter. Frame is cut into horizontal slices which are coded
+ * independently on worker threads, so decoding scales the same way.
+ */
+class lossless_codec {
+public:
+	lossless_codec(uint8_t threads);
+	~lossless_codec();
+	uint32_t encode(const struct slot *, const uint8_t **out);
+	bool decode(const struct lossless_header &, const uint8_t *in,
+	 uint8_t *out); /* out takes header bytes */
+private:
+	struct plane {
+		uint8_t *base;
+		uint32_t stride;
+		uint16_t w;
+		uint16_t h;
+		uint8_t step; /* bytes between samples */
+		int8_t ref; /* sample is coded relative to base + ref, 0 none */
+		uint8_t sub_h;
+	};
+	struct slice {
+		uint8_t *buf = nullptr;
+		uint32_t cap = 0;
+		uint32_t len = 0;
+		const uint8_t *in = nullptr;
+		uint8_t *rows = nullptr; /* current, upper and residual rows */
+		bool ok = false;
+	};
+	bool setup(uint32_t fmt, uint16_t w, uint16_t h, uint32_t stride,
+	 uint32_t bytes, uint8_t *data);
+	void run(uint8_t slices);
+	void work(uint8_t id);
+	void encode_slice(uint8_t i);
+	void decode_slice(uint8_t i);
+	bool reserve(struct slice *, uint32_t cap);
+	struct plane planes_[3];
+	uint8_t planes_cnt_ = 0;
+	uint16_t h_ = 0;
+	uint16_t row_max_ = 0;
+	struct slice slices_[LOSSLESS_MAX_SLICES];
+	uint8_t slices_cnt_ = 0;
+	bool encoding_ = false;
+	uint8_t *out_ = nullptr;
+	uint32_t cap_ = 0;
+	uint8_t threads_cnt_ = 0;
+	std::thread threads_[LOSSLESS_MAX_SLICES]; /* caller runs first share */
+	std::mutex lock_;
+	std::condition_variable go_;
+	std::condition_variable done_;
+	uint32_t gen_ = 0;
+	uint8_t pending_ = 0;
+	bool quit_ = false;
+};
+
+}
+
+#endif // LOSSLESS_H
@@ -19,11 +19,35 @@
 #include <stb/stb_image.h>
 
 #include <linux/videodev2.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include "camera.h"
+#include "pool.h"
+#include "format.h"
+#include "convert.h"
+#include "display.h"
+#include "swap.h"
+#include "upload.h"
+#include "loopback.h"
+#include "osd.h"
+#include "burst.h"
+#include "record.h"
+#include "http.h"
+#include "perf.h"
+#include "probe.h"
+#include "statpage.h"
+#include "watchdog.h"
+#include "rtp.h"
+#include "frameclock.h"
+#include "timebase.h"
 #include "log.h"
 
 #ifndef WIN_WIDTH
@@ -34,6 +58,22 @@
 #define WIN_HEIGHT 540
 #endif
 
+#ifndef POOL_FRAMES
+#define POOL_FRAMES 4
+#endif
+
+#ifndef TEXTURES
+#define TEXTURES 3
+#endif
+
+#ifndef RECORD_QUALITY
+#define RECORD_QUALITY 85
+#endif
+
+#ifndef RECORD_THREADS
+#define RECORD_THREADS 2
+#endif
+
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 #endif
@@ -75,67 +115,140 @@ struct context {
 	GLuint prog;
 	GLuint vbo;
 	GLuint vao;
-	GLuint tex;
 	GLint u_tex;
 	GLint a_pos;
 	float ratio;
-	uint64_t sec;
-	uint64_t nsec;
-	float fps;
+	std::unique_ptr<camera::frame_clock> clock;
+	bool raw_stamps; /* keep driver timestamps as they are */
 	bool print_fps;
+	std::unique_ptr<display::osd> osd;
+	bool show_osd;
+	uint16_t burst_cnt;
+	const char *burst_dir;
+	std::unique_ptr<camera::burst> burst;
+	bool decimate;
+	std::unique_ptr<camera::frame_pool> raw; /* every captured frame */
+	int raw_display;
+	std::thread capture;
+	std::mutex park_lock;
+	std::condition_variable park; /* raw pool got consumer or quit */
+	const char *record_path;
+	uint8_t quality;
+	uint8_t threads;
+	std::unique_ptr<camera::recorder> record;
+	const char *http_addr;
+	std::unique_ptr<camera::http_server> http;
+	const char *rtp_addr;
+	std::unique_ptr<camera::rtp_sender> rtp;
+	std::atomic<bool> quit;
+	uint32_t decoded;
 	const char *dev;
 	camera::params cam;
 	camera::stream_ptr stream;
-};
-
-struct buffer {
-	stbi_uc *data;
-	size_t size;
-	int w;
-	int h;
+	uint8_t frames;
+	enum camera::exhaust policy;
+	camera::decode_fn decode;
+	std::unique_ptr<camera::frame_pool> pool;
+	int display;
+	bool hidden;
+	bool streamoff;
+	bool stopped;
+	const char *backend;
+	display::backend_ptr out;
+	display::swap_clock swap;
+	std::unique_ptr<display::upload_ring> ring;
+	uint8_t textures;
+	uint64_t shown_ns; /* capture time of frame drawn this iteration */
+	uint32_t shown_id;
+	const char *loopback_dev;
+	std::unique_ptr<display::loopback> loopback;
+	stats::perf_stage perf_capture;
+	stats::perf_stage perf_decode;
+	stats::perf_stage perf_upload;
+	stats::page_writer page;
+	uint64_t page_ns; /* last page update */
+	std::atomic<uint32_t> captured;
+	uint32_t shown;
+	stats::watchdog watchdog;
 };
 
 static int fit_w_;
 static int fit_h_;
 static float ratio_ = 1.;
 static float rratio_ = 1.;
+static volatile sig_atomic_t burst_armed_;
 
-static void print_fps(struct context *ctx, camera::image *img)
+static void burst_cb(int)
 {
-	uint64_t ms1 = ctx->sec * 1000 + ctx->nsec * .000001;
-	uint64_t ms2 = img->sec * 1000 + img->nsec * .000001;
-	uint32_t diff = ms2 - ms1;
-	ctx->fps = 1. / (diff * .001);
-	ctx->sec = img->sec;
-	ctx->nsec = img->nsec;
-	printf("\033[?25l\033[Gfps \033[1;33m%u\033[0m diff %d ms\033[K",
-	 (uint8_t) ctx->fps, diff);
+	burst_armed_ = 1;
 }
 
-static const char *format2str(uint32_t format)
+/* Recovered sensor clock replaces jittery driver stamp of captured frame */
+static void recover_clock(struct context *ctx, camera::image &img)
 {
-	if (format == V4L2_PIX_FMT_RGB24)
-		return "RGB8";
-	else if (format == V4L2_PIX_FMT_MJPEG)
-		return "JPEG";
-	else
-		return "<nil>";
+	uint64_t ns = ctx->clock->update(img.id, img.sec * 1000000000ULL +
+	 img.nsec);
+
+	if (ctx->raw_stamps)
+		return;
+
+	img.sec = ns / 1000000000;
+	img.nsec = ns % 1000000000;
 }
 
-static constexpr uint8_t RGB_PLANES = 3;
+static void print_fps(struct context *ctx, uint64_t latency_us)
+{
+	uint32_t us = ctx->clock->interval_ns() / 1000;
+
+	logger::status("\033[?25l\033[Gfps \033[1;33m%u\033[0m interval "
+	 "%u.%u ms jitter %u us latency %u ms\033[K", ctx->clock->fps(),
+	 us / 1000, us / 100 % 10, ctx->clock->jitter_us(),
+	 (uint32_t) (latency_us / 1000));
+}
+
+/* formatted every frame, re-uploaded only when text changes */
+static void update_osd(struct context *ctx, struct camera::slot *img,
+ uint64_t latency_us)
+{
+	ctx->osd->set_line(0, "%ux%u %s %u fps", img->w, img->h,
+	 camera::format_name(ctx->cam.fmt), ctx->clock->fps());
+	ctx->osd->set_line(1, "lat %u ms drop %u", (uint32_t) (latency_us /
+	 1000), ctx->pool->drops() + ctx->pool->reclaims());
+}
 
-static bool decompress_image(struct buffer *buf)
+/* Refresh shared stats page a few times per second */
+static void update_page(struct context *ctx, const stats::histogram &latency)
 {
-	int n = 0;
-	buf->data = stbi_load_from_memory(buf->data, buf->size, &buf->w,
-	 &buf->h, &n, RGB_PLANES);
+	static constexpr uint64_t PAGE_PERIOD_NS = 500000000;
+	uint64_t now = timebase::now();
+	stats::page *p;
 
-	if (n != RGB_PLANES) {
-		ee("only RGB color scheme is supported, n=%d\n", n);
-		return false;
+	if (now - ctx->page_ns < PAGE_PERIOD_NS || !(p = ctx->page.begin()))
+		return;
+
+	ctx->page_ns = now;
+	p->update_ns = now;
+	p->captured = ctx->captured.load(std::memory_order_relaxed);
+	p->decoded = ctx->decoded;
+	p->shown = ctx->shown;
+	p->dropped = ctx->pool->drops();
+	p->reclaimed = ctx->pool->reclaims();
+	if (ctx->raw) {
+		p->dropped += ctx->raw->drops();
+		p->reclaimed += ctx->raw->reclaims();
+		p->raw_queued = ctx->raw->queued(ctx->raw_display);
+		p->raw_busy = ctx->raw->busy();
 	}
 
-	return true;
+	p->pool_queued = ctx->pool->queued(ctx->display);
+	p->pool_busy = ctx->pool->busy();
+	p->latency_us[0] = latency.percentile(50);
+	p->latency_us[1] = latency.percentile(90);
+	p->latency_us[2] = latency.percentile(99);
+	p->latency_us[3] = latency.max();
+	for (uint8_t i = 0; i < stats::STAGES; ++i)
+		p->stalls[i] = ctx->watchdog.stalls((enum stats::stage) i);
+	ctx->page.commit();
 }
 
 static void key_cb(GLFWwindow *win, int key, unused_arg(int code), int action,
@@ -147,6 +260,100 @@ static void key_cb(GLFWwindow *win, int key, unused_arg(int code), int action,
 		glfwSetWindowShouldClose(win, GLFW_TRUE);
 	else if (key == GLFW_KEY_F)
 		glfwSetWindowSize(win, fit_w_, fit_h_);
+	else if (key == GLFW_KEY_B)
+		burst_armed_ = 1;
+}
+
+/* Takes over the loop until burst is captured and written, display freezes
+ * meanwhile
+ */
+static void run_burst(struct context *ctx)
+{
+	if (!burst_armed_)
+		return;
+
+	burst_armed_ = 0;
+	if (!ctx->burst) {
+		ww("burst not configured, see --burst\n");
+		return;
+	} else if (ctx->stopped) {
+		ww("stream is stopped, burst ignored\n");
+		return;
+	}
+
+	ctx->watchdog.suspend(true);
+	if (!ctx->burst->capture(*ctx->stream))
+		ee("burst has %u frames missing\n", ctx->burst->gaps());
+
+	ctx->burst->write(ctx->burst_dir, ctx->cam.fmt);
+	ctx->watchdog.suspend(false);
+}
+
+/* Hidden window gives up its frames; capture and decode carry on only for
+ * side consumers, otherwise the loop sleeps in glfwWaitEvents(). With
+ * decimation the raw frames are given up too, so capture thread parks
+ * unless recorder or streaming servers take them.
+ */
+static void set_hidden(struct context *ctx, bool hidden)
+{
+	if (hidden == ctx->hidden)
+		return;
+
+	ctx->hidden = hidden;
+	if (hidden) {
+		ctx->pool->detach(ctx->display);
+		ctx->display = -1;
+
+		if (ctx->decimate && !ctx->pool->consumers()) {
+			ctx->raw->detach(ctx->raw_display);
+			ctx->raw_display = -1;
+		} else if (ctx->streamoff && !ctx->decimate &&
+		 !ctx->pool->consumers()) {
+			ctx->stopped = ctx->stream->stop();
+		}
+
+		if (ctx->stopped)
+			ctx->watchdog.suspend(true);
+
+		ii("window hidden, %s\n", ctx->stopped ? "stream off" :
+		 "display paused");
+	} else {
+		ctx->display = ctx->pool->attach(1);
+		if (ctx->decimate && ctx->raw_display < 0) {
+			std::lock_guard<std::mutex> lock(ctx->park_lock);
+
+			ctx->raw_display = ctx->raw->attach(1);
+			ctx->park.notify_one();
+		}
+
+		if (ctx->stopped)
+			ctx->stopped = !ctx->stream->start();
+		if (!ctx->stopped)
+			ctx->watchdog.suspend(false);
+
+		ii("window visible, display resumed\n");
+	}
+}
+
+static void visibility_cb(GLFWwindow *win)
+{
+	struct context *ctx = (struct context *) glfwGetWindowUserPointer(win);
+
+	set_hidden(ctx, glfwGetWindowAttrib(win, GLFW_ICONIFIED) ||
+	 !glfwGetWindowAttrib(win, GLFW_VISIBLE));
+}
+
+static void iconify_cb(GLFWwindow *win, unused_arg(int iconified))
+{
+	visibility_cb(win);
+}
+
+/* some window managers hide windows on workspace switch, focus changes
+ * with it
+ */
+static void focus_cb(GLFWwindow *win, unused_arg(int focused))
+{
+	visibility_cb(win);
 }
 
 static void error_cb(int err, const char *str)
@@ -200,48 +407,55 @@ static GLuint make_shader(GLenum type, const char *src)
 	return shader;
 }
 
-static bool make_prog(struct context *ctx)
+static GLuint link_prog(const char *vsrc, const char *fsrc)
 {
-	ctx->prog = glCreateProgram();
-	if (!ctx->prog) {
+	GLuint prog = glCreateProgram();
+	if (!prog) {
 		gl_error("create program");
-		return false;
+		return 0;
 	}
 
-	GLuint vsh = make_shader(GL_VERTEX_SHADER, vsrc_);
+	GLuint vsh = make_shader(GL_VERTEX_SHADER, vsrc);
 	if (!vsh)
-		return false;
+		return 0;
 
-	GLuint fsh = make_shader(GL_FRAGMENT_SHADER, fsrc_);
+	GLuint fsh = make_shader(GL_FRAGMENT_SHADER, fsrc);
 	if (!fsh)
-		return false;
+		return 0;
 
-	glAttachShader(ctx->prog, vsh);
-	glAttachShader(ctx->prog, fsh);
-	glLinkProgram(ctx->prog);
+	glAttachShader(prog, vsh);
+	glAttachShader(prog, fsh);
+	glLinkProgram(prog);
 
 	GLint status = GL_FALSE;
-	glGetProgramiv(ctx->prog, GL_LINK_STATUS, &status);
+	glGetProgramiv(prog, GL_LINK_STATUS, &status);
 	if (status != GL_TRUE) {
 		GLint len = 0;
-		glGetProgramiv(ctx->prog, GL_INFO_LOG_LENGTH, &len);
+		glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &len);
 
 		if (len) {
 			char *buf = (char *) malloc(len);
 
 			if (buf) {
-				glGetProgramInfoLog(ctx->prog, len, NULL, buf);
+				glGetProgramInfoLog(prog, len, NULL, buf);
 				ee("%s", buf);
 				free(buf);
 			}
 		}
 
-		glDeleteProgram(ctx->prog);
-		ee("failed to link program %u\n", ctx->prog);
-		ctx->prog = 0;
-		return false;
+		glDeleteProgram(prog);
+		ee("failed to link program %u\n", prog);
+		return 0;
 	}
 
+	return prog;
+}
+
+static bool make_prog(struct context *ctx)
+{
+	if (!(ctx->prog = link_prog(vsrc_, fsrc_)))
+		return false;
+
 	ctx->u_tex = glGetUniformLocation(ctx->prog, "u_tex");
 	ctx->a_pos = glGetAttribLocation(ctx->prog, "a_pos");
 
@@ -259,55 +473,243 @@ static bool make_prog(struct context *ctx)
 	glBindVertexArray(0);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-	glGenTextures(1, &ctx->tex);
-	glBindTexture(GL_TEXTURE_2D, ctx->tex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1); /* tightly packed rows */
+	ctx->ring.reset(new display::upload_ring());
+	return ctx->ring->init(ctx->textures);
+}
+
+/* Decode once into pooled frame, every attached consumer shares it */
+static bool decode_frame(struct context *ctx, camera::image *img)
+{
+	struct camera::slot *s;
 
+	if (!(s = ctx->pool->acquire()))
+		return false;
+
+	probe2(decode_begin, img->id, img->sec * 1000000000ULL + img->nsec);
+	ctx->watchdog.enter(stats::STAGE_DECODE);
+	ctx->perf_decode.begin();
+	if (!ctx->decode(*img, s)) {
+		ctx->watchdog.leave(stats::STAGE_DECODE);
+		ctx->pool->release(s);
+		return false;
+	}
+
+	ctx->perf_decode.end();
+	ctx->watchdog.leave(stats::STAGE_DECODE);
+	probe2(decode_end, s->id, s->bytes);
+	ctx->decoded++;
+	ctx->pool->publish(s);
 	return true;
 }
 
-static void draw_image(struct context *ctx)
+/* With decimation capture thread dequeues every frame into raw pool at
+ * sensor rate. Display consumer there has queue depth of one, so it only
+ * ever sees newest frame and decode runs at display rate.
+ */
+/* Nobody takes raw frames, sleep until somebody attaches; with -s stream
+ * is stopped meanwhile, from this thread as it is the one dequeuing
+ */
+static void park_capture(struct context *ctx)
+{
+	std::unique_lock<std::mutex> lock(ctx->park_lock);
+	bool off;
+
+	if (ctx->quit || ctx->raw->consumers())
+		return;
+
+	off = ctx->streamoff && ctx->stream->stop();
+	ii("capture parked%s\n", off ? ", stream off" : "");
+	ctx->park.wait(lock, [&] {
+		return ctx->quit || ctx->raw->consumers();
+	});
+
+	if (off && !ctx->stream->start())
+		ee("failed to restart stream\n");
+	else
+		ii("capture resumed\n");
+}
+
+static void capture_loop(struct context *ctx)
 {
-	struct buffer buf;
+	struct camera::slot *s;
 	camera::image img;
+	while (!ctx->quit) {
+		park_capture(ctx);
+		run_burst(ctx);
+		ctx->watchdog.enter(stats::STAGE_CAPTURE);
+		ctx->perf_capture.begin();
+		if (!ctx->stream->get_frame(img)) {
+			ctx->stream->put_frame();
+			continue;
+		}
+
+		ctx->perf_capture.end();
+		ctx->watchdog.leave(stats::STAGE_CAPTURE);
+		recover_clock(ctx, img);
+		if ((s = ctx->raw->acquire())) {
+			s->id = img.id;
+			s->fmt = ctx->cam.fmt;
+			s->w = img.w;
+			s->h = img.h;
+			s->sec = img.sec;
+			s->nsec = img.nsec;
+			s->stride = img.stride;
+			s->bytes = img.bytes < s->size ? img.bytes : s->size;
+			memcpy(s->data, img.data, s->bytes);
+			ctx->raw->publish(s);
+			ctx->captured.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		ctx->stream->put_frame();
+	}
+
+	ii("%u frames captured, %u decoded for display\n",
+	 ctx->captured.load(), ctx->decoded);
+}
+
+/* Decode next frame if there is one, wait tells whether to sleep for it */
+static void next_frame(struct context *ctx, bool wait)
+{
+	struct camera::slot *s;
+	camera::image img;
+
+	if (!ctx->decimate) {
+		ctx->watchdog.enter(stats::STAGE_CAPTURE);
+		ctx->perf_capture.begin();
+		if (ctx->stream->get_frame(img)) {
+			ctx->perf_capture.end();
+			ctx->watchdog.leave(stats::STAGE_CAPTURE);
+			recover_clock(ctx, img);
+			ctx->captured.fetch_add(1, std::memory_order_relaxed);
+			decode_frame(ctx, &img);
+		}
+
+		ctx->stream->put_frame();
+		return;
+	}
+
+	s = wait ? ctx->raw->pop(ctx->raw_display, true) :
+	 ctx->raw->pop_latest(ctx->raw_display);
+	if (!s)
+		return;
+
+	img.id = s->id;
+	img.w = s->w;
+	img.h = s->h;
+	img.data = s->data;
+	img.bytes = s->bytes;
+	img.stride = s->stride;
+	img.sec = s->sec;
+	img.nsec = s->nsec;
+	decode_frame(ctx, &img);
+	ctx->raw->release(s);
+}
+
+static void draw_image(struct context *ctx)
+{
+	struct camera::slot *s;
+	GLuint tex;
+
+	next_frame(ctx, false);
+
+	if ((s = ctx->pool->pop_latest(ctx->display))) {
+		ctx->ratio = (float) s->w / s->h;
+		ratio_ = s->w / (float) s->h;
+		rratio_ = s->h / (float) s->w;
+
+		probe1(upload_begin, s->id);
+		ctx->watchdog.enter(stats::STAGE_UPLOAD);
+		ctx->perf_upload.begin();
+		if (ctx->ring->upload(s)) {
+			ctx->perf_upload.end();
+			ctx->shown_ns = display::capture_ns(s);
+			ctx->shown_id = s->id;
+			ctx->shown++;
+		}
+		ctx->watchdog.leave(stats::STAGE_UPLOAD);
+		probe2(upload_end, s->id, ctx->shown_ns);
+
+		if (ctx->print_fps)
+			print_fps(ctx, ctx->swap.last_us);
+		if (ctx->osd)
+			update_osd(ctx, s, ctx->swap.last_us);
+
+		ctx->pool->release(s);
+	}
+
+	/* without new frame keep showing last one */
+	if (!(tex = ctx->ring->texture()))
+		return;
 
 	glUseProgram(ctx->prog);
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, ctx->tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glBindVertexArray(ctx->vao);
+	glDrawArrays(GL_TRIANGLES, 0, 6);
 
-	ctx->stream->get_frame(img);
-	ctx->ratio = (float) img.w / img.h;
+	if (ctx->loopback && ctx->shown_ns) { /* same picture at camera size */
+		ctx->loopback->render(ctx->prog, ctx->vao, tex, ctx->shown_ns);
+		glViewport(0, 0, fit_w_, fit_h_);
+	}
 
-	buf.data = img.data;
-	buf.size = img.bytes;
-	buf.w = img.w;
-	buf.h = img.h;
+	ctx->ring->fence();
+}
 
-	if (ctx->cam.fmt == V4L2_PIX_FMT_MJPEG && !decompress_image(&buf)) {
-		goto out;
-	} else if (!buf.data || buf.w == 0 || buf.h == 0) {
-		goto out;
+static void idle(struct context *ctx)
+{
+	if (ctx->stopped || !ctx->pool->consumers()) {
+		glfwWaitEvents();
+		return;
 	}
 
-	ratio_ = buf.w / (float) buf.h;
-	rratio_ = buf.h / (float) buf.w;
+	next_frame(ctx, true);
+	update_page(ctx, ctx->swap.latency);
+	glfwPollEvents();
+}
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, buf.w, buf.h, 0, GL_RGB,
-	 GL_UNSIGNED_BYTE, buf.data);
+/* Main loop for presentation backends without GL context */
+static int run_backend(struct context *ctx)
+{
+	struct camera::slot *s;
+
+	if (!(ctx->out = display::create_backend(ctx->backend, ctx->dev,
+	 ctx->cam.w, ctx->cam.h)))
+		return 1;
+
+	while (ctx->out->dispatch()) {
+		if (!ctx->decimate)
+			run_burst(ctx);
+		set_hidden(ctx, ctx->out->hidden());
+		if (ctx->hidden && (ctx->stopped || !ctx->pool->consumers())) {
+			ctx->out->wait();
+			continue;
+		}
 
-	if (ctx->print_fps)
-		print_fps(ctx, &img);
+		next_frame(ctx, true);
+		update_page(ctx, ctx->out->latency);
+		if (!(s = ctx->pool->pop_latest(ctx->display)))
+			continue;
 
-	glBindVertexArray(ctx->vao);
-        glDrawArrays(GL_TRIANGLES, 0, 6);
+		ratio_ = s->w / (float) s->h;
+		ctx->watchdog.enter(stats::STAGE_SWAP);
+		if (!ctx->out->present(s)) {
+			ee("failed to present frame %u\n", s->id);
+		} else {
+			probe2(swap, s->id, display::capture_ns(s));
+			ctx->shown++;
+		}
+		ctx->watchdog.leave(stats::STAGE_SWAP);
 
-	if (ctx->cam.fmt == V4L2_PIX_FMT_MJPEG)
-		free(buf.data);
-out:
-	ctx->stream->put_frame();
+		if (ctx->print_fps)
+			print_fps(ctx, ctx->out->last_us);
+
+		ctx->pool->release(s);
+	}
+
+	ctx->out.reset();
+	ctx->pool->detach(ctx->display);
+	return 0;
 }
 
 static void help(const char *name)
@@ -315,13 +717,40 @@ static void help(const char *name)
 	printf("Usage: %s <options>\n"
 	 "Options:\n"
 	 "\033[2m"
-	 " -d, --dev <str>     video device, e.g. /dev/video0\n"
+	 " -d, --dev <str>     video device, e.g. /dev/video0, .cvl file or\n"
+	 "                     mjpeg url, e.g. http://192.168.1.10/video\n"
 	 " -p, --params <str>  stream hints (WxH@fps), e.g. 1920x1080@30\n"
 	 " -j, --jpeg          request jpeg compressed stream\n"
+	 " -F, --format <str>  request stream format, e.g. YUYV or NV12\n"
 	 " -f, --fps           print fps\n"
+	 " -n, --frames <num>  decoded frames pool size, default %u\n"
+	 " -l, --log <num>     log level: 0 quiet, 1 errors, 2 warnings, 3 info\n"
+	 " -b, --backend <str> presentation backend: gl (default), vk, shm\n"
+	 "                     or kms[:/dev/dri/cardN]\n"
+	 " -s, --streamoff     stop streaming while window is hidden\n"
+	 " -S, --raw-stamps    keep driver timestamps, no clock recovery\n"
+	 " -B, --block         wait for consumers when frame pool is exhausted\n"
+	 "                     instead of dropping oldest frame\n"
+	 " -t, --textures <n>  gl texture ring size, default %u\n"
+	 " -o, --osd           show fps, latency and drops on screen (gl)\n"
+	 " -D, --decimate      capture every frame on own thread, decode only\n"
+	 "                     newest one per displayed frame\n"
+	 " -r, --burst <n>     keep next n raw frames on 'b' key or SIGUSR1\n"
+	 " -R, --burst-dir <s> where burst frames are written, default .\n"
+	 " -e, --record <file> record stream, lossless if file ends with .cvl,\n"
+	 "                     mjpeg otherwise\n"
+	 " -q, --quality <n>   jpeg quality of recording and streams, def. %u\n"
+	 " -T, --threads <n>   recording encoder threads, default %u\n"
+	 " -H, --http <[a:]p>  serve mjpeg over http, on loopback unless\n"
+	 "                     address is given, e.g. 8080 or 0.0.0.0:8080\n"
+	 " -u, --rtp <a:p>     send rtp/jpeg to unicast or multicast address\n"
+	 " -P, --perf          count cycles, instructions, cache and branch\n"
+	 "                     misses of capture, decode and upload\n"
+	 " -L, --loopback <s>  mirror gl output to v4l2loopback device,\n"
+	 "                     YUYV unless :NV12 follows, e.g. /dev/video9\n"
 	 "\033[0m"
 	 "Example: %s -d /dev/video0 -p 1920x1080@30\n",
-	 name, name);
+	 name, POOL_FRAMES, TEXTURES, RECORD_QUALITY, RECORD_THREADS, name);
 }
 
 static int opt(const char *arg, const char *args, const char *argl)
@@ -337,8 +766,33 @@ static void init_context(int argc, const char *argv[], struct context *ctx)
 	const char *arg;
 
 	ctx->cam.fmt = V4L2_PIX_FMT_RGB24;
-	ctx->fps = 30;
+	ctx->raw_stamps = false;
 	ctx->dev = NULL;
+	ctx->frames = POOL_FRAMES;
+	ctx->textures = TEXTURES;
+	ctx->policy = camera::exhaust::drop_oldest;
+	ctx->hidden = false;
+	ctx->show_osd = false;
+	ctx->burst_cnt = 0;
+	ctx->decimate = false;
+	ctx->quit = false;
+	ctx->decoded = 0;
+	ctx->burst_dir = ".";
+	ctx->record_path = nullptr;
+	ctx->http_addr = nullptr;
+	ctx->rtp_addr = nullptr;
+	ctx->quality = RECORD_QUALITY;
+	ctx->threads = RECORD_THREADS;
+	ctx->cam.buffers = 0;
+	ctx->shown_ns = 0;
+	ctx->shown_id = 0;
+	ctx->page_ns = 0;
+	ctx->captured = 0;
+	ctx->shown = 0;
+	ctx->loopback_dev = nullptr;
+	ctx->streamoff = false;
+	ctx->stopped = false;
+	ctx->backend = "gl";
 
 	for (uint8_t i = 0; i < argc; ++i) {
 		arg = argv[i];
@@ -361,8 +815,134 @@ static void init_context(int argc, const char *argv[], struct context *ctx)
 			ctx->cam.h = atoi(++geom_h);
 		} else if (opt(arg, "-j", "--jpeg")) {
 			ctx->cam.fmt = V4L2_PIX_FMT_MJPEG;
+		} else if (opt(arg, "-F", "--format")) {
+			const camera::format *f;
+
+			i++;
+			if (!argv[i] || !(f = camera::find_format(argv[i]))) {
+				ee("unknown format, e.g. RGB8 JPEG YUYV NV12\n");
+				exit(1);
+			}
+
+			ctx->cam.fmt = f->fourcc;
 		} else if (opt(arg, "-f", "--fps")) {
 			ctx->print_fps = true;
+		} else if (opt(arg, "-n", "--frames")) {
+			int n;
+
+			i++;
+			if (!argv[i] || (n = atoi(argv[i])) < 1 ||
+			 n > camera::POOL_MAX_SLOTS) {
+				ee("malformed frames count, 1..%u\n",
+				 camera::POOL_MAX_SLOTS);
+				exit(1);
+			}
+
+			ctx->frames = n;
+		} else if (opt(arg, "-l", "--log")) {
+			i++;
+			if (!argv[i]) {
+				ee("malformed log level, e.g. 2\n");
+				exit(1);
+			}
+
+			logger::set_level(atoi(argv[i]));
+		} else if (opt(arg, "-b", "--backend")) {
+			i++;
+			if (!(ctx->backend = argv[i])) {
+				ee("malformed backend, e.g. shm\n");
+				exit(1);
+			}
+		} else if (opt(arg, "-S", "--raw-stamps")) {
+			ctx->raw_stamps = true;
+		} else if (opt(arg, "-s", "--streamoff")) {
+			ctx->streamoff = true;
+		} else if (opt(arg, "-B", "--block")) {
+			ctx->policy = camera::exhaust::block;
+		} else if (opt(arg, "-t", "--textures")) {
+			int n;
+
+			i++;
+			if (!argv[i] || (n = atoi(argv[i])) < 1 ||
+			 n > display::UPLOAD_MAX) {
+				ee("malformed texture ring size, 1..%u\n",
+				 display::UPLOAD_MAX);
+				exit(1);
+			}
+
+			ctx->textures = n;
+		} else if (opt(arg, "-o", "--osd")) {
+			ctx->show_osd = true;
+		} else if (opt(arg, "-D", "--decimate")) {
+			ctx->decimate = true;
+		} else if (opt(arg, "-r", "--burst")) {
+			int n;
+
+			i++;
+			if (!argv[i] || (n = atoi(argv[i])) < 1 ||
+			 n > UINT16_MAX) {
+				ee("malformed burst frames count, 1..%u\n",
+				 UINT16_MAX);
+				exit(1);
+			}
+
+			ctx->burst_cnt = n;
+		} else if (opt(arg, "-R", "--burst-dir")) {
+			i++;
+			if (!(ctx->burst_dir = argv[i])) {
+				ee("malformed burst directory\n");
+				exit(1);
+			}
+		} else if (opt(arg, "-e", "--record")) {
+			i++;
+			if (!(ctx->record_path = argv[i])) {
+				ee("malformed record file\n");
+				exit(1);
+			}
+		} else if (opt(arg, "-q", "--quality")) {
+			int n;
+
+			i++;
+			if (!argv[i] || (n = atoi(argv[i])) < 1 || n > 100) {
+				ee("malformed jpeg quality, 1..100\n");
+				exit(1);
+			}
+
+			ctx->quality = n;
+		} else if (opt(arg, "-T", "--threads")) {
+			int n;
+
+			i++;
+			if (!argv[i] || (n = atoi(argv[i])) < 1 ||
+			 n > camera::RECORD_MAX_THREADS) {
+				ee("malformed encoder threads count, 1..%u\n",
+				 camera::RECORD_MAX_THREADS);
+				exit(1);
+			}
+
+			ctx->threads = n;
+		} else if (opt(arg, "-H", "--http")) {
+			i++;
+			if (!(ctx->http_addr = argv[i])) {
+				ee("malformed http address, e.g. 8080\n");
+				exit(1);
+			}
+		} else if (opt(arg, "-u", "--rtp")) {
+			i++;
+			if (!(ctx->rtp_addr = argv[i])) {
+				ee("malformed rtp address, e.g. 239.0.0.1:5004\n");
+				exit(1);
+			}
+		} else if (opt(arg, "-P", "--perf")) {
+			ctx->perf_capture.enable();
+			ctx->perf_decode.enable();
+			ctx->perf_upload.enable();
+		} else if (opt(arg, "-L", "--loopback")) {
+			i++;
+			if (!(ctx->loopback_dev = argv[i])) {
+				ee("malformed loopback device, e.g. /dev/video9\n");
+				exit(1);
+			}
 		} else if (opt(arg, "-h", "--help")) {
 			help(argv[0]);
 			exit(1);
@@ -372,18 +952,157 @@ static void init_context(int argc, const char *argv[], struct context *ctx)
 	if (!ctx->dev) {
 		help(argv[0]);
 		exit(1);
+	} else if ((ctx->record_path || ctx->http_addr || ctx->rtp_addr) &&
+	 !ctx->decimate) {
+		ii("capture runs on own thread, decimation enabled\n");
+		ctx->decimate = true;
+	}
+
+	if (ctx->loopback_dev && strcmp(ctx->backend, "gl") != 0) {
+		ww("loopback output needs gl backend\n");
+		ctx->loopback_dev = nullptr;
 	}
 
 	ii("open camera %s; hinted params %s; format %s\n", ctx->dev, geom_w,
-	 format2str(ctx->cam.fmt));
+	 camera::format_name(ctx->cam.fmt));
+
+	if (ctx->burst_cnt) /* more room to absorb copy jitter */
+		ctx->cam.buffers = camera::BURST_BUFFERS;
 
 	ctx->stream = camera::create_stream(ctx->dev, &ctx->cam);
 	if (!ctx->stream.get()) {
-		ee("failed to create %s stream\n", format2str(ctx->cam.fmt));
+		ee("failed to create %s stream\n",
+		 camera::format_name(ctx->cam.fmt));
+		exit(1);
+	}
+
+	/* recording being replayed sets format */
+	if (!(ctx->decode = camera::find_decoder(ctx->cam.fmt))) {
+		ee("no decoder for %s stream\n",
+		 camera::format_name(ctx->cam.fmt));
+		exit(1);
+	}
+
+	if (ctx->burst_cnt) {
+		ctx->burst.reset(new camera::burst(ctx->burst_cnt,
+		 ctx->stream->get_buffer_size()));
+		if (!ctx->burst->valid())
+			exit(1);
+
+		signal(SIGUSR1, burst_cb);
+	}
+}
+
+/* Frame pool may live in GL buffer storage, so this runs after make_prog() */
+static void start_stream(struct context *ctx)
+{
+	const camera::format *decoded = camera::find_format(
+	 camera::find_format(ctx->cam.fmt)->decoded);
+	uint32_t size = camera::image_bytes(*decoded, ctx->cam.w, ctx->cam.h);
+	uint8_t *mem = nullptr;
+
+	ctx->clock.reset(new camera::frame_clock(ctx->cam.fps));
+	if (ctx->ring)
+		mem = ctx->ring->map(ctx->frames * size);
+
+	ctx->pool.reset(new camera::frame_pool(ctx->frames, size, ctx->policy,
+	 mem));
+	if (ctx->ring)
+		ctx->ring->attach(ctx->pool.get());
+
+	if (!ctx->pool->valid()) {
 		exit(1);
-	} else if (!ctx->stream->start()) {
+	} else if ((ctx->display = ctx->pool->attach(1)) < 0) {
+		exit(1);
+	}
+
+	if (ctx->decimate) {
+		uint8_t cnt = ctx->frames;
+
+		/* encoders hold a frame each while more queue up behind */
+		if (ctx->record_path && cnt < ctx->threads * 2 + 2)
+			cnt = ctx->threads * 2 + 2;
+		if (ctx->http_addr) /* one being encoded, one queued */
+			cnt += 2;
+		if (ctx->rtp_addr) /* one being paced out, one queued */
+			cnt += 2;
+		if (cnt > camera::POOL_MAX_SLOTS)
+			cnt = camera::POOL_MAX_SLOTS;
+
+		ctx->raw.reset(new camera::frame_pool(cnt,
+		 ctx->stream->get_buffer_size(), ctx->policy));
+		if (!ctx->raw->valid())
+			exit(1);
+		else if ((ctx->raw_display = ctx->raw->attach(1)) < 0)
+			exit(1);
+	}
+
+	if (ctx->record_path) {
+		ctx->record.reset(new camera::recorder(*ctx->raw,
+		 ctx->record_path, ctx->quality, ctx->threads));
+		if (!ctx->record->valid())
+			exit(1);
+	}
+
+	if (ctx->http_addr) {
+		ctx->http.reset(new camera::http_server(*ctx->raw,
+		 ctx->stream->get_buffer_size(), ctx->http_addr,
+		 ctx->quality));
+		if (!ctx->http->valid())
+			exit(1);
+	}
+
+	if (ctx->rtp_addr) {
+		ctx->rtp.reset(new camera::rtp_sender(*ctx->raw, ctx->rtp_addr,
+		 *ctx->clock, ctx->quality));
+		if (!ctx->rtp->valid())
+			exit(1);
+	}
+
+	ctx->page.open(ctx->dev, ctx->cam.fmt, ctx->cam.w, ctx->cam.h);
+	if (!ctx->stream->start())
 		exit(1);
+
+	if (ctx->decimate) {
+		ctx->capture = std::thread(capture_loop, ctx);
+		pthread_setname_np(ctx->capture.native_handle(), "capture");
+	}
+
+	ctx->watchdog.start(ctx->cam.fps);
+}
+
+static void report_perf(struct context *ctx)
+{
+	const camera::format *f = camera::find_format(ctx->cam.fmt);
+
+	ctx->perf_capture.report("capture");
+	ctx->perf_decode.report(f->layout == camera::layout::jpeg ?
+	 "decode" : "convert");
+	ctx->perf_upload.report("upload");
+}
+
+static void stop_stream(struct context *ctx)
+{
+	ctx->watchdog.stop();
+	ctx->watchdog.report();
+	if (!ctx->capture.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(ctx->park_lock);
+
+		ctx->quit = true;
+		ctx->park.notify_one();
 	}
+
+	ctx->raw->cancel();
+	ctx->capture.join();
+	if (ctx->record)
+		ctx->record->stop(); /* drains what is queued */
+	if (ctx->http)
+		ctx->http->stop();
+	if (ctx->rtp)
+		ctx->rtp->stop();
 }
 
 } /* namespace */
@@ -395,8 +1114,22 @@ int main(int argc, const char *argv[])
 	struct context ctx;
 	GLFWwindow *win;
 
+	logger::start();
+	timebase::init();
 	init_context(argc, argv, &ctx);
 
+	if (strcmp(ctx.backend, "gl") != 0) {
+		start_stream(&ctx);
+		int rc = run_backend(&ctx);
+
+		stop_stream(&ctx);
+		report_perf(&ctx);
+
+		logger::stop();
+		printf("\033[?25h\n"); /* restore cursor */
+		return rc;
+	}
+
 	glfwSetErrorCallback(error_cb);
 	if (!glfwInit())
 		exit(1);
@@ -411,7 +1144,10 @@ int main(int argc, const char *argv[])
 		exit(1);
 	}
 
+	glfwSetWindowUserPointer(win, &ctx);
 	glfwSetKeyCallback(win, key_cb);
+	glfwSetWindowIconifyCallback(win, iconify_cb);
+	glfwSetWindowFocusCallback(win, focus_cb);
 	glfwMakeContextCurrent(win);
 	gladLoadGL(glfwGetProcAddress);
 	glfwSwapInterval(1);
@@ -420,9 +1156,38 @@ int main(int argc, const char *argv[])
 	if (!make_prog(&ctx))
 		exit(1);
 
+	if (ctx.show_osd) {
+		GLuint prog = link_prog(display::osd_vsrc, display::osd_fsrc);
+
+		ctx.osd.reset(new display::osd());
+		if (!prog || !ctx.osd->init(prog))
+			exit(1);
+	}
+
+	if (ctx.loopback_dev) {
+		ctx.loopback.reset(new display::loopback());
+		if (!ctx.loopback->init(ctx.loopback_dev, ctx.cam.w,
+		 ctx.cam.h))
+			exit(1);
+	}
+
+	start_stream(&ctx);
+	ctx.swap.init();
+
 	while (!glfwWindowShouldClose(win)) {
+		if (!ctx.decimate)
+			run_burst(&ctx);
+		if (ctx.hidden) {
+			idle(&ctx);
+			continue;
+		}
+
 		/* lame way of tracking window resize */
 		glfwGetFramebufferSize(win, &w, &h);
+		if (!w || !h) { /* minimised on some platforms */
+			glfwWaitEvents();
+			continue;
+		}
 
 		/* try to maintain original aspect ratio */
 		fit_w_ = h * ratio_;
@@ -435,14 +1200,35 @@ int main(int argc, const char *argv[])
 
 		glViewport(0, 0, fit_w_, fit_h_);
 		glClear(GL_COLOR_BUFFER_BIT);
+		ctx.swap.poll();
+		ctx.shown_ns = 0;
 		draw_image(&ctx);
+		update_page(&ctx, ctx.swap.latency);
+		if (ctx.loopback)
+			ctx.loopback->poll();
+		if (ctx.osd)
+			ctx.osd->draw(fit_w_, fit_h_);
+		ctx.watchdog.enter(stats::STAGE_SWAP);
 		glfwSwapBuffers(win);
+		ctx.watchdog.leave(stats::STAGE_SWAP);
+		if (ctx.shown_ns) {
+			probe2(swap, ctx.shown_id, ctx.shown_ns);
+			ctx.swap.swapped(ctx.shown_ns);
+		}
 		glfwPollEvents();
 	}
 
+	stop_stream(&ctx);
+	ctx.ring->report();
+	ctx.swap.latency.report("capture-to-present");
+	report_perf(&ctx);
+	ctx.ring.reset();
+	ctx.loopback.reset();
+	ctx.osd.reset();
 	glDeleteProgram(ctx.prog);
 	glfwDestroyWindow(win);
 	glfwTerminate();
+	logger::stop();
 	/* restore cursor */
 	printf("\033[?25h\n");
 
@@ -0,0 +1,552 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <linux/videodev2.h>
+#include <stb/stb_image.h>
+
+#include "camera.h"
+#include "timebase.h"
+#include "log.h"
+
+namespace camera {
+
+static constexpr uint32_t RING_BYTES = 16 << 20; /* power of two */
+static constexpr uint32_t HEADERS_MAX = 4096;
+static constexpr uint8_t BOUNDARY_MAX = 72; /* RFC 2046 limit is 70 */
+static constexpr int RECV_TIMEOUT_MS = 1000;
+static constexpr uint64_t RECONNECT_NS = 1000000000;
+static constexpr uint8_t DEFAULT_FPS = 30;
+
+typedef uint8_t u8x16 __attribute__((vector_size(16)));
+
+/* First and last needle bytes are compared for 16 positions at once and
+ * only candidates matching both are verified, so payload is walked at
+ * vector speed and false hits on common bytes stay rare.
+ */
+static const uint8_t *find(const uint8_t *p, const uint8_t *end,
+ const uint8_t *needle, uint8_t n)
+{
+	u8x16 first;
+	u8x16 last;
+	u8x16 a;
+	u8x16 b;
+	u8x16 hit;
+	uint64_t any[2];
+
+	memset(&first, needle[0], sizeof(first));
+	memset(&last, needle[n - 1], sizeof(last));
+
+	for (; p + n - 1 + sizeof(a) <= end; p += sizeof(a)) {
+		memcpy(&a, p, sizeof(a));
+		memcpy(&b, p + n - 1, sizeof(b));
+		hit = (u8x16) ((a == first) & (b == last));
+		memcpy(any, &hit, sizeof(any));
+		if (!(any[0] | any[1]))
+			continue;
+
+		for (uint8_t i = 0; i < sizeof(hit); ++i) {
+			if (hit[i] && memcmp(p + i, needle, n) == 0)
+				return p + i;
+		}
+	}
+
+	for (; p + n <= end; ++p) {
+		if (memcmp(p, needle, n) == 0)
+			return p;
+	}
+
+	return nullptr;
+}
+
+/* Header names are case insensitive, 0 when part has no length */
+static uint32_t content_length(const uint8_t *p, const uint8_t *end)
+{
+	static const char name[] = "Content-Length:";
+	static constexpr uint8_t len = sizeof(name) - 1;
+
+	for (; p + len < end; ++p) {
+		if (strncasecmp((const char *) p, name, len) == 0)
+			return strtoul((const char *) p + len, NULL, 10);
+	}
+
+	return 0;
+}
+
+/* Multipart MJPEG from network camera, http://host[:port]/path. Socket is
+ * read into a ring mapped twice back to back, so every frame is contiguous
+ * in memory however it wraps and is handed out where it was received.
+ * Frame stays in place until put_frame(), reads only fill space behind it.
+ */
+class mjpeg_stream : public stream {
+public:
+	~mjpeg_stream();
+	bool init(const char *url, struct params *);
+	bool start() override;
+	bool stop() override;
+	void get_frame_size(uint16_t &w, uint16_t &h) override;
+	uint32_t get_buffer_size() override { return max_bytes_; }
+	bool get_frame(struct image &) override;
+	void put_frame() override;
+private:
+	bool map_ring();
+	bool parse_url(const char *url);
+	bool connect_server();
+	bool read_headers();
+	bool fill();
+	bool next_part(struct image &);
+	void disconnect();
+	const uint8_t *at(uint64_t pos) const
+	{
+		return ring_ + (pos & (RING_BYTES - 1));
+	}
+	const uint8_t *received(uint64_t from) const /* end, seen from */
+	{
+		return at(from) + (head_ - from);
+	}
+	uint8_t *ring_ = nullptr;
+	uint64_t head_ = 0; /* received */
+	uint64_t tail_ = 0; /* oldest byte still needed */
+	uint64_t scan_ = 0; /* searched up to */
+	uint64_t payload_ = 0; /* of current part */
+	uint32_t length_ = 0; /* Content-Length, 0 if not sent */
+	bool in_part_ = false;
+	uint64_t release_ = 0; /* end of frame handed out */
+	int fd_ = -1;
+	char host_[256];
+	char port_[8];
+	char path_[512];
+	uint8_t boundary_[BOUNDARY_MAX + 2]; /* with leading dashes */
+	uint8_t boundary_len_ = 0;
+	uint16_t w_ = 0;
+	uint16_t h_ = 0;
+	uint32_t max_bytes_ = 0;
+	uint32_t id_ = 0;
+	uint64_t connect_ns_ = 0;
+};
+
+mjpeg_stream::~mjpeg_stream()
+{
+	disconnect();
+	if (ring_)
+		munmap(ring_, RING_BYTES * 2);
+}
+
+bool mjpeg_stream::map_ring()
+{
+	int fd = memfd_create("mjpeg-ring", 0);
+	void *base;
+	bool ok;
+
+	if (fd < 0) {
+		ee("memfd_create failed, errno %d\n", errno);
+		return false;
+	} else if (ftruncate(fd, RING_BYTES) < 0) {
+		ee("failed to size receive ring, errno %d\n", errno);
+		close(fd);
+		return false;
+	}
+
+	base = mmap(NULL, RING_BYTES * 2, PROT_NONE,
+	 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	ring_ = (uint8_t *) base;
+	ok = mmap(ring_, RING_BYTES, PROT_READ | PROT_WRITE,
+	 MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+	 mmap(ring_ + RING_BYTES, RING_BYTES, PROT_READ | PROT_WRITE,
+	 MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+	close(fd);
+
+	if (!ok)
+		ee("failed to mirror receive ring, errno %d\n", errno);
+
+	return ok;
+}
+
+bool mjpeg_stream::parse_url(const char *url)
+{
+	const char *host = url + strlen("http://");
+	const char *path = strchr(host, '/');
+	const char *port;
+	size_t len = path ? (size_t) (path - host) : strlen(host);
+
+	if (len >= sizeof(host_) ||
+	 snprintf(path_, sizeof(path_), "%s", path ? path : "/") >=
+	 (int) sizeof(path_)) {
+		ee("url '%s' is too long\n", url);
+		return false;
+	}
+
+	memcpy(host_, host, len);
+	host_[len] = '\0';
+
+	/* [v6 address]:port keeps its colons inside brackets */
+	port = strrchr(host_, ':');
+	if (port && strchr(port, ']'))
+		port = nullptr;
+
+	snprintf(port_, sizeof(port_), "%s", port ? port + 1 : "80");
+	if (port)
+		host_[port - host_] = '\0';
+
+	if (host_[0] == '[') {
+		len = strlen(host_);
+		memmove(host_, host_ + 1, len);
+		if (len > 1 && host_[len - 2] == ']')
+			host_[len - 2] = '\0';
+	}
+
+	return host_[0] != '\0';
+}
+
+bool mjpeg_stream::connect_server()
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	char req[sizeof(path_) + sizeof(host_) + 64];
+	int len;
+	int rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((rc = getaddrinfo(host_, port_, &hints, &res)) != 0) {
+		ee("failed to resolve %s: %s\n", host_, gai_strerror(rc));
+		return false;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd_ = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+		 ai->ai_protocol);
+		if (fd_ < 0)
+			continue;
+		else if (connect(fd_, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+
+		close(fd_);
+		fd_ = -1;
+	}
+
+	freeaddrinfo(res);
+	if (fd_ < 0) {
+		ee("failed to connect to %s:%s, errno %d\n", host_, port_,
+		 errno);
+		return false;
+	}
+
+	/* 1.0 keeps servers from chunking the response */
+	len = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\nHost: %s\r\n"
+	 "User-Agent: camview\r\nAccept: multipart/x-mixed-replace\r\n\r\n",
+	 path_, host_);
+	if (send(fd_, req, len, MSG_NOSIGNAL) != len) {
+		ee("failed to send request to %s, errno %d\n", host_, errno);
+		return false;
+	}
+
+	head_ = tail_ = scan_ = release_ = 0;
+	in_part_ = false;
+	return read_headers();
+}
+
+/* Status line and response headers, leaves first part in ring */
+bool mjpeg_stream::read_headers()
+{
+	static const uint8_t crlf2[] = { '\r', '\n', '\r', '\n' };
+	char headers[HEADERS_MAX + 1];
+	const uint8_t *end;
+	const char *b;
+	size_t len;
+
+	while (!(end = find(at(0), received(0), crlf2, sizeof(crlf2)))) {
+		if (head_ >= HEADERS_MAX) {
+			ee("response headers of %s are too long\n", host_);
+			return false;
+		} else if (!fill()) {
+			return false;
+		}
+	}
+
+	if ((len = end - at(0)) > HEADERS_MAX) {
+		ee("response headers of %s are too long\n", host_);
+		return false;
+	}
+
+	memcpy(headers, at(0), len);
+	headers[len] = '\0';
+	tail_ = scan_ = len + sizeof(crlf2);
+
+	if (strncmp(headers, "HTTP/1.", 7) != 0 ||
+	 strncmp(headers + 8, " 200", 4) != 0) {
+		ee("%s%s replied '%.*s'\n", host_, path_,
+		 (int) strcspn(headers, "\r\n"), headers);
+		return false;
+	} else if (!(b = strcasestr(headers, "boundary="))) {
+		ee("%s%s is not multipart stream\n", host_, path_);
+		return false;
+	}
+
+	b += strlen("boundary=");
+	if (*b == '"')
+		b++;
+	while (*b == '-') /* some servers declare it with dashes */
+		b++;
+
+	len = strcspn(b, "\"; \r\n");
+	if (!len || len > BOUNDARY_MAX) {
+		ee("malformed boundary in reply of %s\n", host_);
+		return false;
+	}
+
+	boundary_[0] = '-';
+	boundary_[1] = '-';
+	memcpy(boundary_ + 2, b, len);
+	boundary_len_ = len + 2;
+	return true;
+}
+
+/* Receive into free part of ring, false on error, timeout or close */
+bool mjpeg_stream::fill()
+{
+	uint32_t room = RING_BYTES - (head_ - tail_);
+	struct pollfd fds;
+	ssize_t rc;
+
+	if (!room)
+		return false;
+
+	fds.fd = fd_;
+	fds.events = POLLIN;
+	fds.revents = 0;
+	do {
+		rc = poll(&fds, 1, RECV_TIMEOUT_MS);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc == 0) {
+		ww("no data from %s for %d ms\n", host_, RECV_TIMEOUT_MS);
+		return false;
+	} else if (rc < 0) {
+		return false;
+	}
+
+	/* mirror makes room contiguous even across the wrap */
+	do {
+		rc = recv(fd_, (void *) at(head_), room, 0);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc <= 0) {
+		ww("%s closed stream, errno %d\n", host_, rc ? errno : 0);
+		return false;
+	}
+
+	head_ += rc;
+	return true;
+}
+
+/* Locates next part and its JPEG in place, receiving until it is whole */
+bool mjpeg_stream::next_part(struct image &out)
+{
+	static const uint8_t crlf2[] = { '\r', '\n', '\r', '\n' };
+	const uint8_t *p;
+	const uint8_t *hdr;
+	const uint8_t *end;
+	uint64_t pos;
+	uint8_t n = boundary_len_;
+
+	while (1) {
+		if (!in_part_) {
+			if ((p = find(at(scan_), received(scan_), boundary_,
+			 n))) {
+				pos = scan_ + (p - at(scan_));
+				tail_ = scan_ = pos;
+				hdr = p + n;
+				if ((end = find(hdr, received(pos), crlf2,
+				 sizeof(crlf2)))) {
+					length_ = content_length(hdr, end);
+					payload_ = pos + (end - p) +
+					 sizeof(crlf2);
+					scan_ = payload_;
+					in_part_ = true;
+					continue;
+				}
+			} else if (head_ - scan_ >= n) {
+				tail_ = scan_ = head_ - n + 1; /* junk */
+			}
+		} else if (length_) {
+			if (head_ - payload_ >= length_) {
+				end = at(payload_) + length_;
+				break;
+			}
+		} else if ((p = find(at(scan_), received(scan_), boundary_,
+		 n))) {
+			scan_ += p - at(scan_);
+			/* seen from payload, scan may have wrapped already */
+			end = at(payload_) + (scan_ - payload_);
+			/* JPEG ends with EOI, line break is delimiter's */
+			while (end > at(payload_) && (end[-1] == '\r' ||
+			 end[-1] == '\n' || end[-1] == '-'))
+				end--;
+			break;
+		} else if (head_ - scan_ >= n) {
+			scan_ = head_ - n + 1;
+		}
+
+		if (head_ - tail_ == RING_BYTES) {
+			ww("part from %s is larger than %u bytes, skipped\n",
+			 host_, RING_BYTES);
+			tail_ = scan_ = head_;
+			in_part_ = false;
+		}
+
+		if (!fill())
+			return false;
+	}
+
+	in_part_ = false;
+	out.data = (uint8_t *) at(payload_);
+	out.bytes = end - out.data;
+	release_ = payload_ + out.bytes;
+	if (length_)
+		scan_ = release_;
+	return true;
+}
+
+void mjpeg_stream::disconnect()
+{
+	if (fd_ >= 0)
+		close(fd_);
+	fd_ = -1;
+}
+
+bool mjpeg_stream::init(const char *url, struct params *p)
+{
+	struct image img;
+	int w;
+	int h;
+	int n;
+
+	if (!parse_url(url) || !map_ring())
+		return false;
+
+	connect_ns_ = timebase::now();
+	if (!connect_server()) {
+		return false;
+	} else if (!next_part(img)) {
+		ee("no frame from %s\n", url);
+		return false;
+	} else if (!stbi_info_from_memory(img.data, img.bytes, &w, &h, &n)) {
+		ee("first part from %s is not jpeg\n", url);
+		return false;
+	}
+
+	scan_ = tail_; /* hand out first frame again */
+	w_ = w;
+	h_ = h;
+	max_bytes_ = (uint32_t) w * h * 3;
+	if (max_bytes_ > RING_BYTES / 2)
+		max_bytes_ = RING_BYTES / 2;
+
+	p->w = w_;
+	p->h = h_;
+	p->fmt = V4L2_PIX_FMT_MJPEG;
+	if (!p->fps)
+		p->fps = DEFAULT_FPS;
+
+	ii("network camera %s %ux%u\n", url, w_, h_);
+	return true;
+}
+
+bool mjpeg_stream::start()
+{
+	return true; /* connected on demand */
+}
+
+/* Closing is the only way to pause a server push */
+bool mjpeg_stream::stop()
+{
+	disconnect();
+	return true;
+}
+
+void mjpeg_stream::get_frame_size(uint16_t &w, uint16_t &h)
+{
+	w = w_;
+	h = h_;
+}
+
+bool mjpeg_stream::get_frame(struct image &out)
+{
+	uint64_t now = timebase::now();
+	struct timespec ts;
+
+	out.bytes = 0;
+	release_ = 0;
+	if (fd_ < 0) {
+		/* do not hammer server which keeps refusing */
+		if (now - connect_ns_ < RECONNECT_NS) {
+			uint64_t left = RECONNECT_NS - (now - connect_ns_);
+
+			ts.tv_sec = left / 1000000000;
+			ts.tv_nsec = left % 1000000000; /* full second too */
+			nanosleep(&ts, NULL);
+		}
+
+		connect_ns_ = timebase::now();
+		if (!connect_server()) {
+			disconnect();
+			return false;
+		}
+	}
+
+	if (!next_part(out)) {
+		disconnect();
+		return false;
+	}
+
+	now = timebase::now();
+	out.id = id_++;
+	out.w = w_;
+	out.h = h_;
+	out.stride = 0;
+	out.sec = now / 1000000000;
+	out.nsec = now % 1000000000;
+	return out.bytes > 0;
+}
+
+void mjpeg_stream::put_frame()
+{
+	if (release_)
+		tail_ = release_;
+	release_ = 0;
+}
+
+stream_ptr create_mjpeg(const char *url, struct params *p)
+{
+	mjpeg_stream *out = new mjpeg_stream();
+
+	if (!out->init(url, p)) {
+		delete out;
+		return nullptr;
+	}
+
+	return stream_ptr(out);
+}
+
+} // namespace camera
@@ -0,0 +1,234 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <glad/gl.h>
+
+#include "osd.h"
+#include "log.h"
+
+namespace display {
+
+static constexpr uint8_t FONT_FIRST = ' ';
+static constexpr uint8_t FONT_LAST = 'Z'; /* lower case shown as upper */
+static constexpr uint8_t FONT_CNT = FONT_LAST - FONT_FIRST + 1;
+static constexpr uint8_t GLYPH_W = 5;
+static constexpr uint8_t GLYPH_H = 7;
+static constexpr uint8_t CELL_W = GLYPH_W + 1; /* glyph plus spacing */
+static constexpr uint8_t CELL_H = GLYPH_H + 2;
+static constexpr uint8_t OSD_SCALE = 2; /* screen pixels per font pixel */
+
+/* rows top to bottom, bit 4 is leftmost pixel */
+static const uint8_t font_[FONT_CNT][GLYPH_H] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, /* space */
+	{ 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04 }, /* ! */
+	{ 0x0a, 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00 }, /* " */
+	{ 0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a }, /* # */
+	{ 0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04 }, /* $ */
+	{ 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 }, /* % */
+	{ 0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d }, /* & */
+	{ 0x0c, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00 }, /* ' */
+	{ 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 }, /* ( */
+	{ 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 }, /* ) */
+	{ 0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00 }, /* * */
+	{ 0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00 }, /* + */
+	{ 0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08 }, /* , */
+	{ 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00 }, /* - */
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c }, /* . */
+	{ 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 }, /* / */
+	{ 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e }, /* 0 */
+	{ 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e }, /* 1 */
+	{ 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f }, /* 2 */
+	{ 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e }, /* 3 */
+	{ 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 }, /* 4 */
+	{ 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e }, /* 5 */
+	{ 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e }, /* 6 */
+	{ 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 }, /* 7 */
+	{ 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e }, /* 8 */
+	{ 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c }, /* 9 */
+	{ 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 }, /* : */
+	{ 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08 }, /* ; */
+	{ 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 }, /* < */
+	{ 0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00 }, /* = */
+	{ 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 }, /* > */
+	{ 0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04 }, /* ? */
+	{ 0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e }, /* @ */
+	{ 0x0e, 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11 }, /* A */
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e }, /* B */
+	{ 0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e }, /* C */
+	{ 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c }, /* D */
+	{ 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f }, /* E */
+	{ 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 }, /* F */
+	{ 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f }, /* G */
+	{ 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 }, /* H */
+	{ 0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e }, /* I */
+	{ 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c }, /* J */
+	{ 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 }, /* K */
+	{ 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f }, /* L */
+	{ 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 }, /* M */
+	{ 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 }, /* N */
+	{ 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e }, /* O */
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 }, /* P */
+	{ 0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d }, /* Q */
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 }, /* R */
+	{ 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e }, /* S */
+	{ 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 }, /* T */
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e }, /* U */
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04 }, /* V */
+	{ 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a }, /* W */
+	{ 0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11 }, /* X */
+	{ 0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04 }, /* Y */
+	{ 0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f }, /* Z */
+};
+
+const char *osd_vsrc =
+	"#version 330\n"
+	"in vec3 a_glyph;\n" /* column, line, atlas cell */
+	"uniform vec2 u_px;\n" /* font pixel in NDC */
+	"uniform vec2 u_cell;\n" /* atlas cell in font pixels */
+	"out vec2 v_texel;\n"
+	"void main(){\n"
+		"vec2 c=vec2(float(gl_VertexID&1),float(gl_VertexID>>1));\n"
+		"vec2 p=(a_glyph.xy+c)*u_cell*u_px;\n"
+		"gl_Position=vec4(p.x-1.,1.-p.y,0.,1.);\n"
+		"v_texel=vec2(a_glyph.z*u_cell.x,0.)+c*u_cell;\n"
+	"}\n";
+
+const char *osd_fsrc =
+	"#version 330\n"
+	"uniform sampler2D u_atlas;\n"
+	"in vec2 v_texel;\n"
+	"out vec4 frag;\n"
+	"void main(){\n"
+		"float on=texelFetch(u_atlas,ivec2(v_texel),0).r;\n"
+		"frag=mix(vec4(0.,0.,0.,.6),vec4(1.,1.,.3,1.),on);\n"
+	"}\n";
+
+osd::~osd()
+{
+	glDeleteProgram(prog_);
+	glDeleteBuffers(1, &vbo_);
+	glDeleteVertexArrays(1, &vao_);
+	glDeleteTextures(1, &atlas_);
+}
+
+bool osd::init(unsigned int prog)
+{
+	uint8_t atlas[CELL_H][FONT_CNT * CELL_W];
+	GLint a_glyph;
+
+	/* one cell per glyph, blank column right and blank rows around */
+	memset(atlas, 0, sizeof(atlas));
+	for (uint8_t i = 0; i < FONT_CNT; ++i) {
+		for (uint8_t y = 0; y < GLYPH_H; ++y) {
+			for (uint8_t x = 0; x < GLYPH_W; ++x) {
+				if (font_[i][y] & (0x10 >> x))
+					atlas[y + 1][i * CELL_W + x] = 0xff;
+			}
+		}
+	}
+
+	glGenTextures(1, &atlas_);
+	glBindTexture(GL_TEXTURE_2D, atlas_);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, FONT_CNT * CELL_W, CELL_H, 0,
+	 GL_RED, GL_UNSIGNED_BYTE, atlas);
+
+	prog_ = prog;
+	u_px_ = glGetUniformLocation(prog_, "u_px");
+	u_cell_ = glGetUniformLocation(prog_, "u_cell");
+	u_atlas_ = glGetUniformLocation(prog_, "u_atlas");
+	if ((a_glyph = glGetAttribLocation(prog_, "a_glyph")) < 0) {
+		ee("osd program has no glyph attribute\n");
+		return false;
+	}
+
+	glGenVertexArrays(1, &vao_);
+	glBindVertexArray(vao_);
+	glGenBuffers(1, &vbo_);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * OSD_LINES * OSD_COLS,
+	 NULL, GL_DYNAMIC_DRAW);
+	glEnableVertexAttribArray(a_glyph);
+	glVertexAttribPointer(a_glyph, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glVertexAttribDivisor(a_glyph, 1); /* one glyph per instance */
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	return true;
+}
+
+void osd::set_line(uint8_t line, const char *fmt, ...)
+{
+	char buf[OSD_COLS + 1];
+	va_list args;
+
+	if (line >= OSD_LINES)
+		return;
+
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	if (strcmp(buf, lines_[line]) == 0)
+		return;
+
+	memcpy(lines_[line], buf, sizeof(buf));
+	dirty_ = true;
+}
+
+void osd::rebuild()
+{
+	float buf[OSD_LINES * OSD_COLS][3];
+	uint16_t n = 0;
+
+	for (uint8_t i = 0; i < OSD_LINES; ++i) {
+		for (uint8_t j = 0; lines_[i][j]; ++j) {
+			uint8_t ch = toupper(lines_[i][j]);
+
+			if (ch < FONT_FIRST || ch > FONT_LAST)
+				ch = '?';
+
+			buf[n][0] = j;
+			buf[n][1] = i;
+			buf[n][2] = ch - FONT_FIRST;
+			n++;
+		}
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, n * sizeof(buf[0]), buf);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glyphs_ = n;
+	dirty_ = false;
+}
+
+void osd::draw(uint16_t w, uint16_t h)
+{
+	if (dirty_)
+		rebuild();
+
+	if (!glyphs_ || !w || !h)
+		return;
+
+	glUseProgram(prog_);
+	glUniform2f(u_px_, 2. * OSD_SCALE / w, 2. * OSD_SCALE / h);
+	glUniform2f(u_cell_, CELL_W, CELL_H);
+	glUniform1i(u_atlas_, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, atlas_);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glBindVertexArray(vao_);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, glyphs_);
+	glBindVertexArray(0);
+	glDisable(GL_BLEND);
+}
+
+} // namespace display
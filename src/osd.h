@@ -0,0 +1,47 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef OSD_H
+#define OSD_H
+
+#include <stdint.h>
+
+namespace display {
+
+static constexpr uint8_t OSD_LINES = 4;
+static constexpr uint8_t OSD_COLS = 40;
+
+extern const char *osd_vsrc;
+extern const char *osd_fsrc;
+
+/* Text overlay drawn from 5x7 font atlas as one instanced quad per glyph,
+ * whole overlay is a single draw call. Instance buffer is rewritten only
+ * when some line changes.
+ */
+class osd {
+public:
+	~osd();
+	bool init(unsigned int prog); /* takes osd_vsrc/osd_fsrc program */
+	void set_line(uint8_t line, const char *fmt, ...)
+	 __attribute__((format(printf, 3, 4)));
+	void draw(uint16_t w, uint16_t h); /* viewport size */
+private:
+	void rebuild();
+	unsigned int prog_ = 0;
+	unsigned int atlas_ = 0;
+	unsigned int vao_ = 0;
+	unsigned int vbo_ = 0;
+	int u_px_ = -1;
+	int u_cell_ = -1;
+	int u_atlas_ = -1;
+	uint16_t glyphs_ = 0;
+	bool dirty_ = false;
+	char lines_[OSD_LINES][OSD_COLS + 1] = {};
+};
+
+}
+
+#endif // OSD_H
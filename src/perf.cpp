@@ -0,0 +1,129 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <atomic>
+
+#include "perf.h"
+#include "log.h"
+
+namespace stats {
+
+static constexpr uint64_t events_[PERF_EVENTS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static const char *names_[PERF_EVENTS] = {
+	"cycles",
+	"instructions",
+	"cache misses",
+	"branch misses",
+};
+
+static std::atomic<bool> refused_; /* warn once for all stages */
+
+perf_stage::~perf_stage()
+{
+	for (uint8_t i = 0; i < PERF_EVENTS; ++i) {
+		if (fds_[i] >= 0)
+			close(fds_[i]);
+	}
+}
+
+/* One group so all counters are scheduled on PMU together */
+bool perf_stage::open()
+{
+	struct perf_event_attr attr;
+
+	opened_ = true;
+	for (uint8_t i = 0; i < PERF_EVENTS; ++i) {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = events_[i];
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1; /* allowed up to paranoid level 2 */
+		attr.exclude_hv = 1;
+
+		fds_[i] = syscall(__NR_perf_event_open, &attr, 0, -1,
+		 i ? fds_[0] : -1, PERF_FLAG_FD_CLOEXEC);
+		if (fds_[i] >= 0)
+			continue;
+
+		if (refused_.exchange(true)) {
+			return false;
+		} else if (errno == EACCES || errno == EPERM) {
+			ww("%s counter not permitted, lower "
+			 "/proc/sys/kernel/perf_event_paranoid\n", names_[i]);
+		} else {
+			ww("no %s counter on this cpu, errno %d\n", names_[i],
+			 errno);
+		}
+
+		return false;
+	}
+
+	return true;
+}
+
+bool perf_stage::read(uint64_t *out)
+{
+	uint64_t buf[1 + PERF_EVENTS]; /* nr, then values */
+
+	if (::read(fds_[0], buf, sizeof(buf)) != sizeof(buf))
+		return false;
+
+	memcpy(out, buf + 1, sizeof(uint64_t) * PERF_EVENTS);
+	return true;
+}
+
+void perf_stage::begin()
+{
+	if (!on_)
+		return;
+	else if (!opened_ && !open())
+		on_ = false;
+	else if (!read(start_))
+		on_ = false;
+}
+
+void perf_stage::end()
+{
+	uint64_t now[PERF_EVENTS];
+
+	if (!on_ || !read(now))
+		return;
+
+	for (uint8_t i = 0; i < PERF_EVENTS; ++i)
+		sum_[i] += now[i] - start_[i];
+
+	cnt_++;
+}
+
+void perf_stage::report(const char *name) const
+{
+	if (!cnt_)
+		return;
+
+	ii("%s per frame: %llu cycles, %llu instructions, ipc %.2f, %llu "
+	 "cache misses, %llu branch misses; %llu frames\n", name,
+	 (unsigned long long) (sum_[PERF_CYCLES] / cnt_),
+	 (unsigned long long) (sum_[PERF_INSTRUCTIONS] / cnt_),
+	 sum_[PERF_CYCLES] ? (double) sum_[PERF_INSTRUCTIONS] /
+	 sum_[PERF_CYCLES] : 0.,
+	 (unsigned long long) (sum_[PERF_CACHE_MISSES] / cnt_),
+	 (unsigned long long) (sum_[PERF_BRANCH_MISSES] / cnt_),
+	 (unsigned long long) cnt_);
+}
+
+} // namespace stats
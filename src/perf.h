@@ -0,0 +1,48 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+
+namespace stats {
+
+enum perf_event : uint8_t {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_EVENTS,
+};
+
+/* Hardware counters of one pipeline stage, summed over frames. Counter
+ * group is opened by first begin() and counts the thread calling it, so a
+ * stage must always run on the same thread. When kernel refuses counters,
+ * e.g. perf_event_paranoid is too strict or there is no PMU, stage turns
+ * itself off and costs a single branch.
+ */
+class perf_stage {
+public:
+	~perf_stage();
+	void enable() { on_ = true; }
+	void begin();
+	void end(); /* stage did its work, count it */
+	void report(const char *name) const;
+private:
+	bool open();
+	bool read(uint64_t *out);
+	bool on_ = false;
+	bool opened_ = false;
+	int fds_[PERF_EVENTS] = { -1, -1, -1, -1 };
+	uint64_t start_[PERF_EVENTS] = {};
+	uint64_t sum_[PERF_EVENTS] = {};
+	uint64_t cnt_ = 0;
+};
+
+}
+
+#endif // PERF_H
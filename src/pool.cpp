@@ -0,0 +1,301 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "log.h"
+
+namespace camera {
+
+frame_pool::frame_pool(uint8_t cnt, uint32_t size, enum exhaust policy,
+ uint8_t *mem) : policy_(policy), drops_(0), reclaims_(0)
+{
+	uint8_t *data = mem;
+
+	memset(queues_, 0, sizeof(queues_));
+	for (uint8_t i = 0; i < POOL_MAX_SLOTS; ++i) {
+		slots_[i].refs.store(0);
+		slots_[i].data = nullptr;
+		slots_[i].size = 0;
+	}
+
+	if (cnt > POOL_MAX_SLOTS) {
+		ww("frame pool size %u capped to %u\n", cnt, POOL_MAX_SLOTS);
+		cnt = POOL_MAX_SLOTS;
+	}
+
+	if (!data && cnt && (data = (uint8_t *) calloc(cnt, size)))
+		owned_ = true;
+
+	if (!cnt || !data) {
+		ee("failed to allocate %u frames of %u bytes\n", cnt, size);
+		return;
+	}
+
+	for (uint8_t i = 0; i < cnt; ++i) {
+		slots_[i].data = data + i * size;
+		slots_[i].size = size;
+	}
+
+	cnt_ = cnt;
+}
+
+frame_pool::~frame_pool()
+{
+	if (owned_)
+		free(slots_[0].data); /* single allocation for all slots */
+}
+
+int frame_pool::attach(uint8_t depth)
+{
+	std::lock_guard<std::mutex> lock(lock_);
+
+	if (!depth)
+		depth = 1;
+	else if (depth > POOL_MAX_SLOTS)
+		depth = POOL_MAX_SLOTS;
+
+	for (uint8_t i = 0; i < POOL_MAX_CONSUMERS; ++i) {
+		struct queue *q = &queues_[i];
+
+		if (q->active)
+			continue;
+
+		q->active = true;
+		q->depth = depth;
+		q->head = 0;
+		q->len = 0;
+		return i;
+	}
+
+	ee("no room for more than %u frame consumers\n", POOL_MAX_CONSUMERS);
+	return -1;
+}
+
+void frame_pool::detach(int consumer)
+{
+	uint8_t freed = 0;
+
+	if (consumer < 0 || consumer >= POOL_MAX_CONSUMERS)
+		return;
+
+	std::lock_guard<std::mutex> lock(lock_);
+	struct queue *q = &queues_[consumer];
+
+	for (; q->len; --q->len) {
+		struct slot *s = q->q[q->head];
+
+		q->head = (q->head + 1) % POOL_MAX_SLOTS;
+		freed += s->refs.fetch_sub(1) == 1;
+	}
+
+	q->active = false;
+	if (freed)
+		freed_.notify_all();
+}
+
+uint8_t frame_pool::consumers()
+{
+	std::lock_guard<std::mutex> lock(lock_);
+	uint8_t cnt = 0;
+
+	for (uint8_t i = 0; i < POOL_MAX_CONSUMERS; ++i)
+		cnt += queues_[i].active;
+
+	return cnt;
+}
+
+uint8_t frame_pool::queued(int consumer)
+{
+	std::lock_guard<std::mutex> lock(lock_);
+
+	if (consumer < 0 || consumer >= POOL_MAX_CONSUMERS)
+		return 0;
+
+	return queues_[consumer].len;
+}
+
+uint8_t frame_pool::busy()
+{
+	uint8_t cnt = 0;
+
+	for (uint8_t i = 0; i < cnt_; ++i)
+		cnt += slots_[i].refs.load(std::memory_order_relaxed) != 0;
+
+	return cnt;
+}
+
+struct slot *frame_pool::grab()
+{
+	for (uint8_t i = 0; i < cnt_; ++i) {
+		uint32_t free = 0;
+
+		if (slots_[i].refs.compare_exchange_strong(free, 1))
+			return &slots_[i];
+	}
+
+	return nullptr;
+}
+
+/* Must be called with lock_ held. Oldest queued frame sits at the head of
+ * every queue still holding it, so it can be unlinked without searching.
+ */
+bool frame_pool::reclaim_oldest()
+{
+	struct slot *oldest = nullptr;
+
+	for (uint8_t i = 0; i < POOL_MAX_CONSUMERS; ++i) {
+		struct queue *q = &queues_[i];
+
+		if (!q->active || !q->len)
+			continue;
+		else if (!oldest || q->q[q->head]->seq < oldest->seq)
+			oldest = q->q[q->head];
+	}
+
+	if (!oldest)
+		return false;
+
+	for (uint8_t i = 0; i < POOL_MAX_CONSUMERS; ++i) {
+		struct queue *q = &queues_[i];
+
+		if (!q->active || !q->len || q->q[q->head] != oldest)
+			continue;
+
+		q->head = (q->head + 1) % POOL_MAX_SLOTS;
+		q->len--;
+		oldest->refs.fetch_sub(1);
+	}
+
+	reclaims_++;
+	return true;
+}
+
+struct slot *frame_pool::acquire()
+{
+	struct slot *s;
+
+	if ((s = grab()))
+		return s;
+
+	std::unique_lock<std::mutex> lock(lock_);
+	while (!(s = grab())) {
+		if (cancel_) {
+			return nullptr;
+		} else if (policy_ == exhaust::block) {
+			freed_.wait(lock);
+		} else if (!reclaim_oldest()) {
+			drops_++; /* all frames are held by consumers */
+			return nullptr;
+		}
+	}
+
+	return s;
+}
+
+void frame_pool::publish(struct slot *s)
+{
+	uint8_t freed = 0;
+
+	std::unique_lock<std::mutex> lock(lock_);
+	s->seq = seq_++;
+	for (uint8_t i = 0; i < POOL_MAX_CONSUMERS; ++i) {
+		struct queue *q = &queues_[i];
+
+		if (!q->active)
+			continue;
+
+		if (q->len == q->depth) { /* slow consumer keeps newest frames */
+			struct slot *old = q->q[q->head];
+
+			q->head = (q->head + 1) % POOL_MAX_SLOTS;
+			q->len--;
+			freed += old->refs.fetch_sub(1) == 1;
+		}
+
+		s->refs.fetch_add(1);
+		q->q[(q->head + q->len) % POOL_MAX_SLOTS] = s;
+		q->len++;
+	}
+
+	freed += s->refs.fetch_sub(1) == 1; /* producer reference */
+	lock.unlock();
+
+	ready_.notify_all();
+	if (freed)
+		freed_.notify_all();
+}
+
+struct slot *frame_pool::pop(int consumer, bool wait)
+{
+	struct slot *s;
+
+	if (consumer < 0 || consumer >= POOL_MAX_CONSUMERS)
+		return nullptr;
+
+	std::unique_lock<std::mutex> lock(lock_);
+	struct queue *q = &queues_[consumer];
+
+	while (!q->len) {
+		if (!wait || cancel_)
+			return nullptr;
+
+		ready_.wait(lock);
+	}
+
+	s = q->q[q->head];
+	q->head = (q->head + 1) % POOL_MAX_SLOTS;
+	q->len--;
+	return s;
+}
+
+struct slot *frame_pool::pop_latest(int consumer)
+{
+	struct slot *s = nullptr;
+	uint8_t freed = 0;
+
+	if (consumer < 0 || consumer >= POOL_MAX_CONSUMERS)
+		return nullptr;
+
+	std::unique_lock<std::mutex> lock(lock_);
+	struct queue *q = &queues_[consumer];
+
+	for (; q->len; --q->len) {
+		if (s)
+			freed += s->refs.fetch_sub(1) == 1;
+
+		s = q->q[q->head];
+		q->head = (q->head + 1) % POOL_MAX_SLOTS;
+	}
+
+	lock.unlock();
+	if (freed)
+		freed_.notify_all();
+
+	return s;
+}
+
+void frame_pool::release(struct slot *s)
+{
+	if (s->refs.fetch_sub(1) != 1)
+		return;
+
+	std::lock_guard<std::mutex> lock(lock_); /* pairs with acquire() */
+	freed_.notify_all();
+}
+
+void frame_pool::cancel()
+{
+	std::lock_guard<std::mutex> lock(lock_);
+	cancel_ = true;
+	freed_.notify_all();
+	ready_.notify_all();
+}
+
+} // namespace camera
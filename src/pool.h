@@ -0,0 +1,93 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+namespace camera {
+
+static constexpr uint8_t POOL_MAX_SLOTS = 16;
+static constexpr uint8_t POOL_MAX_CONSUMERS = 8;
+
+enum class exhaust : uint8_t {
+	drop_oldest, /* reclaim oldest frame not yet taken by any consumer */
+	block, /* wait for consumers to release frames */
+};
+
+struct slot {
+	std::atomic<uint32_t> refs;
+	uint64_t seq; /* publish order */
+	uint32_t id;
+	uint16_t w;
+	uint16_t h;
+	uint32_t fmt;
+	uint64_t sec;
+	uint64_t nsec;
+	uint32_t bytes; /* payload */
+	uint32_t stride; /* raw frames only, see camera::image */
+	uint32_t size; /* capacity */
+	uint8_t *data;
+};
+
+/* Fixed set of frame slots shared by one producer and several consumers.
+ * Producer fills a slot obtained from acquire() and hands it over with
+ * publish(), which queues one reference per attached consumer. Slot goes
+ * back to the pool when the last reference is dropped with release().
+ * Slot memory may be provided by caller, e.g. mapped GPU buffer of at
+ * least cnt * size bytes.
+ */
+class frame_pool {
+public:
+	frame_pool(uint8_t cnt, uint32_t size, enum exhaust policy,
+	 uint8_t *mem = nullptr);
+	~frame_pool();
+	bool valid() const { return cnt_ != 0; }
+	int attach(uint8_t depth);
+	void detach(int consumer);
+	uint8_t consumers();
+	uint8_t queued(int consumer); /* frames waiting to be popped */
+	uint8_t busy(); /* slots referenced by anyone */
+	struct slot *acquire();
+	void publish(struct slot *);
+	struct slot *pop(int consumer, bool wait = false);
+	struct slot *pop_latest(int consumer);
+	void ref(struct slot *s) { s->refs.fetch_add(1); }
+	void release(struct slot *);
+	void cancel();
+	uint32_t drops() const { return drops_.load(); }
+	uint32_t reclaims() const { return reclaims_.load(); }
+private:
+	struct queue {
+		bool active;
+		uint8_t depth;
+		uint8_t head;
+		uint8_t len;
+		struct slot *q[POOL_MAX_SLOTS];
+	};
+	struct slot *grab();
+	bool reclaim_oldest();
+	uint8_t cnt_ = 0;
+	bool owned_ = false; /* slot memory allocated here */
+	enum exhaust policy_;
+	uint64_t seq_ = 0;
+	bool cancel_ = false;
+	struct slot slots_[POOL_MAX_SLOTS];
+	struct queue queues_[POOL_MAX_CONSUMERS];
+	std::mutex lock_;
+	std::condition_variable freed_;
+	std::condition_variable ready_;
+	std::atomic<uint32_t> drops_;
+	std::atomic<uint32_t> reclaims_;
+};
+
+}
+
+#endif // POOL_H
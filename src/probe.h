@@ -0,0 +1,34 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+/* USDT probes of provider camview, attach without restart, e.g.
+ *   bpftrace -e 'usdt:./camview:camview:decode_end { @[arg0] = nsecs; }'
+ *   perf buildid-cache --add ./camview; perf record -e sdt_camview:dqbuf
+ * Each probe site is a single nop plus ELF note telling tracer where its
+ * arguments live; nothing runs until a tracer attaches. CMake defines
+ * HAVE_PROBES when systemtap sdt header is found and reports it, configure
+ * with -DNO_PROBES=ON to leave them out; otherwise probes compile to nothing.
+ */
+#if defined(HAVE_PROBES) && !defined(NO_PROBES)
+#include <sys/sdt.h>
+#else
+#undef HAVE_PROBES
+#endif
+
+#ifdef HAVE_PROBES
+#define probe1(name, a) STAP_PROBE1(camview, name, a)
+#define probe2(name, a, b) STAP_PROBE2(camview, name, a, b)
+#define probe3(name, a, b, c) STAP_PROBE3(camview, name, a, b, c)
+#else
+#define probe1(name, a) do {} while (0)
+#define probe2(name, a, b) do {} while (0)
+#define probe3(name, a, b, c) do {} while (0)
+#endif
+
+#endif // PROBE_H
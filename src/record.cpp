@@ -0,0 +1,159 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+
+#include "record.h"
+#include "camera.h"
+#include "format.h"
+#include "jpeg.h"
+#include "lossless.h"
+#include "timebase.h"
+#include "log.h"
+
+namespace camera {
+
+recorder::recorder(frame_pool &pool, const char *path, uint8_t quality,
+ uint8_t threads) : pool_(pool), quality_(quality)
+{
+	const char *ext = strrchr(path, '.');
+
+	if (!(fp_ = fopen(path, "wb"))) {
+		ee("failed to open '%s', errno %d\n", path, errno);
+		return;
+	} else if ((consumer_ = pool_.attach(POOL_MAX_SLOTS)) < 0) {
+		fclose(fp_);
+		fp_ = nullptr;
+		return;
+	}
+
+	if (!threads) {
+		threads = 1;
+	} else if (threads > RECORD_MAX_THREADS) {
+		ww("recorder threads %u capped to %u\n", threads,
+		 RECORD_MAX_THREADS);
+		threads = RECORD_MAX_THREADS;
+	}
+
+	if (ext && strcmp(ext, ".cvl") == 0) {
+		slices_ = threads;
+		threads = 1;
+	}
+
+	start_ns_ = timebase::now();
+	for (threads_cnt_ = 0; threads_cnt_ < threads; ++threads_cnt_) {
+		threads_[threads_cnt_] = std::thread(&recorder::work, this);
+		pthread_setname_np(threads_[threads_cnt_].native_handle(),
+		 "record");
+	}
+
+	if (slices_)
+		ii("recording to %s, lossless, %u slices\n", path, slices_);
+	else
+		ii("recording to %s, quality %u, %u threads\n", path, quality_,
+		 threads_cnt_);
+}
+
+recorder::~recorder()
+{
+	stop();
+}
+
+void recorder::stop()
+{
+	if (!fp_)
+		return;
+
+	for (uint8_t i = 0; i < threads_cnt_; ++i)
+		threads_[i].join();
+
+	pool_.detach(consumer_);
+	fclose(fp_);
+	fp_ = nullptr;
+
+	if (!written_)
+		return;
+
+	uint64_t ms = (timebase::now() - start_ns_) / 1000000;
+	uint64_t mean = encode_us_.mean();
+
+	ii("recorded %u frames, %u lost, %llu MiB in %llu MiB out, %llu ms\n",
+	 written_, lost_, (unsigned long long) in_bytes_ >> 20,
+	 (unsigned long long) out_bytes_ >> 20, (unsigned long long) ms);
+	if (mean) { /* what workers could sustain if never starved */
+		ii("encoder capacity %llu fps with %u threads\n",
+		 (unsigned long long) (1000000ULL * threads_cnt_ / mean),
+		 slices_ ? slices_ : threads_cnt_);
+	}
+
+	encode_us_.report(slices_ ? "lossless encode" : "jpeg encode");
+}
+
+void recorder::work()
+{
+	std::unique_ptr<jpeg_encoder> jpeg;
+	std::unique_ptr<lossless_codec> lossless;
+	const uint8_t *out;
+	uint32_t bytes;
+	uint32_t ticket;
+	struct slot *s;
+
+	if (slices_)
+		lossless.reset(new lossless_codec(slices_));
+	else
+		jpeg.reset(new jpeg_encoder(quality_));
+
+	while (1) {
+		{
+			std::lock_guard<std::mutex> lock(take_lock_);
+
+			if (!(s = pool_.pop(consumer_, true)))
+				break; /* cancelled and drained */
+
+			ticket = tickets_++;
+		}
+
+		uint64_t start = timebase::now();
+		const struct format *f = find_format(s->fmt);
+
+		if (lossless) {
+			bytes = lossless->encode(s, &out);
+		} else if (f && f->layout == layout::jpeg) {
+			out = s->data;
+			bytes = s->bytes;
+		} else {
+			bytes = jpeg->encode(s, &out);
+		}
+
+		if (!bytes)
+			ee("failed to encode frame %u\n", s->id);
+
+		uint64_t us = (timebase::now() - start) / 1000;
+
+		std::unique_lock<std::mutex> lock(write_lock_);
+		turn_.wait(lock, [&] { return written_ == ticket; });
+
+		if (bytes && fwrite(out, 1, bytes, fp_) != bytes)
+			ee("failed to write frame %u\n", s->id);
+
+		if (written_ && s->id != last_id_ + 1)
+			lost_ += s->id - last_id_ - 1;
+
+		last_id_ = s->id;
+		in_bytes_ += s->bytes;
+		out_bytes_ += bytes;
+		encode_us_.add(us);
+		written_++;
+		lock.unlock();
+
+		turn_.notify_all();
+		pool_.release(s);
+	}
+}
+
+} // namespace camera
@@ -0,0 +1,60 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "pool.h"
+#include "stats.h"
+
+namespace camera {
+
+static constexpr uint8_t RECORD_MAX_THREADS = 8;
+
+/* Records frames of a pool as MJPEG stream, i.e. concatenated JPEG files.
+ * Raw frames are encoded by a pool of workers, each taking next queued
+ * frame; output is written strictly in the order frames were taken. JPEG
+ * frames are written as is. Paths ending with .cvl get lossless coding
+ * instead, one frame at a time with threads working on its slices.
+ */
+class recorder {
+public:
+	recorder(frame_pool &pool, const char *path, uint8_t quality,
+	 uint8_t threads);
+	~recorder();
+	bool valid() const { return fp_ != nullptr; }
+	void stop(); /* after pool is cancelled, drains queued frames */
+private:
+	void work();
+	frame_pool &pool_;
+	int consumer_ = -1;
+	FILE *fp_ = nullptr;
+	uint8_t quality_;
+	uint8_t slices_ = 0; /* lossless when set */
+	uint8_t threads_cnt_ = 0;
+	std::thread threads_[RECORD_MAX_THREADS];
+	std::mutex take_lock_; /* pop and ticket go together */
+	uint32_t tickets_ = 0;
+	std::mutex write_lock_;
+	std::condition_variable turn_;
+	uint32_t written_ = 0;
+	uint32_t last_id_ = 0;
+	uint32_t lost_ = 0; /* sequence gaps seen in written frames */
+	uint64_t in_bytes_ = 0;
+	uint64_t out_bytes_ = 0;
+	uint64_t start_ns_ = 0;
+	stats::histogram encode_us_;
+};
+
+}
+
+#endif // RECORD_H
@@ -0,0 +1,248 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <thread>
+
+#include "camera.h"
+#include "lossless.h"
+#include "format.h"
+#include "timebase.h"
+#include "log.h"
+
+namespace camera {
+
+static constexpr uint64_t RESYNC_NS = 1000000000; /* behind more, rebase */
+
+static uint8_t decode_threads()
+{
+	unsigned int cnt = std::thread::hardware_concurrency();
+
+	return cnt < 1 ? 1 : (cnt > LOSSLESS_MAX_SLICES ? LOSSLESS_MAX_SLICES :
+	 cnt);
+}
+
+static inline uint64_t stamp_ns(const struct lossless_header &hdr)
+{
+	return hdr.sec * 1000000000ULL + hdr.nsec;
+}
+
+/* Plays .cvl recording at recorded pace and starts over at the end. Frames
+ * are stamped with time they are handed out, so latency stats stay valid,
+ * while ids are kept as recorded and show frames lost during recording.
+ * Compressed frames vary in size and are handed out straight from read
+ * buffer, buffers are sized by largest frame in the file.
+ */
+class replay : public stream {
+public:
+	replay() : codec_(decode_threads()) {}
+	~replay();
+	bool init(const char *path, struct params *);
+	bool start() override;
+	bool stop() override { return true; }
+	void get_frame_size(uint16_t &w, uint16_t &h) override;
+	uint32_t get_buffer_size() override { return max_bytes_; }
+	bool get_frame(struct image &) override;
+	void put_frame() override {}
+private:
+	bool read_frame(struct lossless_header &);
+	void scan();
+	void pace(uint64_t rec_ns);
+	FILE *fp_ = nullptr;
+	lossless_codec codec_;
+	struct lossless_header first_;
+	uint8_t *in_ = nullptr;
+	uint32_t in_cap_ = 0;
+	uint8_t *frame_ = nullptr; /* decoded slices */
+	uint32_t max_bytes_ = 0;
+	uint32_t played_ = 0; /* since last rewind */
+	uint64_t start_ns_ = 0;
+	uint64_t rec_start_ns_ = 0;
+};
+
+replay::~replay()
+{
+	if (fp_)
+		fclose(fp_);
+
+	free(in_);
+	free(frame_);
+}
+
+/* Header and payload of next frame, false at the end or if truncated */
+bool replay::read_frame(struct lossless_header &hdr)
+{
+	uint32_t bytes = 0;
+	uint8_t *in;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp_) != 1) {
+		return false;
+	} else if (hdr.magic != LOSSLESS_MAGIC ||
+	 hdr.slices > LOSSLESS_MAX_SLICES) {
+		ee("malformed recording at offset %ld\n", ftell(fp_));
+		return false;
+	}
+
+	for (uint8_t i = 0; i < hdr.slices; ++i)
+		bytes += hdr.slice_bytes[i];
+
+	if (!hdr.slices)
+		bytes = hdr.bytes;
+
+	if (in_cap_ < bytes) {
+		if (!(in = (uint8_t *) realloc(in_, bytes)))
+			return false;
+
+		in_ = in;
+		in_cap_ = bytes;
+	}
+
+	return fread(in_, 1, bytes, fp_) == bytes;
+}
+
+/* Largest frame of the file, skipping over payloads */
+void replay::scan()
+{
+	struct lossless_header hdr;
+	long bytes;
+
+	rewind(fp_);
+	while (fread(&hdr, sizeof(hdr), 1, fp_) == 1) {
+		if (hdr.magic != LOSSLESS_MAGIC ||
+		 hdr.slices > LOSSLESS_MAX_SLICES)
+			break;
+
+		bytes = hdr.slices ? 0 : hdr.bytes;
+		for (uint8_t i = 0; i < hdr.slices; ++i)
+			bytes += hdr.slice_bytes[i];
+
+		if (hdr.bytes > max_bytes_)
+			max_bytes_ = hdr.bytes;
+		if (fseek(fp_, bytes, SEEK_CUR) < 0)
+			break;
+	}
+
+	rewind(fp_);
+}
+
+bool replay::init(const char *path, struct params *p)
+{
+	struct lossless_header next;
+
+	if (!(fp_ = fopen(path, "rb"))) {
+		ee("failed to open '%s', errno %d\n", path, errno);
+		return false;
+	} else if (!read_frame(first_)) {
+		ee("'%s' is not a recording\n", path);
+		return false;
+	} else if (!find_format(first_.fmt)) {
+		ee("unknown format %08x in '%s'\n", first_.fmt, path);
+		return false;
+	}
+
+	/* recorded rate from first two frames */
+	if (read_frame(next) && stamp_ns(next) > stamp_ns(first_))
+		p->fps = 1000000000ULL / (stamp_ns(next) - stamp_ns(first_));
+
+	scan();
+	if (first_.slices && !(frame_ = (uint8_t *) calloc(1, first_.bytes)))
+		return false;
+
+	p->w = first_.w;
+	p->h = first_.h;
+	p->fmt = first_.fmt;
+	ii("replay %s %ux%u@%u %s\n", path, p->w, p->h, p->fps,
+	 format_name(p->fmt));
+	return true;
+}
+
+bool replay::start()
+{
+	start_ns_ = 0; /* no catching up after pause */
+	return true;
+}
+
+void replay::get_frame_size(uint16_t &w, uint16_t &h)
+{
+	w = first_.w;
+	h = first_.h;
+}
+
+void replay::pace(uint64_t rec_ns)
+{
+	uint64_t now = timebase::now();
+	uint64_t due = start_ns_ + (rec_ns - rec_start_ns_);
+	struct timespec ts;
+
+	if (!start_ns_ || rec_ns < rec_start_ns_ || now > due + RESYNC_NS) {
+		start_ns_ = now;
+		rec_start_ns_ = rec_ns;
+		return;
+	} else if (due <= now) {
+		return;
+	}
+
+	ts.tv_sec = due / 1000000000;
+	ts.tv_nsec = due % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	 EINTR)
+		;
+}
+
+bool replay::get_frame(struct image &out)
+{
+	struct lossless_header hdr;
+
+	if (!read_frame(hdr)) {
+		if (!played_) /* nothing playable in whole file */
+			return false;
+
+		rewind(fp_);
+		played_ = 0;
+		start_ns_ = 0;
+		if (!read_frame(hdr))
+			return false;
+	}
+
+	if (hdr.fmt != first_.fmt || hdr.w != first_.w || hdr.h != first_.h ||
+	 (hdr.slices && (!frame_ || hdr.bytes > first_.bytes))) {
+		ee("frame %u changes stream format\n", hdr.id);
+		return false;
+	} else if (hdr.slices && !codec_.decode(hdr, in_, frame_)) {
+		return false;
+	}
+
+	pace(stamp_ns(hdr));
+	played_++;
+
+	uint64_t now = timebase::now();
+
+	out.id = hdr.id;
+	out.w = hdr.w;
+	out.h = hdr.h;
+	out.data = hdr.slices ? frame_ : in_; /* compressed kept as is */
+	out.bytes = hdr.bytes;
+	out.stride = hdr.stride;
+	out.sec = now / 1000000000;
+	out.nsec = now % 1000000000;
+	return true;
+}
+
+stream_ptr create_replay(const char *path, struct params *p)
+{
+	replay *out = new replay();
+
+	if (!out->init(path, p)) {
+		delete out;
+		return nullptr;
+	}
+
+	return stream_ptr(out);
+}
+
+} // namespace camera
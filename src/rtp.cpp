@@ -0,0 +1,349 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rtp.h"
+#include "camera.h"
+#include "format.h"
+#include "jpeg.h"
+#include "timebase.h"
+#include "log.h"
+
+namespace camera {
+
+static constexpr uint16_t RTP_MTU = 1400; /* whole datagram, fits tunnels */
+static constexpr uint8_t RTP_BATCH = 16; /* packets per sendmmsg() */
+static constexpr uint8_t RTP_PT_JPEG = 26;
+static constexpr uint8_t RTP_HEADER = 12;
+static constexpr uint8_t JPEG_HEADER = 8;
+static constexpr uint8_t QUANT_HEADER = 4 + 2 * 64;
+static constexpr uint8_t PACE_PERCENT = 80; /* of frame interval */
+
+/* What RFC 2435 carries of baseline JPEG: type, size in blocks, tables
+ * and entropy coded scan; Huffman tables must be the standard ones
+ */
+struct rtp_jpeg {
+	uint8_t type; /* 0 for 4:2:2, 1 for 4:2:0 */
+	uint8_t w8;
+	uint8_t h8;
+	const uint8_t *quant[2]; /* zigzag order as in DQT */
+	const uint8_t *scan;
+	uint32_t scan_len;
+};
+
+static inline void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static bool parse(const uint8_t *p, uint32_t len, struct rtp_jpeg *out)
+{
+	uint8_t sampling[3] = {};
+	uint8_t tq[3] = {};
+	uint16_t w = 0;
+	uint16_t h = 0;
+	uint32_t i = 2;
+
+	memset(out, 0, sizeof(*out));
+	if (len < 4 || p[0] != 0xff || p[1] != 0xd8)
+		return false;
+
+	while (!out->scan && i + 4 <= len) {
+		const uint8_t *d = p + i + 4;
+		uint16_t seg = p[i + 2] << 8 | p[i + 3];
+		uint8_t marker = p[i + 1];
+
+		if (p[i] != 0xff) {
+			return false;
+		} else if (marker == 0xff) { /* fill byte */
+			i++;
+			continue;
+		} else if (seg < 2 || i + 2 + seg > len) {
+			return false;
+		}
+
+		switch (marker) {
+		case 0xdb: /* DQT, 8-bit tables only */
+			for (uint16_t j = 0; j + 65 <= seg - 2; j += 65) {
+				if (d[j] >> 4)
+					return false;
+				else if ((d[j] & 0xf) < 2)
+					out->quant[d[j] & 0xf] = d + j + 1;
+			}
+			break;
+		case 0xc0: /* SOF0 with three components */
+			if (seg < 17 || d[5] != 3)
+				return false;
+
+			h = d[1] << 8 | d[2];
+			w = d[3] << 8 | d[4];
+			for (uint8_t c = 0; c < 3; ++c) {
+				sampling[c] = d[7 + c * 3];
+				tq[c] = d[8 + c * 3];
+			}
+			break;
+		case 0xc4: /* DHT, receiver can only rebuild standard ones */
+			if (!standard_dht(d, seg - 2))
+				return false;
+			break;
+		case 0xdd: /* DRI, restart markers need other payload type */
+			if (d[0] || d[1])
+				return false;
+			break;
+		case 0xda:
+			out->scan = p + i + 2 + seg;
+			break;
+		default: /* other SOFs: extended, progressive, lossless */
+			if ((marker & 0xf0) == 0xc0 && marker != 0xc4 &&
+			 marker != 0xc8 && marker != 0xcc)
+				return false;
+			break;
+		}
+
+		i += 2 + seg;
+	}
+
+	if (!out->scan || !out->quant[0] || !out->quant[1] || tq[0] != 0 ||
+	 tq[1] != 1 || tq[2] != 1 || sampling[1] != 0x11 ||
+	 sampling[2] != 0x11) {
+		return false;
+	} else if (sampling[0] == 0x21) {
+		out->type = 0;
+	} else if (sampling[0] == 0x22) {
+		out->type = 1;
+	} else {
+		return false;
+	}
+
+	if (!w || !h || (w + 7) / 8 > 255 || (h + 7) / 8 > 255)
+		return false;
+
+	out->w8 = (w + 7) / 8;
+	out->h8 = (h + 7) / 8;
+	out->scan_len = p + len - out->scan;
+	for (uint32_t j = len - 2; p + j > out->scan; --j) { /* up to EOI */
+		if (p[j] == 0xff && p[j + 1] == 0xd9) {
+			out->scan_len = p + j - out->scan;
+			break;
+		}
+	}
+
+	return true;
+}
+
+rtp_sender::rtp_sender(frame_pool &raw, const char *addr,
+ const frame_clock &clock, uint8_t quality) : raw_(raw), clock_(clock),
+ quality_(quality)
+{
+	struct sockaddr_in sa;
+	const char *port = strrchr(addr, ':');
+	char host[INET_ADDRSTRLEN];
+	uint64_t now = timebase::now();
+	int size = 1 << 20;
+	uint8_t ttl = 1;
+	uint8_t loop = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	if (!port || port - addr >= (int) sizeof(host)) {
+		ee("malformed rtp address '%s', e.g. 239.0.0.1:5004\n", addr);
+		return;
+	}
+
+	memcpy(host, addr, port - addr);
+	host[port - addr] = '\0';
+	sa.sin_port = htons(atoi(port + 1));
+	if (!sa.sin_port || inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+		ee("malformed rtp address '%s', e.g. 127.0.0.1:5004\n", addr);
+		return;
+	} else if ((fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+		ee("failed to create socket, errno %d\n", errno);
+		return;
+	}
+
+	/* multicast stays on this subnet and loops back to local receivers */
+	if (IN_MULTICAST(ntohl(sa.sin_addr.s_addr))) {
+		setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, 1);
+		setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, 1);
+	}
+
+	setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	if (connect(fd_, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+		ee("failed to connect to %s, errno %d\n", addr, errno);
+		close(fd_);
+		fd_ = -1;
+		return;
+	} else if ((consumer_ = raw_.attach(1)) < 0) {
+		close(fd_);
+		fd_ = -1;
+		return;
+	}
+
+	seq_ = now;
+	ssrc_ = (now >> 32) ^ now ^ getpid();
+	thread_ = std::thread(&rtp_sender::work, this);
+	pthread_setname_np(thread_.native_handle(), "rtp");
+	ii("rtp/jpeg to %s, payload type %u, 90 kHz clock\n", addr,
+	 RTP_PT_JPEG);
+}
+
+rtp_sender::~rtp_sender()
+{
+	stop();
+}
+
+void rtp_sender::stop()
+{
+	if (fd_ < 0)
+		return;
+
+	thread_.join();
+	raw_.detach(consumer_);
+	close(fd_);
+	fd_ = -1;
+
+	ii("rtp: %u frames in %u packets, %u frames skipped, %u send errors\n",
+	 frames_, packets_, skipped_, errors_);
+}
+
+/* Packets of a frame go in batches spread evenly over most of frame
+ * interval; only sequence, marker and offset differ between them
+ */
+bool rtp_sender::send(const struct rtp_jpeg &j, uint32_t ts)
+{
+	uint8_t hdr[RTP_BATCH][RTP_HEADER + JPEG_HEADER + QUANT_HEADER];
+	uint8_t tmpl[RTP_HEADER + JPEG_HEADER];
+	struct iovec iov[RTP_BATCH][2];
+	struct mmsghdr msgs[RTP_BATCH];
+	uint32_t room = RTP_MTU - RTP_HEADER - JPEG_HEADER;
+	uint32_t cnt = 1;
+	uint32_t off = 0;
+	uint64_t start = timebase::now();
+	uint64_t span = clock_.interval_ns() * PACE_PERCENT / 100;
+
+	if (j.scan_len > room - QUANT_HEADER)
+		cnt += (j.scan_len - (room - QUANT_HEADER) + room - 1) / room;
+
+	uint32_t batches = (cnt + RTP_BATCH - 1) / RTP_BATCH;
+
+	tmpl[0] = 0x80; /* version 2 */
+	tmpl[1] = RTP_PT_JPEG;
+	put32(tmpl + 4, ts);
+	put32(tmpl + 8, ssrc_);
+	tmpl[12] = 0; /* type specific */
+	tmpl[16] = j.type;
+	tmpl[17] = 255; /* tables in band */
+	tmpl[18] = j.w8;
+	tmpl[19] = j.h8;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (uint32_t b = 0; b < batches; ++b) {
+		uint8_t n = 0;
+
+		for (; n < RTP_BATCH && off < j.scan_len; ++n) {
+			uint8_t *h = hdr[n];
+			uint16_t len = sizeof(tmpl);
+			uint32_t take = room;
+
+			memcpy(h, tmpl, sizeof(tmpl));
+			put16(h + 2, seq_++);
+			h[13] = off >> 16;
+			put16(h + 14, off);
+
+			if (!off) {
+				h[20] = 0; /* mbz */
+				h[21] = 0; /* both tables 8-bit */
+				put16(h + 22, 2 * 64);
+				memcpy(h + 24, j.quant[0], 64);
+				memcpy(h + 24 + 64, j.quant[1], 64);
+				len += QUANT_HEADER;
+				take -= QUANT_HEADER;
+			}
+
+			if (take >= j.scan_len - off) {
+				take = j.scan_len - off;
+				h[1] |= 0x80; /* marker, last packet of frame */
+			}
+
+			iov[n][0] = { h, len };
+			iov[n][1] = { (void *) (j.scan + off), take };
+			msgs[n].msg_hdr.msg_iov = iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 2;
+			off += take;
+		}
+
+		if (b) {
+			uint64_t due = start + span * b / batches;
+			struct timespec at = { (time_t) (due / 1000000000),
+			 (long) (due % 1000000000) };
+
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			 &at, NULL) == EINTR)
+				;
+		}
+
+		for (uint8_t sent = 0; sent < n;) {
+			int rc = sendmmsg(fd_, msgs + sent, n - sent, 0);
+
+			if (rc < 0 && errno == EINTR) {
+				continue;
+			} else if (rc < 0) { /* e.g. no listener on loopback */
+				errors_++;
+				return false;
+			}
+
+			sent += rc;
+			packets_ += rc;
+		}
+	}
+
+	return true;
+}
+
+void rtp_sender::work()
+{
+	jpeg_encoder jpeg(quality_);
+	struct rtp_jpeg info;
+	struct slot *s;
+
+	while ((s = raw_.pop(consumer_, true))) {
+		const struct format *f = find_format(s->fmt);
+		const uint8_t *data = s->data;
+		uint32_t bytes = s->bytes;
+		uint32_t ts = (s->sec * 90000 + s->nsec * 9 / 100000);
+
+		if (!f || f->layout != layout::jpeg)
+			bytes = jpeg.encode(s, &data);
+
+		if (!bytes || !parse(data, bytes, &info)) {
+			if (!skipped_++)
+				ww("frame %u is not baseline 4:2:2 or 4:2:0 jpeg "
+				 "of at most 2040x2040, not sent\n", s->id);
+		} else if (send(info, ts)) {
+			frames_++;
+		}
+
+		raw_.release(s);
+	}
+}
+
+} // namespace camera
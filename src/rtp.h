@@ -0,0 +1,52 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef RTP_H
+#define RTP_H
+
+#include <stdint.h>
+#include <thread>
+
+#include "pool.h"
+#include "frameclock.h"
+
+namespace camera {
+
+struct rtp_jpeg;
+
+/* RTP/JPEG (RFC 2435) over UDP, unicast or multicast. Newest frame of raw
+ * pool is sent as is when camera gives JPEG, raw formats are encoded.
+ * Scan data goes out straight from frame memory in batches of packets
+ * spread over measured frame interval, so switches and receivers see no
+ * bursts.
+ */
+class rtp_sender {
+public:
+	rtp_sender(frame_pool &raw, const char *addr,
+	 const frame_clock &clock, uint8_t quality);
+	~rtp_sender();
+	bool valid() const { return fd_ >= 0; }
+	void stop(); /* after raw pool is cancelled */
+private:
+	void work();
+	bool send(const struct rtp_jpeg &, uint32_t ts);
+	frame_pool &raw_;
+	int consumer_ = -1;
+	int fd_ = -1;
+	const frame_clock &clock_;
+	uint8_t quality_;
+	uint16_t seq_;
+	uint32_t ssrc_;
+	uint32_t frames_ = 0;
+	uint32_t packets_ = 0;
+	uint32_t skipped_ = 0; /* not representable in RTP/JPEG */
+	uint32_t errors_ = 0;
+	std::thread thread_;
+};
+
+}
+
+#endif // RTP_H
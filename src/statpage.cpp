@@ -0,0 +1,145 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "statpage.h"
+#include "format.h"
+#include "log.h"
+
+namespace stats {
+
+page_writer::~page_writer()
+{
+	if (!page_)
+		return;
+
+	munmap(page_, sizeof(*page_));
+	unlink(path_);
+}
+
+bool page_writer::open(const char *dev, uint32_t fmt, uint16_t w,
+ uint16_t h)
+{
+	int fd;
+	void *mem;
+
+	snprintf(path_, sizeof(path_), "%s/%s%d", PAGE_DIR, PAGE_PREFIX,
+	 getpid());
+	if ((fd = ::open(path_, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+	 0644)) < 0) {
+		ww("no stats page, failed to create %s, errno %d\n", path_,
+		 errno);
+		return false;
+	} else if (ftruncate(fd, sizeof(*page_)) < 0) {
+		close(fd);
+		unlink(path_);
+		return false;
+	}
+
+	mem = mmap(NULL, sizeof(*page_), PROT_READ | PROT_WRITE, MAP_SHARED,
+	 fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		unlink(path_);
+		return false;
+	}
+
+	page_ = (struct page *) mem; /* zero filled by ftruncate */
+	page_->pid = getpid();
+	snprintf(page_->dev, sizeof(page_->dev), "%s", dev);
+	snprintf(page_->fmt, sizeof(page_->fmt), "%s",
+	 camera::format_name(fmt));
+	page_->w = w;
+	page_->h = h;
+	page_->size = sizeof(*page_);
+	page_->version = PAGE_VERSION;
+	__atomic_store_n(&page_->magic, PAGE_MAGIC, __ATOMIC_RELEASE);
+
+	tick_ns_ = 1000000000 / sysconf(_SC_CLK_TCK);
+	return true;
+}
+
+/* Name and cpu time of every thread, from /proc/self/task/<tid>/stat */
+void page_writer::sample_threads()
+{
+	DIR *dir = opendir("/proc/self/task");
+	struct dirent *e;
+	struct page_thread *t;
+	char path[64];
+	char buf[512];
+	const char *name;
+	const char *end;
+	unsigned long utime;
+	unsigned long stime;
+	ssize_t len;
+	int tid;
+	int fd;
+
+	threads_cnt_ = 0;
+	if (!dir)
+		return;
+
+	while ((e = readdir(dir)) && threads_cnt_ < PAGE_THREADS) {
+		if (!(tid = atoi(e->d_name)))
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+		if ((fd = ::open(path, O_RDONLY | O_CLOEXEC)) < 0)
+			continue;
+
+		len = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (len <= 0)
+			continue;
+
+		buf[len] = '\0';
+		/* comm may hold spaces and parens, it ends at last ')' */
+		if (!(name = strchr(buf, '(')) || !(end = strrchr(buf, ')')))
+			continue;
+		else if (sscanf(end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u "
+		 "%*u %*u %lu %lu", &utime, &stime) != 2)
+			continue;
+
+		t = &threads_[threads_cnt_++];
+		t->tid = tid;
+		snprintf(t->name, sizeof(t->name), "%.*s",
+		 (int) (end - name - 1), name + 1);
+		t->cpu_ns = (uint64_t) (utime + stime) * tick_ns_;
+	}
+
+	closedir(dir);
+}
+
+struct page *page_writer::begin()
+{
+	uint32_t seq;
+
+	if (!page_)
+		return nullptr;
+
+	sample_threads();
+	seq = __atomic_load_n(&page_->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&page_->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return page_;
+}
+
+void page_writer::commit()
+{
+	memcpy(page_->threads, threads_, sizeof(threads_[0]) * threads_cnt_);
+	page_->threads_cnt = threads_cnt_;
+	__atomic_store_n(&page_->seq, page_->seq + 1, __ATOMIC_RELEASE);
+}
+
+} // namespace stats
@@ -0,0 +1,95 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef STATPAGE_H
+#define STATPAGE_H
+
+#include <stdint.h>
+
+namespace stats {
+
+static constexpr uint32_t PAGE_MAGIC = 0x54535643; /* "CVST" */
+static constexpr uint16_t PAGE_VERSION = 2;
+static constexpr uint8_t PAGE_THREADS = 16;
+static constexpr const char *PAGE_DIR = "/dev/shm";
+static constexpr const char *PAGE_PREFIX = "camview."; /* then pid */
+
+struct page_thread {
+	uint32_t tid;
+	char name[16];
+	uint64_t cpu_ns; /* user and system time so far */
+};
+
+/* Layout shared with camview-top, bump PAGE_VERSION on any change. Writer
+ * makes seq odd while updating and even once done, readers copy the page
+ * and retry when seq was odd or moved meanwhile. Plain data, seq is only
+ * touched with atomic builtins, so page copies like any struct.
+ */
+struct page {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size; /* of this struct */
+	uint32_t seq;
+	uint32_t pid;
+	char dev[64];
+	char fmt[8];
+	uint16_t w;
+	uint16_t h;
+	uint64_t update_ns; /* CLOCK_MONOTONIC */
+	uint64_t captured;
+	uint64_t decoded;
+	uint64_t shown;
+	uint64_t dropped; /* pool had nothing to give */
+	uint64_t reclaimed; /* queued frames taken back */
+	uint32_t latency_us[4]; /* p50, p90, p99, max capture to present */
+	uint8_t raw_queued; /* waiting for display decode */
+	uint8_t raw_busy;
+	uint8_t pool_queued; /* decoded, waiting for display */
+	uint8_t pool_busy;
+	uint32_t stalls[4]; /* capture, decode, upload, swap past deadline */
+	uint8_t threads_cnt;
+	struct page_thread threads[PAGE_THREADS];
+};
+
+/* Consistent copy of page other process may be writing */
+static inline bool read_page(const struct page *src, struct page *dst)
+{
+	uint32_t seq;
+
+	for (uint8_t i = 0; i < 100; ++i) {
+		if ((seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE)) & 1)
+			continue;
+
+		__builtin_memcpy(dst, src, sizeof(*dst));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) == seq)
+			return dst->magic == PAGE_MAGIC &&
+			 dst->version == PAGE_VERSION &&
+			 dst->size == sizeof(*dst);
+	}
+
+	return false;
+}
+
+/* Publishes page of this process in PAGE_DIR, removed again on exit */
+class page_writer {
+public:
+	~page_writer();
+	bool open(const char *dev, uint32_t fmt, uint16_t w, uint16_t h);
+	struct page *begin(); /* nullptr when not open */
+	void commit();
+private:
+	void sample_threads();
+	struct page *page_ = nullptr;
+	char path_[64];
+	struct page_thread threads_[PAGE_THREADS]; /* taken outside update */
+	uint8_t threads_cnt_ = 0;
+	uint64_t tick_ns_ = 0;
+};
+
+}
+
+#endif // STATPAGE_H
@@ -0,0 +1,78 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <string.h>
+
+#include "stats.h"
+#include "log.h"
+
+namespace stats {
+
+static inline uint16_t bucket(uint64_t v)
+{
+	if (v >= UINT32_MAX)
+		return HIST_BUCKETS - 1;
+	else if (v < HIST_SUB)
+		return v;
+
+	uint8_t shift = 31 - __builtin_clz(v) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+static inline uint64_t bucket_value(uint16_t i)
+{
+	if (i < HIST_SUB)
+		return i;
+
+	uint8_t shift = i / HIST_SUB - 1;
+	return (uint64_t) (HIST_SUB + i % HIST_SUB) << shift;
+}
+
+void histogram::add(uint64_t us)
+{
+	buckets_[bucket(us)]++;
+	cnt_++;
+	sum_ += us;
+	if (us < min_)
+		min_ = us;
+	if (us > max_)
+		max_ = us;
+}
+
+void histogram::reset()
+{
+	memset(buckets_, 0, sizeof(buckets_));
+	cnt_ = sum_ = max_ = 0;
+	min_ = UINT64_MAX;
+}
+
+uint64_t histogram::percentile(float p) const
+{
+	uint64_t rank = cnt_ * p / 100.;
+	uint64_t seen = 0;
+
+	for (uint16_t i = 0; i < HIST_BUCKETS; ++i) {
+		if ((seen += buckets_[i]) > rank)
+			return bucket_value(i);
+	}
+
+	return max_;
+}
+
+void histogram::report(const char *name) const
+{
+	if (!cnt_)
+		return;
+
+	ii("%s us: min %llu p50 %llu p90 %llu p99 %llu max %llu; %llu "
+	 "samples\n", name, (unsigned long long) min(),
+	 (unsigned long long) percentile(50),
+	 (unsigned long long) percentile(90),
+	 (unsigned long long) percentile(99),
+	 (unsigned long long) max_, (unsigned long long) cnt_);
+}
+
+} // namespace stats
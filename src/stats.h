@@ -0,0 +1,39 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+namespace stats {
+
+static constexpr uint8_t HIST_SUB_BITS = 5; /* ~3% bucket precision */
+static constexpr uint16_t HIST_SUB = 1 << HIST_SUB_BITS;
+static constexpr uint16_t HIST_BUCKETS = (32 - HIST_SUB_BITS + 1) * HIST_SUB;
+
+/* Log-linear histogram of microsecond values, fixed size, no allocation */
+class histogram {
+public:
+	void add(uint64_t us);
+	void reset();
+	uint64_t percentile(float p) const;
+	uint64_t count() const { return cnt_; }
+	uint64_t min() const { return cnt_ ? min_ : 0; }
+	uint64_t max() const { return max_; }
+	uint64_t mean() const { return cnt_ ? sum_ / cnt_ : 0; }
+	void report(const char *name) const;
+private:
+	uint32_t buckets_[HIST_BUCKETS] = {};
+	uint64_t cnt_ = 0;
+	uint64_t sum_ = 0;
+	uint64_t min_ = UINT64_MAX;
+	uint64_t max_ = 0;
+};
+
+}
+
+#endif // STATS_H
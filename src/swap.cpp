@@ -0,0 +1,164 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <glad/gl.h>
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>
+
+#include "camera.h"
+#include "swap.h"
+#include "timebase.h"
+#include "log.h"
+
+namespace display {
+
+/* GLX entry points, declared by hand since GL/glx.h clashes with glad */
+typedef void *(*get_display_fn)(void);
+typedef unsigned long (*get_drawable_fn)(void);
+typedef int (*get_sync_values_fn)(void *, unsigned long, int64_t *,
+ int64_t *, int64_t *);
+
+static get_sync_values_fn get_sync_values_;
+
+bool swap_clock::sync_values(int64_t *ust, int64_t *msc, int64_t *sbc)
+{
+	return get_sync_values_(dpy_, drawable_, ust, msc, sbc);
+}
+
+void swap_clock::init()
+{
+	void *gl;
+	get_display_fn get_display;
+	get_drawable_fn get_drawable;
+	int64_t ust;
+	int64_t msc;
+	int64_t sbc;
+
+	oml_ = false;
+	if (!glfwExtensionSupported("GLX_OML_sync_control"))
+		goto fallback;
+
+	if (!(gl = dlopen("libGLX.so.0", RTLD_LAZY | RTLD_NOLOAD)) &&
+	 !(gl = dlopen("libGL.so.1", RTLD_LAZY | RTLD_NOLOAD)))
+		goto fallback;
+
+	get_display = (get_display_fn) dlsym(gl, "glXGetCurrentDisplay");
+	get_drawable = (get_drawable_fn) dlsym(gl, "glXGetCurrentDrawable");
+	get_sync_values_ = (get_sync_values_fn)
+	 glfwGetProcAddress("glXGetSyncValuesOML");
+	dlclose(gl); /* still held by GLFW */
+
+	if (!get_display || !get_drawable || !get_sync_values_)
+		goto fallback;
+
+	dpy_ = get_display();
+	drawable_ = get_drawable();
+	if (!dpy_ || !drawable_ || !sync_values(&ust, &msc, &sbc))
+		goto fallback;
+
+	/* UST is CLOCK_MONOTONIC microseconds on Mesa and NVIDIA, measure
+	 * offset anyway in case driver uses its own epoch
+	 */
+	ust_offset_ns_ = timebase::now() - ust * 1000;
+	if (llabs(ust_offset_ns_) < 1000000000)
+		ust_offset_ns_ = 0;
+
+	sbc_ = sbc;
+	ust_ = ust;
+	msc_ = msc;
+	oml_ = true;
+fallback:
+	ii("presentation timing via %s\n", method());
+}
+
+void swap_clock::done(uint64_t present_ns)
+{
+	struct pending *p = &q_[head_];
+
+	if (present_ns > p->capture_ns) {
+		last_us = (present_ns - p->capture_ns) / 1000;
+		latency.add(last_us);
+	}
+
+	if (p->fence)
+		glDeleteSync((GLsync) p->fence);
+
+	head_ = (head_ + 1) % SWAP_PENDING;
+	len_--;
+}
+
+/* call right after swap buffers */
+void swap_clock::swapped(uint64_t capture_ns)
+{
+	int64_t ust;
+	int64_t msc;
+	int64_t sbc;
+	struct pending *p;
+
+	if (len_ == SWAP_PENDING) /* lost track, forget oldest */
+		done(0);
+
+	p = &q_[(head_ + len_) % SWAP_PENDING];
+	p->capture_ns = capture_ns;
+	p->sbc = ++sbc_;
+	p->fence = nullptr;
+	p->seen_msc = msc_;
+
+	if (!oml_)
+		p->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	else if (sync_values(&ust, &msc, &sbc))
+		p->seen_msc = msc;
+
+	len_++;
+}
+
+/* call once per frame, never blocks */
+void swap_clock::poll()
+{
+	int64_t ust;
+	int64_t msc;
+	int64_t sbc;
+
+	if (!oml_) {
+		while (len_) {
+			GLenum rc = glClientWaitSync((GLsync) q_[head_].fence,
+			 GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+
+			if (rc != GL_ALREADY_SIGNALED &&
+			 rc != GL_CONDITION_SATISFIED)
+				break;
+
+			done(timebase::now());
+		}
+		return;
+	}
+
+	if (!len_ || !sync_values(&ust, &msc, &sbc))
+		return;
+
+	if (msc > msc_)
+		period_us_ = (ust - ust_) / (msc - msc_);
+
+	ust_ = ust;
+	msc_ = msc;
+
+	while (len_ && q_[head_].sbc <= sbc) {
+		/* swap landed on first vblank after we last saw it pending */
+		int64_t on = q_[head_].seen_msc + 1;
+
+		if (on > msc)
+			on = msc;
+
+		done((ust - (msc - on) * period_us_) * 1000 + ust_offset_ns_);
+	}
+
+	for (uint8_t i = 0; i < len_; ++i)
+		q_[(head_ + i) % SWAP_PENDING].seen_msc = msc;
+}
+
+} // namespace display
@@ -0,0 +1,55 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stdint.h>
+
+#include "stats.h"
+
+namespace display {
+
+static constexpr uint8_t SWAP_PENDING = 8;
+
+/* Tracks when swapped GL frames actually reach the screen. With
+ * GLX_OML_sync_control presentation time is derived from UST/MSC of the
+ * vblank that completed the swap, otherwise from a fence signalled after
+ * swap. Both are compared to capture time in CLOCK_MONOTONIC.
+ */
+class swap_clock {
+public:
+	void init(); /* with GL context current */
+	void swapped(uint64_t capture_ns);
+	void poll();
+	const char *method() const { return oml_ ? "OML" : "fence"; }
+	stats::histogram latency;
+	uint64_t last_us = 0;
+private:
+	struct pending {
+		uint64_t capture_ns;
+		int64_t sbc; /* swap count once this frame is on screen */
+		int64_t seen_msc; /* last vblank seen without completion */
+		void *fence; /* GLsync, freed along with context */
+	};
+	bool sync_values(int64_t *ust, int64_t *msc, int64_t *sbc);
+	void done(uint64_t present_ns);
+	struct pending q_[SWAP_PENDING];
+	uint8_t head_ = 0;
+	uint8_t len_ = 0;
+	bool oml_ = false;
+	void *dpy_ = nullptr;
+	unsigned long drawable_ = 0;
+	int64_t sbc_ = 0; /* swaps issued */
+	int64_t ust_ = 0; /* previous sample for refresh period */
+	int64_t msc_ = 0;
+	int64_t period_us_ = 0;
+	int64_t ust_offset_ns_ = 0;
+};
+
+}
+
+#endif // SWAP_H
@@ -0,0 +1,192 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "timebase.h"
+#include "log.h"
+
+namespace timebase {
+
+#if defined(__x86_64__) || defined(__i386__)
+static const char *counter_name_ = "tsc";
+#elif defined(__aarch64__)
+static const char *counter_name_ = "arch_sys_counter";
+#else
+static const char *counter_name_ = nullptr;
+#endif
+
+static constexpr uint64_t STEP_NS = 1000000; /* off by more, jump */
+static constexpr double MAX_SLEW = .0005; /* steer at most 500 ppm */
+
+struct scale scale_;
+bool counter_;
+
+static bool busy_; /* re-anchoring in progress */
+static uint64_t cal_ticks_; /* start of long baseline for frequency */
+static uint64_t cal_ns_;
+static double ns_per_tick_;
+
+/* Kernel only keeps counter as clocksource while it is invariant and in
+ * sync across cpus, that is the check worth trusting.
+ */
+static bool counter_usable()
+{
+	char buf[32] = {0};
+	int fd;
+
+	if (!counter_name_)
+		return false;
+	else if ((fd = open("/sys/devices/system/clocksource/clocksource0/"
+	 "current_clocksource", O_RDONLY | O_CLOEXEC)) < 0)
+		return false;
+
+	if (read(fd, buf, sizeof(buf) - 1) < 0)
+		buf[0] = '\0';
+
+	close(fd);
+	buf[strcspn(buf, "\n")] = '\0';
+	return strcmp(buf, counter_name_) == 0;
+}
+
+/* Counter read bracketed by the tightest pair of clock reads out of few */
+static void sample(uint64_t *t, uint64_t *ns)
+{
+	uint64_t best = UINT64_MAX;
+	uint64_t a;
+	uint64_t b;
+	uint64_t c;
+
+	for (uint8_t i = 0; i < 5; ++i) {
+		a = monotonic_ns();
+		c = ticks();
+		b = monotonic_ns();
+		if (b - a < best) {
+			best = b - a;
+			*t = c;
+			*ns = a + (b - a) / 2;
+		}
+	}
+}
+
+static void publish(uint64_t t, uint64_t ns, double ns_per_tick)
+{
+	uint32_t seq = scale_.seq;
+
+	__atomic_store_n(&scale_.seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&scale_.base_ticks, t, __ATOMIC_RELAXED);
+	__atomic_store_n(&scale_.base_ns, ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&scale_.mult, (uint64_t) (ns_per_tick *
+	 4294967296.), __ATOMIC_RELAXED);
+	__atomic_store_n(&scale_.max_ticks, (uint64_t) (1e9 / ns_per_tick),
+	 __ATOMIC_RELAXED);
+	__atomic_store_n(&scale_.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void init()
+{
+	uint64_t t;
+	uint64_t ns;
+
+	if (counter_ || !counter_usable()) {
+		ii("timebase %s\n", source());
+		return;
+	}
+
+	sample(&cal_ticks_, &cal_ns_);
+	usleep(20000);
+	sample(&t, &ns);
+	if (t <= cal_ticks_ || ns <= cal_ns_) {
+		ww("%s counter does not advance, using clock_gettime\n",
+		 counter_name_);
+		return;
+	}
+
+	ns_per_tick_ = (double) (ns - cal_ns_) / (t - cal_ticks_);
+	publish(t, ns, ns_per_tick_);
+	counter_ = true;
+	ii("timebase %s, %.3f MHz\n", source(), 1e3 / ns_per_tick_);
+}
+
+const char *source()
+{
+	return counter_ ? counter_name_ : "clock_gettime";
+}
+
+/* Re-anchor at current tick, keeping time continuous unless it is off by
+ * more than STEP_NS (system suspend), and steer rate so the remaining
+ * error is gone by next re-anchor. Rate itself comes from the baseline
+ * since init, which gets more precise the longer camview runs.
+ */
+uint64_t slow_now(uint64_t t)
+{
+	uint64_t mono;
+	uint64_t ns;
+	uint64_t cal_t;
+	double err;
+	double slew;
+
+	if (__atomic_exchange_n(&busy_, true, __ATOMIC_ACQUIRE))
+		return monotonic_ns(); /* other thread is at it */
+
+	sample(&cal_t, &mono);
+	ns = scale_.base_ns + (uint64_t) ((double) (t - scale_.base_ticks) *
+	 (scale_.mult / 4294967296.));
+	err = (double) mono - (double) ns;
+
+	if (t < scale_.base_ticks || err > STEP_NS || err < -(double) STEP_NS) {
+		cal_ticks_ = cal_t; /* restart baseline too */
+		cal_ns_ = mono;
+		publish(cal_t, mono, ns_per_tick_);
+		__atomic_store_n(&busy_, false, __ATOMIC_RELEASE);
+		return mono;
+	}
+
+	if (cal_t > cal_ticks_ && mono > cal_ns_)
+		ns_per_tick_ = (double) (mono - cal_ns_) / (cal_t - cal_ticks_);
+
+	slew = err / 1e9;
+	if (slew > MAX_SLEW)
+		slew = MAX_SLEW;
+	else if (slew < -MAX_SLEW)
+		slew = -MAX_SLEW;
+
+	publish(t, ns, ns_per_tick_ * (1 + slew));
+	__atomic_store_n(&busy_, false, __ATOMIC_RELEASE);
+	return ns;
+}
+
+/* V4L2 buffer timestamps are CLOCK_MONOTONIC already unless driver is old
+ * enough to use wall clock. Stamps which are missing, copied or end up
+ * before boot or in the future are replaced by current time.
+ */
+uint64_t from_timeval(const struct timeval &tv, enum stamp type)
+{
+	uint64_t ns = tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000;
+	uint64_t cur = now();
+	struct timespec rt;
+	uint64_t offset;
+
+	if (type == STAMP_NONE || !ns)
+		return cur;
+
+	if (type == STAMP_REALTIME) {
+		clock_gettime(CLOCK_REALTIME, &rt);
+		offset = rt.tv_sec * 1000000000ULL + rt.tv_nsec -
+		 monotonic_ns();
+		if (ns <= offset) /* was not wall clock after all */
+			return cur;
+
+		ns -= offset;
+	}
+
+	return ns < cur ? ns : cur;
+}
+
+} // namespace timebase
@@ -0,0 +1,103 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+
+#include <time.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Nanoseconds in CLOCK_MONOTONIC domain for instrumentation and frame
+ * timestamps. Where kernel itself trusts cpu counter (TSC on x86, CNTVCT
+ * on arm64) it is read directly and scaled, otherwise clock_gettime() via
+ * vDSO is used. Counter scale is re-anchored to CLOCK_MONOTONIC about once
+ * a second by whichever thread notices, so both stay within microseconds.
+ */
+namespace timebase {
+
+enum stamp : uint8_t {
+	STAMP_MONOTONIC,
+	STAMP_REALTIME, /* wall clock of old drivers */
+	STAMP_NONE, /* copied from elsewhere or missing, use dequeue time */
+};
+
+struct scale {
+	uint32_t seq; /* odd while being updated */
+	uint64_t base_ticks;
+	uint64_t base_ns;
+	uint64_t mult; /* ns per tick << 32 */
+	uint64_t max_ticks; /* re-anchor after this many */
+};
+
+extern struct scale scale_;
+extern bool counter_;
+
+void init(); /* before starting threads, monotonic fallback until then */
+const char *source();
+uint64_t slow_now(uint64_t ticks);
+uint64_t from_timeval(const struct timeval &tv, enum stamp);
+
+static inline uint64_t ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t val;
+
+	__asm__ __volatile__ ("isb; mrs %0, cntvct_el0" : "=r" (val) ::
+	 "memory");
+	return val;
+#else
+	return 0;
+#endif
+}
+
+static inline uint64_t monotonic_ns()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline uint64_t now()
+{
+	uint64_t base_ticks;
+	uint64_t base_ns;
+	uint64_t mult;
+	uint64_t max;
+	uint64_t t;
+	uint32_t seq;
+
+	if (!counter_)
+		return monotonic_ns();
+
+	do {
+		seq = __atomic_load_n(&scale_.seq, __ATOMIC_ACQUIRE);
+		base_ticks = __atomic_load_n(&scale_.base_ticks,
+		 __ATOMIC_RELAXED);
+		base_ns = __atomic_load_n(&scale_.base_ns, __ATOMIC_RELAXED);
+		mult = __atomic_load_n(&scale_.mult, __ATOMIC_RELAXED);
+		max = __atomic_load_n(&scale_.max_ticks, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) ||
+	 seq != __atomic_load_n(&scale_.seq, __ATOMIC_RELAXED));
+
+	t = ticks();
+	if (t - base_ticks > max) /* also when other cpu was behind */
+		return slow_now(t);
+
+	return base_ns + (((t - base_ticks) * mult) >> 32);
+}
+
+}
+
+#endif // TIMEBASE_H
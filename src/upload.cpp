@@ -0,0 +1,280 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <string.h>
+#include <glad/gl.h>
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>
+
+#include "upload.h"
+#include "format.h"
+#include "log.h"
+
+namespace display {
+
+/* ARB_buffer_storage, core in 4.4 and not part of generated GL 3.3 loader */
+static constexpr GLbitfield GL_MAP_PERSISTENT_BIT_ = 0x0040;
+static constexpr GLbitfield GL_MAP_COHERENT_BIT_ = 0x0080;
+
+typedef void (GLAD_API_PTR *buffer_storage_fn)(GLenum, GLsizeiptr,
+ const void *, GLbitfield);
+
+upload_ring::~upload_ring()
+{
+	for (uint8_t i = 0; i < cnt_; ++i) {
+		struct entry *e = &ring_[i];
+
+		if (e->fence)
+			glDeleteSync((GLsync) e->fence);
+		if (e->copied)
+			glDeleteSync((GLsync) e->copied);
+		if (e->slot)
+			pool_->release(e->slot);
+
+		glDeleteBuffers(1, &e->pbo);
+		glDeleteTextures(1, &e->tex);
+	}
+
+	if (storage_) { /* pool must not touch slots from here on */
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, storage_);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &storage_);
+	}
+}
+
+uint8_t *upload_ring::map(uint32_t bytes)
+{
+	buffer_storage_fn buffer_storage;
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT_ |
+	 GL_MAP_COHERENT_BIT_;
+
+	if (!glfwExtensionSupported("GL_ARB_buffer_storage")) {
+		ii("no buffer storage, upload through unpack buffers\n");
+		return nullptr;
+	}
+
+	buffer_storage = (buffer_storage_fn)
+	 glfwGetProcAddress("glBufferStorage");
+	if (!buffer_storage)
+		return nullptr;
+
+	glGenBuffers(1, &storage_);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, storage_);
+	buffer_storage(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, flags);
+	map_ = (uint8_t *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+	 flags);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (!map_) {
+		ww("failed to map %u bytes of buffer storage\n", bytes);
+		glDeleteBuffers(1, &storage_);
+		storage_ = 0;
+		return nullptr;
+	}
+
+	map_bytes_ = bytes;
+	ii("frames decoded into %u bytes of mapped buffer storage\n", bytes);
+	return map_;
+}
+
+bool upload_ring::init(uint8_t cnt)
+{
+	if (!cnt) {
+		cnt = 1;
+	} else if (cnt > UPLOAD_MAX) {
+		ww("texture ring size %u capped to %u\n", cnt, UPLOAD_MAX);
+		cnt = UPLOAD_MAX;
+	}
+
+	for (uint8_t i = 0; i < cnt; ++i) {
+		struct entry *e = &ring_[i];
+
+		glGenTextures(1, &e->tex);
+		glBindTexture(GL_TEXTURE_2D, e->tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+		 GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+		 GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+		 GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+		 GL_CLAMP_TO_BORDER);
+		glGenBuffers(1, &e->pbo);
+
+		if (!e->tex || !e->pbo) {
+			ee("failed to create texture ring entry %u\n", i);
+			cnt_ = i + 1;
+			return false;
+		}
+	}
+
+	cnt_ = cnt;
+	ii("texture ring of %u\n", cnt_);
+	return true;
+}
+
+/* true once GPU is done with entry, never waits */
+bool upload_ring::idle(struct entry *e)
+{
+	GLenum rc;
+
+	if (!e->fence)
+		return true;
+
+	rc = glClientWaitSync((GLsync) e->fence, 0, 0);
+	if (rc != GL_ALREADY_SIGNALED && rc != GL_CONDITION_SATISFIED)
+		return false;
+
+	glDeleteSync((GLsync) e->fence);
+	e->fence = nullptr;
+	return true;
+}
+
+/* give back slots device side copy is done with */
+void upload_ring::reap()
+{
+	for (uint8_t i = 0; i < cnt_; ++i) {
+		struct entry *e = &ring_[i];
+		GLenum rc;
+
+		if (!e->slot)
+			continue;
+
+		rc = glClientWaitSync((GLsync) e->copied, 0, 0);
+		if (rc != GL_ALREADY_SIGNALED && rc != GL_CONDITION_SATISFIED)
+			continue;
+
+		glDeleteSync((GLsync) e->copied);
+		e->copied = nullptr;
+		pool_->release(e->slot);
+		e->slot = nullptr;
+	}
+}
+
+bool upload_ring::copy_mapped(struct entry *e, struct camera::slot *s)
+{
+	if (e->slot) /* still copying previous slot, rare */
+		return false;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, storage_);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, s->w, s->h,
+	 camera::find_format(s->fmt)->gl_fmt, GL_UNSIGNED_BYTE,
+	 (const void *) (uintptr_t) (s->data - map_));
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	e->copied = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	e->slot = s;
+	pool_->ref(s);
+	stats_.mapped++;
+	return true;
+}
+
+bool upload_ring::copy_pbo(struct entry *e, const struct camera::slot *s)
+{
+	void *dst;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, e->pbo);
+	if (e->size < s->bytes) {
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, s->bytes, NULL,
+		 GL_STREAM_DRAW);
+		e->size = s->bytes;
+	}
+
+	/* fence says GPU is done with buffer, no need to sync on map */
+	dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, s->bytes,
+	 GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+	 GL_MAP_UNSYNCHRONIZED_BIT);
+	if (!dst) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		ee("failed to map unpack buffer %u\n", e->pbo);
+		return false;
+	}
+
+	memcpy(dst, s->data, s->bytes);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, s->w, s->h,
+	 camera::find_format(s->fmt)->gl_fmt, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	return true;
+}
+
+bool upload_ring::upload(struct camera::slot *s)
+{
+	struct entry *e = nullptr;
+
+	if (storage_)
+		reap();
+
+	/* oldest entry first, one on screen last */
+	for (uint8_t i = 0; i < cnt_; ++i) {
+		struct entry *next = &ring_[(cur_ + 1 + i) % cnt_];
+
+		if (idle(next)) {
+			e = next;
+			break;
+		}
+
+		stats_.busy++;
+	}
+
+	if (!e) {
+		stats_.dropped++;
+		return false;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, e->tex);
+	if (e->w != s->w || e->h != s->h || e->fmt != s->fmt) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, s->w, s->h, 0,
+		 camera::find_format(s->fmt)->gl_fmt, GL_UNSIGNED_BYTE, NULL);
+		e->w = s->w;
+		e->h = s->h;
+		e->fmt = s->fmt;
+	}
+
+	if (map_ && pool_ && s->data >= map_ && s->data + s->bytes <= map_ +
+	 map_bytes_) {
+		if (!copy_mapped(e, s))
+			return false;
+	} else if (!copy_pbo(e, s)) {
+		return false;
+	}
+
+	cur_ = e - ring_;
+	stats_.uploads++;
+	return true;
+}
+
+unsigned int upload_ring::texture() const
+{
+	return cur_ < 0 ? 0 : ring_[cur_].tex;
+}
+
+void upload_ring::fence()
+{
+	struct entry *e;
+
+	if (storage_)
+		reap();
+
+	if (cur_ < 0)
+		return;
+
+	e = &ring_[cur_];
+	if (e->fence)
+		glDeleteSync((GLsync) e->fence);
+
+	e->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void upload_ring::report() const
+{
+	ii("texture ring of %u: %u uploads (%u from mapped storage), %u busy "
+	 "entries skipped, %u frames dropped\n", cnt_, stats_.uploads,
+	 stats_.mapped, stats_.busy, stats_.dropped);
+}
+
+} // namespace display
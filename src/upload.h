@@ -0,0 +1,74 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdint.h>
+
+#include "pool.h"
+
+namespace display {
+
+static constexpr uint8_t UPLOAD_MAX = 8;
+
+struct upload_stats {
+	uint32_t uploads;
+	uint32_t busy; /* entries skipped, GPU still reading them */
+	uint32_t dropped; /* frames not uploaded, whole ring busy */
+	uint32_t mapped; /* uploads straight from persistent buffer */
+};
+
+/* Ring of textures, each fed by own pixel unpack buffer and guarded by a
+ * fence placed after last draw sampling it. Upload goes to first entry GPU
+ * is done with, so neither texture re-specification nor buffer mapping
+ * waits for pending draws and CPU never blocks on the driver.
+ *
+ * With ARB_buffer_storage frame pool itself can live in one persistently
+ * mapped buffer handed out by map(). Decoders then write straight into
+ * GPU visible memory and upload is a device side copy; slot is held until
+ * the copy fence signals.
+ */
+class upload_ring {
+public:
+	~upload_ring();
+	bool init(uint8_t cnt); /* with GL context current */
+	uint8_t *map(uint32_t bytes); /* nullptr without buffer storage */
+	void attach(camera::frame_pool *pool) { pool_ = pool; }
+	bool upload(struct camera::slot *);
+	unsigned int texture() const; /* latest uploaded, 0 if none yet */
+	void fence(); /* after draw call sampling texture() */
+	void report() const;
+	uint8_t size() const { return cnt_; }
+private:
+	struct entry {
+		unsigned int tex;
+		unsigned int pbo;
+		void *fence; /* GLsync */
+		void *copied; /* GLsync after copy from slot */
+		struct camera::slot *slot; /* mapped slot being copied */
+		uint32_t size; /* pbo capacity */
+		uint16_t w;
+		uint16_t h;
+		uint32_t fmt;
+	};
+	bool idle(struct entry *);
+	void reap();
+	bool copy_mapped(struct entry *, struct camera::slot *);
+	bool copy_pbo(struct entry *, const struct camera::slot *);
+	camera::frame_pool *pool_ = nullptr;
+	unsigned int storage_ = 0; /* persistent buffer */
+	uint8_t *map_ = nullptr;
+	uint32_t map_bytes_ = 0;
+	struct entry ring_[UPLOAD_MAX] = {};
+	uint8_t cnt_ = 0;
+	int8_t cur_ = -1;
+	struct upload_stats stats_ = {};
+};
+
+}
+
+#endif // UPLOAD_H
@@ -0,0 +1,765 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include "display.h"
+#include "timebase.h"
+#include "log.h"
+
+namespace display {
+
+static constexpr uint8_t VK_RING = 3; /* staging slots in flight */
+static constexpr uint8_t VK_MAX_IMAGES = 8;
+static constexpr uint64_t VK_TIMEOUT_NS = 1000000000;
+
+struct vk_slot {
+	VkBuffer buf;
+	VkDeviceMemory buf_mem;
+	uint8_t *map;
+	VkImage img; /* frame sized copy, blitted to swapchain with scaling */
+	VkDeviceMemory img_mem;
+	VkCommandBuffer cmd;
+	VkSemaphore acquired;
+	uint64_t done; /* timeline value signalled when GPU is done */
+	uint64_t capture_ns;
+	bool pending; /* latency not recorded yet */
+	uint16_t w;
+	uint16_t h;
+};
+
+/* Upload goes through a ring of host visible staging buffers. Timeline
+ * semaphore value of the submit that consumed a slot tells when the slot
+ * can be written again, so CPU never overwrites memory GPU still reads
+ * and never waits on a whole-queue fence.
+ *
+ * There is no dma-buf import. Frames come here from the decoded pool, the
+ * V4L2 buffer they were copied from is queued back right away, and none
+ * of the capture formats (YUYV, NV12, MJPEG, RGB24) can be copied into a
+ * BGRA image as is; importing would need ycbcr sampling in a shader plus
+ * holding V4L2 buffers until GPU is done, neither of which exists here.
+ */
+class vulkan : public backend {
+public:
+	~vulkan();
+	bool init(const char *title, uint16_t w, uint16_t h);
+	bool present(const struct camera::slot *) override;
+	bool dispatch() override;
+	void wait() override { glfwWaitEvents(); }
+	bool hidden() override;
+private:
+	bool pick_gpu();
+	bool make_device();
+	bool make_swapchain();
+	void drop_swapchain();
+	bool make_slot(struct vk_slot *, uint16_t w, uint16_t h);
+	void drop_slot(struct vk_slot *);
+	void record(struct vk_slot *, uint32_t idx);
+	void reap();
+	uint32_t find_memory(uint32_t bits, VkMemoryPropertyFlags);
+	static void key_cb(GLFWwindow *, int key, int code, int action,
+	 int mods);
+	GLFWwindow *win_ = nullptr;
+	VkInstance inst_ = VK_NULL_HANDLE;
+	VkSurfaceKHR surf_ = VK_NULL_HANDLE;
+	VkPhysicalDevice gpu_ = VK_NULL_HANDLE;
+	VkDevice dev_ = VK_NULL_HANDLE;
+	VkQueue queue_ = VK_NULL_HANDLE;
+	uint32_t family_ = 0;
+	VkCommandPool pool_ = VK_NULL_HANDLE;
+	VkSemaphore timeline_ = VK_NULL_HANDLE;
+	uint64_t value_ = 0;
+	VkSwapchainKHR chain_ = VK_NULL_HANDLE;
+	VkFormat format_ = VK_FORMAT_B8G8R8A8_UNORM;
+	VkExtent2D extent_ = { 0, 0 };
+	VkPresentModeKHR mode_ = VK_PRESENT_MODE_FIFO_KHR;
+	uint32_t images_cnt_ = 0;
+	VkImage images_[VK_MAX_IMAGES] = {};
+	VkSemaphore rendered_[VK_MAX_IMAGES] = {};
+	struct vk_slot ring_[VK_RING] = {};
+	uint32_t next_ = 0;
+	bool stale_ = false; /* swapchain needs recreation */
+	uint32_t ring_waits_ = 0;
+	scaler conv_; /* 1:1, RGB24 to BGRX rows */
+	scaler fit_; /* only computes blit rectangle */
+};
+
+static bool has_extension(const VkExtensionProperties *ext, uint32_t cnt,
+ const char *name)
+{
+	for (uint32_t i = 0; i < cnt; ++i) {
+		if (strcmp(ext[i].extensionName, name) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+void vulkan::key_cb(GLFWwindow *win, int key, int, int action, int)
+{
+	if (action == GLFW_PRESS && (key == GLFW_KEY_ESCAPE ||
+	 key == GLFW_KEY_Q))
+		glfwSetWindowShouldClose(win, GLFW_TRUE);
+}
+
+uint32_t vulkan::find_memory(uint32_t bits, VkMemoryPropertyFlags props)
+{
+	VkPhysicalDeviceMemoryProperties mem;
+
+	vkGetPhysicalDeviceMemoryProperties(gpu_, &mem);
+	for (uint32_t i = 0; i < mem.memoryTypeCount; ++i) {
+		if ((bits & (1 << i)) &&
+		 (mem.memoryTypes[i].propertyFlags & props) == props)
+			return i;
+	}
+
+	return UINT32_MAX;
+}
+
+bool vulkan::pick_gpu()
+{
+	VkPhysicalDevice gpus[8];
+	uint32_t cnt = 8;
+
+	vkEnumeratePhysicalDevices(inst_, &cnt, gpus);
+	for (uint32_t i = 0; i < cnt; ++i) {
+		VkPhysicalDeviceProperties props;
+		VkPhysicalDeviceVulkan12Features v12;
+		VkPhysicalDeviceFeatures2 features;
+		VkQueueFamilyProperties families[16];
+		VkExtensionProperties ext[256];
+		uint32_t families_cnt = 16;
+		uint32_t ext_cnt = 256;
+
+		vkGetPhysicalDeviceProperties(gpus[i], &props);
+		if (props.apiVersion < VK_API_VERSION_1_2)
+			continue;
+
+		memset(&v12, 0, sizeof(v12));
+		v12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+		memset(&features, 0, sizeof(features));
+		features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		features.pNext = &v12;
+		vkGetPhysicalDeviceFeatures2(gpus[i], &features);
+		if (!v12.timelineSemaphore)
+			continue;
+
+		vkEnumerateDeviceExtensionProperties(gpus[i], NULL, &ext_cnt, ext);
+		if (!has_extension(ext, ext_cnt, VK_KHR_SWAPCHAIN_EXTENSION_NAME))
+			continue;
+
+		vkGetPhysicalDeviceQueueFamilyProperties(gpus[i], &families_cnt,
+		 families);
+		for (uint32_t j = 0; j < families_cnt; ++j) {
+			VkBool32 present = VK_FALSE;
+
+			if (!(families[j].queueFlags & VK_QUEUE_GRAPHICS_BIT))
+				continue;
+
+			vkGetPhysicalDeviceSurfaceSupportKHR(gpus[i], j, surf_,
+			 &present);
+			if (!present)
+				continue;
+
+			gpu_ = gpus[i];
+			family_ = j;
+			ii("vulkan device %s\n", props.deviceName);
+			return true;
+		}
+	}
+
+	ee("no vulkan 1.2 device with timeline semaphores and present\n");
+	return false;
+}
+
+bool vulkan::make_device()
+{
+	const char *ext[] = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
+	float priority = 1.;
+	VkPhysicalDeviceVulkan12Features v12;
+	VkDeviceQueueCreateInfo queue;
+	VkDeviceCreateInfo info;
+	VkSemaphoreTypeCreateInfo type;
+	VkSemaphoreCreateInfo sem;
+	VkCommandPoolCreateInfo pool;
+
+	memset(&v12, 0, sizeof(v12));
+	v12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	v12.timelineSemaphore = VK_TRUE;
+
+	memset(&queue, 0, sizeof(queue));
+	queue.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+	queue.queueFamilyIndex = family_;
+	queue.queueCount = 1;
+	queue.pQueuePriorities = &priority;
+
+	memset(&info, 0, sizeof(info));
+	info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+	info.pNext = &v12;
+	info.queueCreateInfoCount = 1;
+	info.pQueueCreateInfos = &queue;
+	info.enabledExtensionCount = 1;
+	info.ppEnabledExtensionNames = ext;
+
+	if (vkCreateDevice(gpu_, &info, NULL, &dev_) != VK_SUCCESS) {
+		ee("vkCreateDevice failed\n");
+		return false;
+	}
+
+	vkGetDeviceQueue(dev_, family_, 0, &queue_);
+
+	memset(&type, 0, sizeof(type));
+	type.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+	type.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	type.initialValue = 0;
+	memset(&sem, 0, sizeof(sem));
+	sem.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	sem.pNext = &type;
+
+	if (vkCreateSemaphore(dev_, &sem, NULL, &timeline_) != VK_SUCCESS) {
+		ee("failed to create timeline semaphore\n");
+		return false;
+	}
+
+	memset(&pool, 0, sizeof(pool));
+	pool.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	pool.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	pool.queueFamilyIndex = family_;
+
+	return vkCreateCommandPool(dev_, &pool, NULL, &pool_) == VK_SUCCESS;
+}
+
+void vulkan::drop_swapchain()
+{
+	for (uint32_t i = 0; i < images_cnt_; ++i) {
+		vkDestroySemaphore(dev_, rendered_[i], NULL);
+		rendered_[i] = VK_NULL_HANDLE;
+	}
+
+	if (chain_)
+		vkDestroySwapchainKHR(dev_, chain_, NULL);
+
+	chain_ = VK_NULL_HANDLE;
+	images_cnt_ = 0;
+}
+
+bool vulkan::make_swapchain()
+{
+	VkSurfaceCapabilitiesKHR caps;
+	VkSurfaceFormatKHR formats[32];
+	VkPresentModeKHR modes[8];
+	uint32_t formats_cnt = 32;
+	uint32_t modes_cnt = 8;
+	VkSwapchainCreateInfoKHR info;
+	VkSemaphoreCreateInfo sem;
+	int w;
+	int h;
+
+	vkDeviceWaitIdle(dev_);
+	drop_swapchain();
+
+	vkGetPhysicalDeviceSurfaceCapabilitiesKHR(gpu_, surf_, &caps);
+	if (!(caps.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT)) {
+		ee("swapchain images can't be transfer destination\n");
+		return false;
+	}
+
+	vkGetPhysicalDeviceSurfaceFormatsKHR(gpu_, surf_, &formats_cnt,
+	 formats);
+	format_ = formats[0].format;
+	for (uint32_t i = 0; i < formats_cnt; ++i) {
+		if (formats[i].format == VK_FORMAT_B8G8R8A8_UNORM)
+			format_ = formats[i].format;
+	}
+
+	/* mailbox replaces queued image with newest one, lowest latency
+	 * without tearing
+	 */
+	vkGetPhysicalDeviceSurfacePresentModesKHR(gpu_, surf_, &modes_cnt,
+	 modes);
+	mode_ = VK_PRESENT_MODE_FIFO_KHR;
+	for (uint32_t i = 0; i < modes_cnt; ++i) {
+		if (modes[i] == VK_PRESENT_MODE_MAILBOX_KHR)
+			mode_ = modes[i];
+	}
+
+	glfwGetFramebufferSize(win_, &w, &h);
+	if (caps.currentExtent.width != UINT32_MAX) {
+		extent_ = caps.currentExtent;
+	} else {
+		extent_.width = w;
+		extent_.height = h;
+	}
+
+	if (!extent_.width || !extent_.height) {
+		stale_ = true; /* minimised, retry later */
+		return true;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+	info.surface = surf_;
+	info.minImageCount = caps.minImageCount + 1;
+	if (caps.maxImageCount && info.minImageCount > caps.maxImageCount)
+		info.minImageCount = caps.maxImageCount;
+	info.imageFormat = format_;
+	info.imageColorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+	info.imageExtent = extent_;
+	info.imageArrayLayers = 1;
+	info.imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	info.preTransform = caps.currentTransform;
+	info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+	info.presentMode = mode_;
+	info.clipped = VK_TRUE;
+
+	if (vkCreateSwapchainKHR(dev_, &info, NULL, &chain_) != VK_SUCCESS) {
+		ee("vkCreateSwapchainKHR failed\n");
+		return false;
+	}
+
+	images_cnt_ = VK_MAX_IMAGES;
+	vkGetSwapchainImagesKHR(dev_, chain_, &images_cnt_, images_);
+
+	memset(&sem, 0, sizeof(sem));
+	sem.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	for (uint32_t i = 0; i < images_cnt_; ++i)
+		vkCreateSemaphore(dev_, &sem, NULL, &rendered_[i]);
+
+	stale_ = false;
+	nop("swapchain %ux%u, %u images, %s\n", extent_.width, extent_.height,
+	 images_cnt_, mode_ == VK_PRESENT_MODE_MAILBOX_KHR ? "mailbox" :
+	 "fifo");
+	return true;
+}
+
+void vulkan::drop_slot(struct vk_slot *s)
+{
+	if (s->map)
+		vkUnmapMemory(dev_, s->buf_mem);
+	if (s->buf)
+		vkDestroyBuffer(dev_, s->buf, NULL);
+	if (s->buf_mem)
+		vkFreeMemory(dev_, s->buf_mem, NULL);
+	if (s->img)
+		vkDestroyImage(dev_, s->img, NULL);
+	if (s->img_mem)
+		vkFreeMemory(dev_, s->img_mem, NULL);
+
+	s->map = nullptr;
+	s->buf = VK_NULL_HANDLE;
+	s->buf_mem = VK_NULL_HANDLE;
+	s->img = VK_NULL_HANDLE;
+	s->img_mem = VK_NULL_HANDLE;
+	s->w = s->h = 0;
+}
+
+bool vulkan::make_slot(struct vk_slot *s, uint16_t w, uint16_t h)
+{
+	VkBufferCreateInfo buf;
+	VkImageCreateInfo img;
+	VkMemoryRequirements req;
+	VkMemoryAllocateInfo alloc;
+
+	drop_slot(s);
+
+	memset(&buf, 0, sizeof(buf));
+	buf.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	buf.size = (VkDeviceSize) w * h * 4;
+	buf.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	buf.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	if (vkCreateBuffer(dev_, &buf, NULL, &s->buf) != VK_SUCCESS)
+		return false;
+
+	vkGetBufferMemoryRequirements(dev_, s->buf, &req);
+	memset(&alloc, 0, sizeof(alloc));
+	alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	alloc.allocationSize = req.size;
+	alloc.memoryTypeIndex = find_memory(req.memoryTypeBits,
+	 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+	 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	if (alloc.memoryTypeIndex == UINT32_MAX ||
+	 vkAllocateMemory(dev_, &alloc, NULL, &s->buf_mem) != VK_SUCCESS)
+		return false;
+
+	vkBindBufferMemory(dev_, s->buf, s->buf_mem, 0);
+	vkMapMemory(dev_, s->buf_mem, 0, VK_WHOLE_SIZE, 0, (void **) &s->map);
+
+	memset(&img, 0, sizeof(img));
+	img.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	img.imageType = VK_IMAGE_TYPE_2D;
+	img.format = VK_FORMAT_B8G8R8A8_UNORM;
+	img.extent.width = w;
+	img.extent.height = h;
+	img.extent.depth = 1;
+	img.mipLevels = 1;
+	img.arrayLayers = 1;
+	img.samples = VK_SAMPLE_COUNT_1_BIT;
+	img.tiling = VK_IMAGE_TILING_OPTIMAL;
+	img.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+	 VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	img.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	img.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	if (vkCreateImage(dev_, &img, NULL, &s->img) != VK_SUCCESS)
+		return false;
+
+	vkGetImageMemoryRequirements(dev_, s->img, &req);
+	alloc.allocationSize = req.size;
+	alloc.memoryTypeIndex = find_memory(req.memoryTypeBits,
+	 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	if (alloc.memoryTypeIndex == UINT32_MAX)
+		alloc.memoryTypeIndex = find_memory(req.memoryTypeBits, 0);
+	if (vkAllocateMemory(dev_, &alloc, NULL, &s->img_mem) != VK_SUCCESS)
+		return false;
+
+	vkBindImageMemory(dev_, s->img, s->img_mem, 0);
+	s->w = w;
+	s->h = h;
+	return true;
+}
+
+static void barrier(VkCommandBuffer cmd, VkImage img, VkImageLayout from,
+ VkImageLayout to, VkAccessFlags src, VkAccessFlags dst)
+{
+	VkImageMemoryBarrier b;
+
+	memset(&b, 0, sizeof(b));
+	b.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	b.srcAccessMask = src;
+	b.dstAccessMask = dst;
+	b.oldLayout = from;
+	b.newLayout = to;
+	b.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	b.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	b.image = img;
+	b.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	b.subresourceRange.levelCount = 1;
+	b.subresourceRange.layerCount = 1;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	 VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &b);
+}
+
+void vulkan::record(struct vk_slot *s, uint32_t idx)
+{
+	VkCommandBufferBeginInfo begin;
+	VkBufferImageCopy copy;
+	VkImageBlit blit;
+	VkClearColorValue black;
+	VkImageSubresourceRange range;
+	VkImage dst = images_[idx];
+
+	memset(&begin, 0, sizeof(begin));
+	begin.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	begin.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(s->cmd, &begin);
+
+	barrier(s->cmd, s->img, VK_IMAGE_LAYOUT_UNDEFINED,
+	 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0,
+	 VK_ACCESS_TRANSFER_WRITE_BIT);
+
+	memset(&copy, 0, sizeof(copy));
+	copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	copy.imageSubresource.layerCount = 1;
+	copy.imageExtent.width = s->w;
+	copy.imageExtent.height = s->h;
+	copy.imageExtent.depth = 1;
+	vkCmdCopyBufferToImage(s->cmd, s->buf, s->img,
+	 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+
+	barrier(s->cmd, s->img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+	 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT,
+	 VK_ACCESS_TRANSFER_READ_BIT);
+	barrier(s->cmd, dst, VK_IMAGE_LAYOUT_UNDEFINED,
+	 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0,
+	 VK_ACCESS_TRANSFER_WRITE_BIT);
+
+	memset(&black, 0, sizeof(black));
+	memset(&range, 0, sizeof(range));
+	range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	range.levelCount = 1;
+	range.layerCount = 1;
+	vkCmdClearColorImage(s->cmd, dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+	 &black, 1, &range);
+	barrier(s->cmd, dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+	 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT,
+	 VK_ACCESS_TRANSFER_WRITE_BIT);
+
+	/* anchor to bottom left corner like glViewport() does */
+	fit_.fit(s->w, s->h, extent_.width, extent_.height);
+	memset(&blit, 0, sizeof(blit));
+	blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	blit.srcSubresource.layerCount = 1;
+	blit.srcOffsets[1].x = s->w;
+	blit.srcOffsets[1].y = s->h;
+	blit.srcOffsets[1].z = 1;
+	blit.dstSubresource = blit.srcSubresource;
+	blit.dstOffsets[0].y = extent_.height - fit_.h;
+	blit.dstOffsets[1].x = fit_.w;
+	blit.dstOffsets[1].y = extent_.height;
+	blit.dstOffsets[1].z = 1;
+	vkCmdBlitImage(s->cmd, s->img, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+	 dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit,
+	 VK_FILTER_LINEAR);
+
+	barrier(s->cmd, dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+	 VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_ACCESS_TRANSFER_WRITE_BIT, 0);
+	vkEndCommandBuffer(s->cmd);
+}
+
+/* GPU finished the blit into swapchain image, presentation engine may
+ * add up to a refresh on top of it
+ */
+void vulkan::reap()
+{
+	uint64_t reached = 0;
+	uint64_t now;
+
+	vkGetSemaphoreCounterValue(dev_, timeline_, &reached);
+	now = timebase::now();
+	for (uint8_t i = 0; i < VK_RING; ++i) {
+		struct vk_slot *s = &ring_[i];
+
+		if (s->pending && s->done <= reached) {
+			s->pending = false;
+			presented(s->capture_ns, now);
+		}
+	}
+}
+
+bool vulkan::present(const struct camera::slot *frame)
+{
+	struct vk_slot *s = &ring_[next_ % VK_RING];
+	VkPipelineStageFlags stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	VkTimelineSemaphoreSubmitInfo values;
+	VkSemaphoreWaitInfo wait;
+	VkSubmitInfo submit;
+	VkPresentInfoKHR info;
+	VkSemaphore signal[2];
+	uint64_t signal_values[2];
+	uint64_t reached = 0;
+	uint32_t idx;
+	VkResult rc;
+
+	if (stale_ && (!make_swapchain() || stale_))
+		return true;
+
+	/* wait until GPU consumed this slot last time around the ring */
+	vkGetSemaphoreCounterValue(dev_, timeline_, &reached);
+	if (reached < s->done) {
+		memset(&wait, 0, sizeof(wait));
+		wait.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+		wait.semaphoreCount = 1;
+		wait.pSemaphores = &timeline_;
+		wait.pValues = &s->done;
+		ring_waits_++;
+
+		if (vkWaitSemaphores(dev_, &wait, VK_TIMEOUT_NS) != VK_SUCCESS) {
+			ww("upload slot still busy, frame %u dropped\n",
+			 frame->id);
+			return true;
+		}
+	}
+
+	reap(); /* before slot is overwritten */
+
+	if ((s->w != frame->w || s->h != frame->h) &&
+	 !make_slot(s, frame->w, frame->h)) {
+		ee("failed to allocate %ux%u staging\n", frame->w, frame->h);
+		return false;
+	}
+
+	rc = vkAcquireNextImageKHR(dev_, chain_, VK_TIMEOUT_NS, s->acquired,
+	 VK_NULL_HANDLE, &idx);
+	if (rc == VK_ERROR_OUT_OF_DATE_KHR) {
+		stale_ = true;
+		return true;
+	} else if (rc != VK_SUCCESS && rc != VK_SUBOPTIMAL_KHR) {
+		return rc == VK_TIMEOUT || rc == VK_NOT_READY;
+	}
+
+	conv_.fit(frame->w, frame->h, frame->w, frame->h);
+	conv_.run(frame->data, s->map, frame->w * 4);
+	record(s, idx);
+
+	signal[0] = rendered_[idx];
+	signal[1] = timeline_;
+	signal_values[0] = 0; /* binary, ignored */
+	signal_values[1] = ++value_;
+
+	memset(&values, 0, sizeof(values));
+	values.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	values.signalSemaphoreValueCount = 2;
+	values.pSignalSemaphoreValues = signal_values;
+
+	memset(&submit, 0, sizeof(submit));
+	submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit.pNext = &values;
+	submit.waitSemaphoreCount = 1;
+	submit.pWaitSemaphores = &s->acquired;
+	submit.pWaitDstStageMask = &stage;
+	submit.commandBufferCount = 1;
+	submit.pCommandBuffers = &s->cmd;
+	submit.signalSemaphoreCount = 2;
+	submit.pSignalSemaphores = signal;
+
+	if (vkQueueSubmit(queue_, 1, &submit, VK_NULL_HANDLE) != VK_SUCCESS) {
+		ee("vkQueueSubmit failed\n");
+		return false;
+	}
+
+	s->done = value_;
+	s->capture_ns = capture_ns(frame);
+	s->pending = true;
+	next_++;
+
+	memset(&info, 0, sizeof(info));
+	info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+	info.waitSemaphoreCount = 1;
+	info.pWaitSemaphores = &rendered_[idx];
+	info.swapchainCount = 1;
+	info.pSwapchains = &chain_;
+	info.pImageIndices = &idx;
+
+	rc = vkQueuePresentKHR(queue_, &info);
+	if (rc == VK_ERROR_OUT_OF_DATE_KHR || rc == VK_SUBOPTIMAL_KHR)
+		stale_ = true;
+	else if (rc != VK_SUCCESS)
+		return false;
+
+	return true;
+}
+
+bool vulkan::dispatch()
+{
+	int w;
+	int h;
+
+	glfwPollEvents();
+	reap();
+	glfwGetFramebufferSize(win_, &w, &h);
+	if ((uint32_t) w != extent_.width || (uint32_t) h != extent_.height)
+		stale_ = true;
+
+	return !glfwWindowShouldClose(win_);
+}
+
+bool vulkan::hidden()
+{
+	return glfwGetWindowAttrib(win_, GLFW_ICONIFIED) ||
+	 !glfwGetWindowAttrib(win_, GLFW_VISIBLE);
+}
+
+bool vulkan::init(const char *title, uint16_t w, uint16_t h)
+{
+	VkApplicationInfo app;
+	VkInstanceCreateInfo info;
+	VkCommandBufferAllocateInfo alloc;
+	VkSemaphoreCreateInfo sem;
+	uint32_t ext_cnt = 0;
+	const char **ext;
+
+	if (!glfwInit() || !glfwVulkanSupported()) {
+		ee("vulkan is not supported by glfw\n");
+		return false;
+	}
+
+	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+	if (!(win_ = glfwCreateWindow(w, h, title, NULL, NULL)))
+		return false;
+
+	glfwSetKeyCallback(win_, key_cb);
+	ext = glfwGetRequiredInstanceExtensions(&ext_cnt);
+
+	memset(&app, 0, sizeof(app));
+	app.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+	app.pApplicationName = "camview";
+	app.apiVersion = VK_API_VERSION_1_2;
+
+	memset(&info, 0, sizeof(info));
+	info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	info.pApplicationInfo = &app;
+	info.enabledExtensionCount = ext_cnt;
+	info.ppEnabledExtensionNames = ext;
+
+	if (vkCreateInstance(&info, NULL, &inst_) != VK_SUCCESS) {
+		ee("vkCreateInstance failed\n");
+		return false;
+	} else if (glfwCreateWindowSurface(inst_, win_, NULL, &surf_) !=
+	 VK_SUCCESS) {
+		ee("glfwCreateWindowSurface failed\n");
+		return false;
+	} else if (!pick_gpu() || !make_device() || !make_swapchain()) {
+		return false;
+	}
+
+	memset(&alloc, 0, sizeof(alloc));
+	alloc.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	alloc.commandPool = pool_;
+	alloc.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	alloc.commandBufferCount = 1;
+
+	memset(&sem, 0, sizeof(sem));
+	sem.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+	for (uint8_t i = 0; i < VK_RING; ++i) {
+		if (vkAllocateCommandBuffers(dev_, &alloc, &ring_[i].cmd) !=
+		 VK_SUCCESS || vkCreateSemaphore(dev_, &sem, NULL,
+		 &ring_[i].acquired) != VK_SUCCESS)
+			return false;
+	}
+
+	return true;
+}
+
+vulkan::~vulkan()
+{
+	if (dev_) {
+		vkDeviceWaitIdle(dev_);
+
+		for (uint8_t i = 0; i < VK_RING; ++i) {
+			drop_slot(&ring_[i]);
+			if (ring_[i].acquired)
+				vkDestroySemaphore(dev_, ring_[i].acquired, NULL);
+		}
+
+		drop_swapchain();
+		if (timeline_)
+			vkDestroySemaphore(dev_, timeline_, NULL);
+		if (pool_)
+			vkDestroyCommandPool(dev_, pool_, NULL);
+
+		vkDestroyDevice(dev_, NULL);
+		ii("vulkan: %llu frames submitted, %u staging ring waits\n",
+		 (unsigned long long) value_, ring_waits_);
+	}
+
+	if (surf_)
+		vkDestroySurfaceKHR(inst_, surf_, NULL);
+	if (inst_)
+		vkDestroyInstance(inst_, NULL);
+	if (win_)
+		glfwDestroyWindow(win_);
+
+	glfwTerminate();
+}
+
+backend_ptr create_vulkan(const char *title, uint16_t w, uint16_t h)
+{
+	vulkan *out = new vulkan();
+
+	if (!out->init(title, w, h)) {
+		delete out;
+		return nullptr;
+	}
+
+	return backend_ptr(out);
+}
+
+} // namespace display
@@ -0,0 +1,201 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "watchdog.h"
+#include "timebase.h"
+#include "log.h"
+
+namespace stats {
+
+static constexpr uint8_t STALL_INTERVALS = 6; /* frame intervals */
+static constexpr uint64_t STALL_MIN_NS = 250000000;
+static constexpr uint8_t STACK_FRAMES = 24;
+
+static const char *names_[STAGES] = {
+	"capture",
+	"decode",
+	"upload",
+	"swap",
+};
+
+/* Filled by stalled thread itself in signal handler, one dump at a time */
+static void *stack_[STACK_FRAMES];
+static std::atomic<int> stack_cnt_;
+
+static void on_dump(int)
+{
+	stack_cnt_.store(backtrace(stack_, STACK_FRAMES),
+	 std::memory_order_release);
+}
+
+static int dump_signal()
+{
+	return SIGRTMIN + 1;
+}
+
+bool watchdog::start(uint8_t fps)
+{
+	struct sigaction sa;
+
+	if (thread_.joinable())
+		return true;
+
+	deadline_ns_ = STALL_INTERVALS * 1000000000ULL / (fps ? fps : 30);
+	if (deadline_ns_ < STALL_MIN_NS)
+		deadline_ns_ = STALL_MIN_NS;
+
+	backtrace(stack_, 1); /* loads unwinder now, not in signal handler */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_dump;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(dump_signal(), &sa, NULL) < 0)
+		ww("no stall backtraces, errno %d\n", errno);
+
+	quit_ = false;
+	thread_ = std::thread(&watchdog::run, this);
+	return true;
+}
+
+void watchdog::stop()
+{
+	if (!thread_.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		quit_ = true;
+	}
+
+	wake_.notify_one();
+	thread_.join();
+}
+
+void watchdog::enter(enum stage s)
+{
+	struct state *st = &stages_[s];
+
+	if (st->since.load(std::memory_order_relaxed))
+		return;
+	else if (!st->tid.load(std::memory_order_relaxed))
+		st->tid.store(syscall(SYS_gettid), std::memory_order_relaxed);
+
+	st->since.store(timebase::now(), std::memory_order_relaxed);
+}
+
+void watchdog::leave(enum stage s)
+{
+	struct state *st = &stages_[s];
+
+	st->left.store(timebase::now(), std::memory_order_relaxed);
+	st->since.store(0, std::memory_order_release);
+}
+
+void watchdog::suspend(bool on)
+{
+	if (!on) /* time spent suspended does not count */
+		resumed_ns_.store(timebase::now(), std::memory_order_relaxed);
+
+	suspended_.store(on, std::memory_order_relaxed);
+}
+
+/* Ask stalled thread to unwind its own stack and log it from here */
+void watchdog::dump(int tid)
+{
+	char **syms;
+	int cnt = -1;
+
+	stack_cnt_.store(-1);
+	if (!tid || syscall(SYS_tgkill, getpid(), tid, dump_signal()) < 0)
+		return;
+
+	for (uint8_t i = 0; i < 50 && cnt < 0; ++i) {
+		usleep(1000);
+		cnt = stack_cnt_.load(std::memory_order_acquire);
+	}
+
+	if (cnt <= 0 || !(syms = backtrace_symbols(stack_, cnt)))
+		return;
+
+	/* first two are handler and signal trampoline */
+	for (int i = 2; i < cnt && logger::enabled(LOG_WARN); ++i)
+		logger::write("(ww)   #%d %s\n", i - 2, syms[i]);
+
+	free(syms);
+}
+
+void watchdog::check(enum stage s, uint64_t now)
+{
+	struct state *st = &stages_[s];
+	uint64_t since = st->since.load(std::memory_order_acquire);
+	uint64_t from;
+	uint64_t ns;
+
+	if (st->stalled && since != st->stalled) { /* left or entered again */
+		ns = st->left.load(std::memory_order_relaxed) - st->stalled;
+		if (ns > st->longest_ns)
+			st->longest_ns = ns;
+
+		ww("%s stage recovered after %llu ms\n", names_[s],
+		 (unsigned long long) (ns / 1000000));
+		st->stalled = 0;
+	}
+
+	from = resumed_ns_.load(std::memory_order_relaxed);
+	if (since > from)
+		from = since;
+
+	if (!since || st->stalled || suspended_.load(std::memory_order_relaxed))
+		return;
+	else if (now < from + deadline_ns_)
+		return;
+
+	st->stalled = since;
+	st->stalls.fetch_add(1, std::memory_order_relaxed);
+	ee("%s stage stalled for %llu ms, deadline %llu ms, thread %d\n",
+	 names_[s], (unsigned long long) ((now - from) / 1000000),
+	 (unsigned long long) (deadline_ns_ / 1000000), st->tid.load());
+	dump(st->tid.load());
+}
+
+void watchdog::run()
+{
+	std::unique_lock<std::mutex> lock(lock_);
+	std::chrono::nanoseconds period(deadline_ns_ / 4);
+
+	pthread_setname_np(pthread_self(), "watchdog");
+	while (!wake_.wait_for(lock, period, [this] { return quit_; })) {
+		uint64_t now = timebase::now();
+
+		for (uint8_t i = 0; i < STAGES; ++i)
+			check((enum stage) i, now);
+	}
+}
+
+void watchdog::report() const
+{
+	for (uint8_t i = 0; i < STAGES; ++i) {
+		const struct state *st = &stages_[i];
+
+		if (!st->stalls.load())
+			continue;
+
+		ww("%s stage stalled %u times, longest %llu ms\n", names_[i],
+		 st->stalls.load(), (unsigned long long) (st->longest_ns /
+		 1000000));
+	}
+}
+
+} // namespace stats
@@ -0,0 +1,67 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace stats {
+
+enum stage : uint8_t {
+	STAGE_CAPTURE, /* waiting for and dequeuing frame */
+	STAGE_DECODE,
+	STAGE_UPLOAD,
+	STAGE_SWAP, /* or present on other backends */
+	STAGES,
+};
+
+/* Pipeline threads mark entering and leaving each stage, two relaxed
+ * stores. Watchdog thread flags a stage which stays entered past its
+ * deadline of a few frame intervals, logs backtrace of the thread stuck
+ * in it and how long it took to recover, and counts stalls per stage.
+ * Entering again before leaving keeps original time, so capture retrying
+ * after timeouts still counts as one wait.
+ */
+class watchdog {
+public:
+	~watchdog() { stop(); }
+	bool start(uint8_t fps);
+	void stop();
+	void enter(enum stage s);
+	void leave(enum stage s);
+	void suspend(bool on); /* stream off or display frozen on purpose */
+	uint32_t stalls(enum stage s) const { return stages_[s].stalls.load(); }
+	void report() const;
+private:
+	struct state {
+		std::atomic<uint64_t> since; /* entered at, 0 when outside */
+		std::atomic<uint64_t> left;
+		std::atomic<int> tid;
+		std::atomic<uint32_t> stalls; /* read by stats page */
+		uint64_t stalled; /* since value of stall being tracked */
+		uint64_t longest_ns;
+	};
+	void run();
+	void check(enum stage s, uint64_t now);
+	void dump(int tid);
+	struct state stages_[STAGES] = {};
+	uint64_t deadline_ns_ = 0;
+	std::atomic<bool> suspended_{false};
+	std::atomic<uint64_t> resumed_ns_{0};
+	std::thread thread_;
+	std::mutex lock_;
+	std::condition_variable wake_;
+	bool quit_ = false;
+};
+
+}
+
+#endif // WATCHDOG_H
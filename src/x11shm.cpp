@@ -0,0 +1,317 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XShm.h>
+
+#include "camera.h"
+#include "display.h"
+#include "timebase.h"
+#include "log.h"
+
+namespace display {
+
+static constexpr uint8_t SHM_IMAGES = 2;
+
+struct shm_image {
+	XImage *img;
+	XShmSegmentInfo shm;
+	bool busy; /* server has not completed XShmPutImage yet */
+	uint64_t capture_ns;
+};
+
+/* Frames are scaled on CPU straight into shared memory images and only
+ * the picture rectangle is sent to the server, borders are repainted on
+ * resize alone.
+ */
+class x11shm : public backend {
+public:
+	~x11shm();
+	bool init(const char *title, uint16_t w, uint16_t h);
+	bool present(const struct camera::slot *) override;
+	bool dispatch() override;
+	void wait() override;
+	bool hidden() override { return !mapped_; }
+private:
+	bool alloc_images();
+	void free_images();
+	Display *dpy_ = nullptr;
+	Window win_ = 0;
+	GC gc_ = 0;
+	Visual *visual_ = nullptr;
+	int depth_ = 0;
+	int completion_ = 0;
+	Atom wm_delete_ = 0;
+	struct shm_image images_[SHM_IMAGES] = {};
+	uint16_t win_w_ = 0;
+	uint16_t win_h_ = 0;
+	uint16_t img_w_ = 0; /* allocated image size */
+	uint16_t img_h_ = 0;
+	bool mapped_ = false;
+	bool damaged_ = true;
+	uint32_t busy_drops_ = 0;
+	scaler scaler_;
+};
+
+x11shm::~x11shm()
+{
+	if (!dpy_)
+		return;
+
+	free_images();
+	if (gc_)
+		XFreeGC(dpy_, gc_);
+	if (win_)
+		XDestroyWindow(dpy_, win_);
+
+	XCloseDisplay(dpy_);
+	latency.report("capture-to-server");
+	if (busy_drops_)
+		ii("%u frames dropped waiting for X server\n", busy_drops_);
+}
+
+void x11shm::free_images()
+{
+	for (uint8_t i = 0; i < SHM_IMAGES; ++i) {
+		struct shm_image *s = &images_[i];
+
+		if (!s->img)
+			continue;
+
+		XShmDetach(dpy_, &s->shm);
+		XDestroyImage(s->img);
+		shmdt(s->shm.shmaddr);
+		s->img = nullptr;
+	}
+
+	XSync(dpy_, False);
+	img_w_ = img_h_ = 0;
+}
+
+bool x11shm::alloc_images()
+{
+	free_images();
+	memset(images_, 0, sizeof(images_));
+
+	for (uint8_t i = 0; i < SHM_IMAGES; ++i) {
+		struct shm_image *s = &images_[i];
+
+		s->img = XShmCreateImage(dpy_, visual_, depth_, ZPixmap, NULL,
+		 &s->shm, win_w_, win_h_);
+		if (!s->img) {
+			ee("XShmCreateImage %ux%u failed\n", win_w_, win_h_);
+			return false;
+		}
+
+		s->shm.shmid = shmget(IPC_PRIVATE, s->img->bytes_per_line *
+		 s->img->height, IPC_CREAT | 0600);
+		if (s->shm.shmid < 0) {
+			ee("shmget failed\n");
+			XDestroyImage(s->img);
+			s->img = nullptr;
+			return false;
+		}
+
+		s->shm.shmaddr = s->img->data = (char *) shmat(s->shm.shmid,
+		 NULL, 0);
+		s->shm.readOnly = False;
+		XShmAttach(dpy_, &s->shm);
+		XSync(dpy_, False);
+		shmctl(s->shm.shmid, IPC_RMID, NULL); /* gone once detached */
+	}
+
+	img_w_ = win_w_;
+	img_h_ = win_h_;
+	return true;
+}
+
+bool x11shm::init(const char *title, uint16_t w, uint16_t h)
+{
+	XVisualInfo info;
+	XSetWindowAttributes attr;
+
+	if (!(dpy_ = XOpenDisplay(NULL))) {
+		ee("failed to open X display\n");
+		return false;
+	} else if (!XShmQueryExtension(dpy_)) {
+		ee("X server has no MIT-SHM extension\n");
+		return false;
+	}
+
+	int screen = DefaultScreen(dpy_);
+	if (!XMatchVisualInfo(dpy_, screen, 24, TrueColor, &info) ||
+	 info.red_mask != 0xff0000 || info.blue_mask != 0xff) {
+		ee("no 24-bit XRGB visual\n");
+		return false;
+	}
+
+	visual_ = info.visual;
+	depth_ = info.depth;
+	completion_ = XShmGetEventBase(dpy_) + ShmCompletion;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.background_pixel = BlackPixel(dpy_, screen);
+	attr.colormap = XCreateColormap(dpy_, RootWindow(dpy_, screen),
+	 visual_, AllocNone);
+	attr.event_mask = ExposureMask | StructureNotifyMask | KeyPressMask |
+	 VisibilityChangeMask;
+
+	win_ = XCreateWindow(dpy_, RootWindow(dpy_, screen), 0, 0, w, h, 0,
+	 depth_, InputOutput, visual_, CWBackPixel | CWColormap | CWEventMask,
+	 &attr);
+	XStoreName(dpy_, win_, title);
+	wm_delete_ = XInternAtom(dpy_, "WM_DELETE_WINDOW", False);
+	XSetWMProtocols(dpy_, win_, &wm_delete_, 1);
+	gc_ = XCreateGC(dpy_, win_, 0, NULL);
+	XMapWindow(dpy_, win_);
+
+	win_w_ = w;
+	win_h_ = h;
+	return alloc_images();
+}
+
+bool x11shm::dispatch()
+{
+	XEvent ev;
+
+	while (XPending(dpy_)) {
+		XNextEvent(dpy_, &ev);
+
+		if (ev.type == completion_) {
+			Drawable d = ((XShmCompletionEvent *) &ev)->drawable;
+			ShmSeg seg = ((XShmCompletionEvent *) &ev)->shmseg;
+
+			for (uint8_t i = 0; i < SHM_IMAGES && d == win_; ++i) {
+				if (!images_[i].img || images_[i].shm.shmseg != seg)
+					continue;
+
+				/* server copied pixels, compositor may add more */
+				images_[i].busy = false;
+				presented(images_[i].capture_ns, timebase::now());
+			}
+
+			continue;
+		}
+
+		switch (ev.type) {
+		case Expose:
+			damaged_ = true;
+			break;
+		case ConfigureNotify:
+			if (ev.xconfigure.width != win_w_ ||
+			 ev.xconfigure.height != win_h_) {
+				win_w_ = ev.xconfigure.width;
+				win_h_ = ev.xconfigure.height;
+				damaged_ = true;
+			}
+			break;
+		case MapNotify:
+			mapped_ = true;
+			damaged_ = true;
+			break;
+		case UnmapNotify:
+			mapped_ = false;
+			break;
+		case VisibilityNotify:
+			mapped_ = ev.xvisibility.state != VisibilityFullyObscured;
+			break;
+		case KeyPress: {
+			KeySym sym = XLookupKeysym(&ev.xkey, 0);
+
+			if (sym == XK_Escape || sym == XK_q)
+				return false;
+			else if (sym == XK_f && scaler_.w && scaler_.h)
+				XResizeWindow(dpy_, win_, scaler_.w, scaler_.h);
+			break;
+		}
+		case ClientMessage:
+			if ((Atom) ev.xclient.data.l[0] == wm_delete_)
+				return false;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return true;
+}
+
+void x11shm::wait()
+{
+	struct pollfd fds;
+
+	XFlush(dpy_);
+	if (XPending(dpy_))
+		return;
+
+	fds.fd = ConnectionNumber(dpy_);
+	fds.events = POLLIN;
+	poll(&fds, 1, -1);
+}
+
+bool x11shm::present(const struct camera::slot *s)
+{
+	struct shm_image *out = nullptr;
+
+	if (!mapped_ || !s->w || !s->h)
+		return true;
+
+	if ((win_w_ != img_w_ || win_h_ != img_h_) && !alloc_images())
+		return false;
+
+	if (scaler_.fit(s->w, s->h, win_w_, win_h_))
+		damaged_ = true;
+
+	for (uint8_t i = 0; i < SHM_IMAGES; ++i) {
+		if (!images_[i].busy) {
+			out = &images_[i];
+			break;
+		}
+	}
+
+	if (!out) { /* never stall capture on a slow server */
+		busy_drops_++;
+		return true;
+	}
+
+	/* anchor to bottom left corner like glViewport() does */
+	int y = win_h_ - scaler_.h;
+
+	if (damaged_) {
+		XClearWindow(dpy_, win_);
+		damaged_ = false;
+	}
+
+	scaler_.run(s->data, (uint8_t *) out->img->data,
+	 out->img->bytes_per_line);
+	XShmPutImage(dpy_, win_, gc_, out->img, 0, 0, 0, y, scaler_.w,
+	 scaler_.h, True);
+	out->busy = true;
+	out->capture_ns = capture_ns(s);
+	XFlush(dpy_);
+	return true;
+}
+
+backend_ptr create_x11shm(const char *title, uint16_t w, uint16_t h)
+{
+	x11shm *out = new x11shm();
+
+	if (!out->init(title, w, h)) {
+		delete out;
+		return nullptr;
+	}
+
+	return backend_ptr(out);
+}
+
+} // namespace display
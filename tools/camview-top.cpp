@@ -0,0 +1,248 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "statpage.h"
+
+/* Live view of every running camview, read from their stats pages. Pages
+ * stay mapped between refreshes and are only copied, so viewers never
+ * notice being watched.
+ */
+
+namespace {
+
+static constexpr uint8_t MAX_INSTANCES = 64;
+
+struct instance {
+	uint32_t pid;
+	const struct stats::page *map;
+	struct stats::page cur;
+	struct stats::page prev;
+	bool have_prev;
+	bool seen; /* page still there this round */
+};
+
+static struct instance instances_[MAX_INSTANCES];
+static uint8_t cnt_;
+
+static struct instance *find_instance(uint32_t pid)
+{
+	struct instance *in;
+	char path[64];
+	void *mem;
+	int fd;
+
+	for (uint8_t i = 0; i < cnt_; ++i) {
+		if (instances_[i].pid == pid)
+			return &instances_[i];
+	}
+
+	if (cnt_ == MAX_INSTANCES)
+		return nullptr;
+
+	snprintf(path, sizeof(path), "%s/%s%u", stats::PAGE_DIR,
+	 stats::PAGE_PREFIX, pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return nullptr;
+
+	mem = mmap(NULL, sizeof(stats::page), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return nullptr;
+
+	in = &instances_[cnt_++];
+	memset(in, 0, sizeof(*in));
+	in->pid = pid;
+	in->map = (const struct stats::page *) mem;
+	return in;
+}
+
+static void drop_instance(uint8_t i)
+{
+	munmap((void *) instances_[i].map, sizeof(stats::page));
+	instances_[i] = instances_[--cnt_];
+}
+
+/* Map pages of new instances, forget those which are gone */
+static void scan()
+{
+	DIR *dir = opendir(stats::PAGE_DIR);
+	size_t len = strlen(stats::PAGE_PREFIX);
+	struct instance *in;
+	struct dirent *e;
+	uint32_t pid;
+
+	for (uint8_t i = 0; i < cnt_; ++i)
+		instances_[i].seen = false;
+
+	while (dir && (e = readdir(dir))) {
+		if (strncmp(e->d_name, stats::PAGE_PREFIX, len) != 0)
+			continue;
+		else if (!(pid = atoi(e->d_name + len)))
+			continue;
+		else if (kill(pid, 0) < 0 && errno != EPERM) /* stale page */
+			continue;
+		else if ((in = find_instance(pid)))
+			in->seen = true;
+	}
+
+	if (dir)
+		closedir(dir);
+
+	for (uint8_t i = 0; i < cnt_;) {
+		if (!instances_[i].seen)
+			drop_instance(i);
+		else
+			++i;
+	}
+}
+
+static float rate(uint64_t cur, uint64_t prev, float sec)
+{
+	return sec > 0 ? (cur - prev) / sec : 0;
+}
+
+static uint64_t thread_cpu_ns(const struct stats::page *p, uint32_t tid)
+{
+	for (uint8_t i = 0; i < p->threads_cnt; ++i) {
+		if (p->threads[i].tid == tid)
+			return p->threads[i].cpu_ns;
+	}
+
+	return UINT64_MAX;
+}
+
+static void print_instance(struct instance *in)
+{
+	const struct stats::page *c = &in->cur;
+	const struct stats::page *p = &in->prev;
+	float sec = in->have_prev ? (c->update_ns - p->update_ns) * 1e-9 : 0;
+	float total = 0;
+	char size[16];
+	char threads[256];
+	uint64_t prev_ns;
+	uint32_t stalls = 0;
+	size_t len = 0;
+	float pct;
+
+	threads[0] = '\0';
+	for (uint8_t i = 0; i < c->threads_cnt && sec > 0; ++i) {
+		prev_ns = thread_cpu_ns(p, c->threads[i].tid);
+		if (prev_ns == UINT64_MAX || c->threads[i].cpu_ns < prev_ns)
+			continue;
+
+		pct = (c->threads[i].cpu_ns - prev_ns) * 1e-7 / sec;
+		total += pct;
+		if (len < sizeof(threads)) {
+			len += snprintf(threads + len, sizeof(threads) - len,
+			 " %s:%u %.1f%%", c->threads[i].name,
+			 c->threads[i].tid, pct);
+		}
+	}
+
+	for (uint8_t i = 0; i < 4; ++i)
+		stalls += c->stalls[i];
+
+	snprintf(size, sizeof(size), "%ux%u", c->w, c->h);
+	printf("%-7u %-20.20s %-10s %-5s %6.1f %6.1f %6.1f %7llu %5u/%-5u"
+	 " %2u/%-2u %2u/%-2u %6u %6.1f\n", c->pid, c->dev, size, c->fmt,
+	 rate(c->captured, p->captured, sec),
+	 rate(c->decoded, p->decoded, sec),
+	 rate(c->shown, p->shown, sec),
+	 (unsigned long long) (c->dropped + c->reclaimed),
+	 c->latency_us[0] / 1000, c->latency_us[2] / 1000,
+	 c->raw_queued, c->raw_busy, c->pool_queued, c->pool_busy, stalls,
+	 total);
+	if (threads[0])
+		printf("        \033[2m%s\033[0m\n", threads);
+}
+
+static void refresh(bool clear)
+{
+	struct instance *in;
+
+	scan();
+	if (clear)
+		printf("\033[H\033[2J");
+
+	printf("%-7s %-20s %-10s %-5s %6s %6s %6s %7s %11s %5s %5s %6s %6s\n",
+	 "PID", "DEVICE", "SIZE", "FMT", "CAP/s", "DEC/s", "SHOW/s", "DROPS",
+	 "LAT p50/p99", "RAW", "POOL", "STALLS", "CPU%");
+
+	for (uint8_t i = 0; i < cnt_; ++i) {
+		in = &instances_[i];
+		if (!stats::read_page(in->map, &in->cur))
+			continue;
+
+		print_instance(in);
+		in->prev = in->cur;
+		in->have_prev = true;
+	}
+
+	fflush(stdout);
+}
+
+static void help(const char *name)
+{
+	printf("Usage: %s <options>\n"
+	 "Options:\n"
+	 "\033[2m"
+	 " -i, --interval <ms> refresh period, default 1000\n"
+	 " -n, --count <num>   exit after this many refreshes\n"
+	 " -b, --batch         no screen clearing, for logs and pipes\n"
+	 "\033[0m"
+	 "Latency is in ms, RAW and POOL show queued/busy frames, STALLS\n"
+	 "counts pipeline stages which missed watchdog deadline.\n", name);
+}
+
+static int opt(const char *arg, const char *args, const char *argl)
+{
+	return (strcmp(arg, args) == 0 || strcmp(arg, argl) == 0);
+}
+
+} /* namespace */
+
+int main(int argc, const char *argv[])
+{
+	uint32_t interval_ms = 1000;
+	uint32_t count = 0;
+	bool batch = false;
+
+	for (int i = 1; i < argc; ++i) {
+		if (opt(argv[i], "-i", "--interval") && i + 1 < argc) {
+			interval_ms = atoi(argv[++i]);
+		} else if (opt(argv[i], "-n", "--count") && i + 1 < argc) {
+			count = atoi(argv[++i]);
+		} else if (opt(argv[i], "-b", "--batch")) {
+			batch = true;
+		} else {
+			help(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!interval_ms)
+		interval_ms = 1000;
+
+	for (uint32_t n = 1; ; ++n) {
+		refresh(!batch);
+		if (count && n >= count)
+			break;
+
+		usleep(interval_ms * 1000);
+	}
+
+	return 0;
+}
@@ -0,0 +1,140 @@
+/* Copyright (C) 2022 Aliaksei Katovich. All rights reserved.
+ *
+ * This source code is licensed under the BSD Zero Clause License found in
+ * the 0BSD file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "format.h"
+#include "jpeg.h"
+#include "stats.h"
+#include "timebase.h"
+
+/* Single thread throughput of recorder's JPEG encoder on synthetic frames
+ * of every raw layout it takes. Picture is smooth gradient with some noise,
+ * so entropy coding does about as much work as on camera frames.
+ */
+
+namespace {
+
+static const uint32_t fourccs_[] = {
+	V4L2_PIX_FMT_NV12,
+	V4L2_PIX_FMT_YUYV,
+	V4L2_PIX_FMT_RGB24,
+};
+
+static void fill(uint8_t *data, uint32_t bytes, uint32_t stride)
+{
+	uint32_t seed = 1;
+
+	for (uint32_t i = 0; i < bytes; ++i) {
+		uint32_t x = i % stride;
+		uint32_t y = i / stride;
+
+		seed = seed * 1103515245 + 12345;
+		data[i] = (x / 4 + y / 3 + ((seed >> 16) & 0xf)) & 0xff;
+	}
+}
+
+static bool bench(uint32_t fourcc, uint16_t w, uint16_t h, uint8_t quality,
+ uint32_t frames)
+{
+	static struct camera::slot s;
+	const struct camera::format *f = camera::find_format(fourcc);
+	camera::jpeg_encoder jpeg(quality);
+	stats::histogram us;
+	const uint8_t *out;
+	uint64_t bytes = 0;
+	uint32_t len;
+
+	s.w = w;
+	s.h = h;
+	s.fmt = fourcc;
+	s.stride = line_bytes(*f, w);
+	s.bytes = plane_bytes(*f, s.stride, h);
+	if (!(s.data = (uint8_t *) malloc(s.bytes))) {
+		fprintf(stderr, "failed to allocate %u bytes\n", s.bytes);
+		return false;
+	}
+
+	fill(s.data, s.bytes, s.stride);
+	jpeg.encode(&s, &out); /* warm up scratch and output buffers */
+
+	for (uint32_t i = 0; i < frames; ++i) {
+		uint64_t start = timebase::now();
+
+		if (!(len = jpeg.encode(&s, &out))) {
+			fprintf(stderr, "failed to encode %s frame\n", f->name);
+			free(s.data);
+			return false;
+		}
+
+		us.add((timebase::now() - start) / 1000);
+		bytes += len;
+	}
+
+	printf("%-5s %ux%u q%u: mean %.2f ms, p50 %.2f ms, p99 %.2f ms, "
+	 "%llu KiB/frame, %.1f fps\n", f->name, w, h, quality,
+	 us.mean() / 1e3, us.percentile(50) / 1e3, us.percentile(99) / 1e3,
+	 (unsigned long long) bytes / frames >> 10,
+	 us.mean() ? 1e6 / us.mean() : 0.);
+	free(s.data);
+	return true;
+}
+
+static void help(const char *name)
+{
+	printf("Usage: %s <options>\n"
+	 "Options:\n"
+	 "\033[2m"
+	 " -s, --size <WxH>    frame size, default 1920x1080\n"
+	 " -q, --quality <num> jpeg quality 1..100, default 85\n"
+	 " -n, --frames <num>  frames per format, default 100\n"
+	 "\033[0m", name);
+}
+
+static int opt(const char *arg, const char *args, const char *argl)
+{
+	return (strcmp(arg, args) == 0 || strcmp(arg, argl) == 0);
+}
+
+} /* namespace */
+
+int main(int argc, const char *argv[])
+{
+	unsigned int w = 1920;
+	unsigned int h = 1080;
+	int quality = 85;
+	int frames = 100;
+
+	for (int i = 1; i < argc; ++i) {
+		if (opt(argv[i], "-s", "--size") && i + 1 < argc) {
+			if (sscanf(argv[++i], "%ux%u", &w, &h) != 2)
+				w = h = 0;
+		} else if (opt(argv[i], "-q", "--quality") && i + 1 < argc) {
+			quality = atoi(argv[++i]);
+		} else if (opt(argv[i], "-n", "--frames") && i + 1 < argc) {
+			frames = atoi(argv[++i]);
+		} else {
+			help(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!w || !h || w > UINT16_MAX || h > UINT16_MAX || (w | h) & 1 ||
+	 quality < 1 || quality > 100 || frames < 1) {
+		help(argv[0]);
+		return 1;
+	}
+
+	timebase::init();
+	for (uint8_t i = 0; i < sizeof(fourccs_) / sizeof(fourccs_[0]); ++i) {
+		if (!bench(fourccs_[i], w, h, quality, frames))
+			return 1;
+	}
+
+	return 0;
+}